@@ -23,14 +23,417 @@
 */
 #include <iostream>
 #include <string>
+#include <cstring>
+#include <sstream>
 #include "straw.h"
 using namespace std;
 
+// the intervals of a BEDPE file, or of standard input for "-"
+static vector<bedpeInterval> readBedpeFile(const string &name) {
+    if (name == "-") {
+        return readBedpe(cin);
+    }
+    ifstream bedpe(name);
+    if (!bedpe) {
+        cerr << "File " << name << " cannot be opened for reading" << endl;
+        exit(4);
+    }
+    return readBedpe(bedpe);
+}
+
+static void printBedpeUsage() {
+    cerr << "Usage: straw bedpe [--output records/sum/dense] [--threads N] [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <BEDPE file or -> <BP/FRAG> <binsize>" << endl;
+}
+
+// straw bedpe: extracts every interval of a BEDPE file. each output line starts with the interval's line number
+// among the intervals (from 0); lines come out as intervals finish, not in file order
+static int runBedpe(int argc, char *argv[]) {
+    string output = "records";
+    int32_t threads = 0;
+    int arg = 2;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--output" && arg + 1 < argc) {
+            output = argv[arg + 1];
+        } else if (option == "--threads" && arg + 1 < argc) {
+            threads = stoi(argv[arg + 1]);
+        } else {
+            printBedpeUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    int remaining = argc - arg;
+    if (remaining != 5 && remaining != 6) {
+        cerr << "Incorrect arguments" << endl;
+        printBedpeUsage();
+        exit(1);
+    }
+    string matrixType = "observed";
+    if (remaining == 6) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string bedpeName = argv[arg + 2];
+    string unit = argv[arg + 3];
+    int32_t binsize = stoi(argv[arg + 4]);
+
+    vector<bedpeInterval> intervals = readBedpeFile(bedpeName);
+    strawBedpe(matrixType, norm, fname, unit, binsize, intervals, output, threads,
+               [&output](const bedpeResult &result) {
+        if (output == "records") {
+            for (const contactRecord &record : result.records) {
+                printf("%zu\t%d\t%d\t%.14g\n", result.index, record.binX, record.binY, record.counts);
+            }
+        } else if (output == "sum") {
+            printf("%zu\t%.14g\n", result.index, result.sum);
+        } else {
+            printf("%zu\t%lld\t%lld", result.index, (long long) result.numRows, (long long) result.numCols);
+            for (float value : result.matrix) {
+                printf("\t%.14g", value);
+            }
+            printf("\n");
+        }
+    });
+    return 0;
+}
+
+static void printApaUsage() {
+    cerr << "Usage: straw apa [--window N] [--normalize none/sum] [--threads N] [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <BEDPE file or -> <BP/FRAG> <binsize>" << endl;
+}
+
+// straw apa: aggregate peak analysis around the loops of a BEDPE file, anchored at the middle of each interval.
+// prints the (2 * window + 1) square pileup, one row per line
+static int runApa(int argc, char *argv[]) {
+    int32_t window = 10;
+    string normalization = "none";
+    int32_t threads = 0;
+    int arg = 2;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--window" && arg + 1 < argc) {
+            window = stoi(argv[arg + 1]);
+        } else if (option == "--normalize" && arg + 1 < argc) {
+            normalization = argv[arg + 1];
+        } else if (option == "--threads" && arg + 1 < argc) {
+            threads = stoi(argv[arg + 1]);
+        } else {
+            printApaUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    int remaining = argc - arg;
+    if (remaining != 5 && remaining != 6) {
+        cerr << "Incorrect arguments" << endl;
+        printApaUsage();
+        exit(1);
+    }
+    string matrixType = "observed";
+    if (remaining == 6) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string bedpeName = argv[arg + 2];
+    string unit = argv[arg + 3];
+    int32_t binsize = stoi(argv[arg + 4]);
+
+    vector<apaLocus> loci;
+    for (const bedpeInterval &interval : readBedpeFile(bedpeName)) {
+        loci.push_back({interval.chr1, (interval.start1 + interval.end1) / 2, interval.chr2,
+                        (interval.start2 + interval.end2) / 2});
+    }
+    apaResult pileup = strawApa(matrixType, norm, fname, unit, binsize, loci, window, normalization, threads);
+    cerr << pileup.loci << " of " << loci.size() << " loci in the pileup" << endl;
+    for (int64_t r = 0; r < pileup.width; r++) {
+        for (int64_t c = 0; c < pileup.width; c++) {
+            printf(c == 0 ? "%.14g" : "\t%.14g", pileup.matrix[r * pileup.width + c]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+static void printGenomeUsage() {
+    cerr << "Usage: straw genome [--threads N] [--unordered] [--max-buffer MB] [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <BP/FRAG> <binsize>" << endl;
+}
+
+// straw genome: dumps every chromosome pair of the file, one line per record starting with the two chromosomes.
+// pairs come out in chromosome order unless --unordered, which lets them interleave
+static int runGenome(int argc, char *argv[]) {
+    int32_t threads = 0;
+    bool ordered = true;
+    int64_t maxBufferMB = 256;
+    int arg = 2;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--unordered") {
+            ordered = false;
+            arg += 1;
+            continue;
+        }
+        if (option == "--threads" && arg + 1 < argc) {
+            threads = stoi(argv[arg + 1]);
+        } else if (option == "--max-buffer" && arg + 1 < argc) {
+            maxBufferMB = stoll(argv[arg + 1]);
+        } else {
+            printGenomeUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    int remaining = argc - arg;
+    if (remaining != 4 && remaining != 5) {
+        cerr << "Incorrect arguments" << endl;
+        printGenomeUsage();
+        exit(1);
+    }
+    string matrixType = "observed";
+    if (remaining == 5) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string unit = argv[arg + 2];
+    int32_t binsize = stoi(argv[arg + 3]);
+
+    strawGenome(matrixType, norm, fname, unit, binsize, threads, ordered, maxBufferMB << 20,
+                [](const string &chr1, const string &chr2, const contactColumns &records) {
+        for (size_t i = 0; i < records.counts.size(); i++) {
+            printf("%s\t%d\t%s\t%d\t%.14g\n", chr1.c_str(), records.binX[i], chr2.c_str(), records.binY[i],
+                   records.counts[i]);
+        }
+    });
+    return 0;
+}
+
+static void printViewpointUsage() {
+    cerr << "Usage: straw viewpoint [--threads N] [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <chr>:<position> <all or chr[,chr...]> <BP/FRAG> <binsize>" << endl;
+}
+
+// straw viewpoint: virtual 4C from the bin at chr:position to every bin of the target chromosomes, one line per bin
+// with its chromosome, start and value
+static int runViewpoint(int argc, char *argv[]) {
+    int32_t threads = 0;
+    int arg = 2;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--threads" && arg + 1 < argc) {
+            threads = stoi(argv[arg + 1]);
+        } else {
+            printViewpointUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    int remaining = argc - arg;
+    if (remaining != 6 && remaining != 7) {
+        cerr << "Incorrect arguments" << endl;
+        printViewpointUsage();
+        exit(1);
+    }
+    string matrixType = "observed";
+    if (remaining == 7) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string viewpoint = argv[arg + 2];
+    string targetList = argv[arg + 3];
+    string unit = argv[arg + 4];
+    int32_t binsize = stoi(argv[arg + 5]);
+
+    size_t colon = viewpoint.rfind(':');
+    if (colon == string::npos) {
+        printViewpointUsage();
+        exit(1);
+    }
+    vector<string> targets;
+    if (targetList != "all") {
+        stringstream list(targetList);
+        string target;
+        while (getline(list, target, ',')) {
+            targets.push_back(target);
+        }
+    }
+    vector<viewpointProfile> profiles = strawViewpoint(matrixType, norm, fname, viewpoint.substr(0, colon),
+                                                       stoll(viewpoint.substr(colon + 1)), targets, unit, binsize,
+                                                       threads);
+    for (const viewpointProfile &profile : profiles) {
+        for (size_t b = 0; b < profile.values.size(); b++) {
+            printf("%s\t%lld\t%.14g\n", profile.chr.c_str(), (long long) b * binsize, profile.values[b]);
+        }
+    }
+    return 0;
+}
+
+static void printBandUsage() {
+    cerr << "Usage: straw band [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <chr> <minDistance> <maxDistance> <BP/FRAG> <binsize>" << endl;
+}
+
+// straw band: the contacts of a whole chromosome whose distance from the diagonal is between minDistance and
+// maxDistance inclusive, printed like a straw query
+static int runBand(int argc, char *argv[]) {
+    int remaining = argc - 2;
+    if (remaining != 7 && remaining != 8) {
+        cerr << "Incorrect arguments" << endl;
+        printBandUsage();
+        exit(1);
+    }
+    int arg = 2;
+    string matrixType = "observed";
+    if (remaining == 8) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string chr = argv[arg + 2];
+    int64_t minDistance = stoll(argv[arg + 3]);
+    int64_t maxDistance = stoll(argv[arg + 4]);
+    string unit = argv[arg + 5];
+    int32_t binsize = stoi(argv[arg + 6]);
+    vector<contactRecord> records = strawBand(matrixType, norm, fname, chr, minDistance, maxDistance, unit, binsize);
+    for (const contactRecord &record : records) {
+        printf("%d\t%d\t%.14g\n", record.binX, record.binY, record.counts);
+    }
+    return 0;
+}
+
+static void printExplainUsage() {
+    cerr << "Usage: straw explain [--max-pixels N] [--max-bytes N] [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize or auto>" << endl;
+}
+
+// straw explain: what a straw query would read, without reading any block. with binsize auto the resolution is the
+// one planQuery picks for the --max-pixels and --max-bytes budget
+static int runExplain(int argc, char *argv[]) {
+    int64_t maxPixels = 0;
+    int64_t maxBytes = 0;
+    int arg = 2;
+    while (arg < argc && strncmp(argv[arg], "--", 2) == 0) {
+        string option = argv[arg];
+        if (option == "--max-pixels" && arg + 1 < argc) {
+            maxPixels = stoll(argv[arg + 1]);
+        } else if (option == "--max-bytes" && arg + 1 < argc) {
+            maxBytes = stoll(argv[arg + 1]);
+        } else {
+            printExplainUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    int remaining = argc - arg;
+    if (remaining != 6 && remaining != 7) {
+        cerr << "Incorrect arguments" << endl;
+        printExplainUsage();
+        exit(1);
+    }
+    string matrixType = "observed";
+    if (remaining == 7) {
+        matrixType = argv[arg++];
+    }
+    string norm = argv[arg];
+    string fname = argv[arg + 1];
+    string chr1loc = argv[arg + 2];
+    string chr2loc = argv[arg + 3];
+    string unit = argv[arg + 4];
+    string size = argv[arg + 5];
+
+    int32_t binsize;
+    if (size == "auto") {
+        queryPlan plan = planQuery(fname, chr1loc, chr2loc, unit, maxPixels, maxBytes);
+        if (plan.resolution == 0) {
+            return 1;
+        }
+        for (const zoomEstimate &estimate : plan.considered) {
+            if (!estimate.available) {
+                printf("considered\t%d\tnot in the file\n", estimate.resolution);
+                continue;
+            }
+            printf("considered\t%d\t%lld pixels\t%lld blocks\t%lld bytes\n", estimate.resolution,
+                   (long long) estimate.pixels, (long long) estimate.blocks, (long long) estimate.bytes);
+        }
+        printf("within budget\t%s\n", plan.fits ? "yes" : "no");
+        binsize = plan.resolution;
+    } else {
+        binsize = stoi(size);
+    }
+    queryCost cost = strawExplain(matrixType, norm, fname, chr1loc, chr2loc, unit, binsize);
+    printf("resolution\t%d\n", cost.resolution);
+    printf("blocks\t%lld\n", (long long) cost.blocks);
+    printf("compressed bytes\t%lld\n", (long long) cost.compressedBytes);
+    printf("estimated decompressed bytes\t%lld\n", (long long) cost.estimatedDecompressedBytes);
+    printf("estimated records\t%lld\n", (long long) cost.estimatedRecords);
+    printf("requests\t%lld\n", (long long) cost.requests);
+    printf("coalesced requests\t%lld\n", (long long) cost.coalescedRequests);
+    printf("norm vector bytes\t%lld\n", (long long) cost.normVectorBytes);
+    printf("expected vector bytes\t%lld\n", (long long) cost.expectedVectorBytes);
+    return 0;
+}
+
+static void printServeUsage() {
+    cerr << "Usage: straw serve [--socket PATH] [--max-matrices N] [--block-cache MB] [--max-connections N]" << endl;
+}
+
+// straw serve: answers the straw queries of other processes from files, matrices and blocks it keeps cached, until
+// interrupted. clients find it through STRAW_SOCKET
+static int runServe(int argc, char *argv[]) {
+    string socketPath = defaultServerSocket();
+    serveOptions options;
+    int arg = 2;
+    while (arg < argc) {
+        string option = argv[arg];
+        if (option == "--socket" && arg + 1 < argc) {
+            socketPath = argv[arg + 1];
+        } else if (option == "--max-matrices" && arg + 1 < argc) {
+            options.maxMatrices = stoi(argv[arg + 1]);
+        } else if (option == "--block-cache" && arg + 1 < argc) {
+            options.blockCacheBytes = stoll(argv[arg + 1]) << 20;
+        } else if (option == "--max-connections" && arg + 1 < argc) {
+            options.maxConnections = stoi(argv[arg + 1]);
+        } else {
+            printServeUsage();
+            exit(1);
+        }
+        arg += 2;
+    }
+    return strawServe(socketPath, options);
+}
+
 int main(int argc, char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "bedpe") == 0) {
+        return runBedpe(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "apa") == 0) {
+        return runApa(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "genome") == 0) {
+        return runGenome(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "viewpoint") == 0) {
+        return runViewpoint(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "band") == 0) {
+        return runBand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "explain") == 0) {
+        return runExplain(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return runServe(argc, argv);
+    }
     if (argc != 7 && argc != 8) {
         cerr << "Incorrect arguments" << endl;
         cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>" << endl;
+        printBedpeUsage();
+        printApaUsage();
+        printGenomeUsage();
+        printViewpointUsage();
+        printBandUsage();
+        printExplainUsage();
+        printServeUsage();
         exit(1);
     }
     int offset = 0;
@@ -47,7 +450,12 @@ int main(int argc, char *argv[])
     string size = argv[6 + offset];
     int32_t binsize = stoi(size);
     vector<contactRecord> records;
-    records = straw(matrixType, norm, fname, chr1loc, chr2loc, unit, binsize);
+    try {
+        records = straw(matrixType, norm, fname, chr1loc, chr2loc, unit, binsize);
+    } catch (const serveError &e) {
+        cerr << e.what() << endl;
+        exit(e.status); // as the query would have, had it run here
+    }
     size_t length = records.size();
     for (int i = 0; i < length; i++) {
         printf("%d\t%d\t%.14g\n", records[i].binX, records[i].binY, records[i].counts);
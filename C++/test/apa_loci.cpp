@@ -0,0 +1,121 @@
+/*
+  Checks strawApa on loci given both ways round: every locus's square has to come out with its rows on chr1 of the
+  locus, so a locus and the same locus written with its anchors swapped give transposed squares, and a list mixing
+  both orientations sums to the squares built by hand from getRecords. A query stopped before it starts counts no
+  loci.
+
+  usage: apa_loci <test.hic> [threads]
+ */
+#include <random>
+#include "../straw.cpp"
+
+static const int32_t binsize = 2500000;
+static const int32_t window = 3;
+static const int64_t width = 2 * window + 1;
+
+// the square around one locus, rows on chr1 and columns on chr2, from records read one locus at a time
+static vector<double> expectedTile(HiCFile &hiCFile, const apaLocus &locus) {
+    bool flipped = hiCFile.getChromosome(locus.chr1).index > hiCFile.getChromosome(locus.chr2).index;
+    string stored1 = flipped ? locus.chr2 : locus.chr1, stored2 = flipped ? locus.chr1 : locus.chr2;
+    unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(stored1, stored2, "observed", "NONE", "BP", binsize));
+    int64_t origin1 = locus.pos1 / binsize - window, origin2 = locus.pos2 / binsize - window;
+    int64_t x0 = flipped ? origin2 : origin1, y0 = flipped ? origin1 : origin2;
+    vector<contactRecord> records = mzd->getRecords(x0 * binsize, (x0 + width) * binsize - 1, y0 * binsize,
+                                                    (y0 + width) * binsize - 1);
+    vector<double> tile(static_cast<size_t>(width * width), 0);
+    for (const contactRecord &record : records) {
+        int64_t bin1 = (flipped ? record.binY : record.binX) / binsize;
+        int64_t bin2 = (flipped ? record.binX : record.binY) / binsize;
+        for (int mirror = 0; mirror < (stored1 == stored2 ? 2 : 1); mirror++) {
+            int64_t r = (mirror ? bin2 : bin1) - origin1, c = (mirror ? bin1 : bin2) - origin2;
+            if (r >= 0 && r < width && c >= 0 && c < width && !isnan(record.counts)) {
+                tile[r * width + c] = record.counts;
+            }
+        }
+    }
+    return tile;
+}
+
+static bool sameMatrix(const vector<double> &a, const vector<double> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t c = 0; c < a.size(); c++) {
+        if (fabs(a[c] - b[c]) > 1e-6 * max(1.0, fabs(b[c]))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static vector<double> transposed(const vector<double> &tile) {
+    vector<double> result(tile.size());
+    for (int64_t r = 0; r < width; r++) {
+        for (int64_t c = 0; c < width; c++) {
+            result[c * width + r] = tile[r * width + c];
+        }
+    }
+    return result;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: apa_loci <test.hic> [threads]" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    int32_t threads = argc > 2 ? atoi(argv[2]) : 4;
+    setServerSocket(""); // always read the file in this process
+    HiCFile hiCFile(fileName);
+    const string chromosomes[] = {"1", "2", "3", "X"};
+    mt19937 rng(7);
+    int failures = 0;
+
+    vector<apaLocus> loci;
+    vector<double> mixed(static_cast<size_t>(width * width), 0);
+    for (int i = 0; i < 40; i++) {
+        apaLocus locus;
+        locus.chr1 = chromosomes[rng() % 4];
+        locus.chr2 = chromosomes[rng() % 4];
+        // far enough from the start of the chromosome that the square isn't clipped
+        locus.pos1 = (window + 1) * binsize + rng() % 100000000;
+        locus.pos2 = (window + 1) * binsize + rng() % 100000000;
+        apaLocus swapped = {locus.chr2, locus.pos2, locus.chr1, locus.pos1};
+
+        vector<double> tile = expectedTile(hiCFile, locus);
+        apaResult one = strawApa("observed", "NONE", fileName, "BP", binsize, {locus}, window, "none", threads);
+        apaResult other = strawApa("observed", "NONE", fileName, "BP", binsize, {swapped}, window, "none", threads);
+        if (one.loci != 1 || other.loci != 1 || !sameMatrix(one.matrix, tile) ||
+            !sameMatrix(other.matrix, transposed(tile))) {
+            cerr << "square around " << locus.chr1 << ":" << locus.pos1 << " " << locus.chr2 << ":" << locus.pos2
+                 << " differs between orientations" << endl;
+            failures++;
+        }
+        // the mixed list takes every other locus the other way round
+        loci.push_back(i % 2 == 0 ? locus : swapped);
+        vector<double> expected = i % 2 == 0 ? tile : transposed(tile);
+        for (size_t c = 0; c < mixed.size(); c++) {
+            mixed[c] += expected[c];
+        }
+    }
+
+    apaResult all = strawApa("observed", "NONE", fileName, "BP", binsize, loci, window, "none", threads);
+    if (all.loci != static_cast<int64_t>(loci.size()) || !sameMatrix(all.matrix, mixed)) {
+        cerr << "pileup of loci in mixed orientations differs, " << all.loci << " loci" << endl;
+        failures++;
+    }
+
+    queryControl control;
+    control.cancel();
+    apaResult stopped = strawApa("observed", "NONE", fileName, "BP", binsize, loci, window, "none", threads, &control);
+    if (stopped.loci != 0) {
+        cerr << "a cancelled pileup counted " << stopped.loci << " loci" << endl;
+        failures++;
+    }
+
+    if (failures > 0) {
+        return 1;
+    }
+    cout << "apa loci ok" << endl;
+    return 0;
+}
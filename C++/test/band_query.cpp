@@ -0,0 +1,72 @@
+/*
+  Checks strawBand against straw on the whole chromosome with the records outside the band dropped by hand: bands
+  near and far from the diagonal, one on a single distance, one reaching past the chromosome and one that is empty,
+  observed and normalized. An unknown chromosome gives no records.
+
+  usage: band_query <test.hic>
+ */
+#include "../straw.cpp"
+
+static bool sameRecords(vector<contactRecord> a, vector<contactRecord> b) {
+    auto byBin = [](const contactRecord &x, const contactRecord &y) {
+        return x.binX != y.binX ? x.binX < y.binX : x.binY < y.binY;
+    };
+    sort(a.begin(), a.end(), byBin);
+    sort(b.begin(), b.end(), byBin);
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        bool bothNan = isnan(a[i].counts) && isnan(b[i].counts);
+        if (a[i].binX != b[i].binX || a[i].binY != b[i].binY || (!bothNan && a[i].counts != b[i].counts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: band_query <test.hic>" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    const int32_t binsize = 2500000;
+    setServerSocket(""); // always read the file in this process
+    const int64_t bands[][2] = {{0, 5000000}, {20000000, 60000000}, {7500000, 7500000}, {100000000, 1000000000},
+                                {-5, 2500000}, {30000000, 20000000}};
+    int failures = 0;
+
+    for (const string &chr : {string("1"), string("X")}) {
+        for (const string &norm : {string("NONE"), string("KR")}) {
+            vector<contactRecord> all = straw("observed", norm, fileName, chr, chr, "BP", binsize);
+            for (auto &band : bands) {
+                vector<contactRecord> expected;
+                for (const contactRecord &record : all) {
+                    int64_t distance = abs(static_cast<int64_t>(record.binX) - record.binY);
+                    if (distance >= band[0] && distance <= band[1]) {
+                        expected.push_back(record);
+                    }
+                }
+                vector<contactRecord> records = strawBand("observed", norm, fileName, chr, band[0], band[1], "BP",
+                                                          binsize);
+                if (!sameRecords(records, expected)) {
+                    cerr << "band " << band[0] << " to " << band[1] << " of " << chr << " " << norm << " gave "
+                         << records.size() << " records, expected " << expected.size() << endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    if (!strawBand("observed", "NONE", fileName, "Q", 0, 10000000, "BP", binsize).empty()) {
+        cerr << "an unknown chromosome gave records" << endl;
+        failures++;
+    }
+
+    if (failures > 0) {
+        return 1;
+    }
+    cout << "band query ok" << endl;
+    return 0;
+}
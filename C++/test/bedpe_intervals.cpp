@@ -0,0 +1,138 @@
+/*
+  Checks strawBedpe on 5000 random intervals of test.hic, about half of them with the first chromosome of the line
+  stored second in the file, against getRecords on the interval one at a time. Every output (records, sum, dense) has
+  to come out oriented like the BEDPE line, and the same with one thread as with many.
+
+  usage: bedpe_intervals <test.hic> [threads]
+ */
+#include <random>
+#include "../straw.cpp"
+
+static bool sameCounts(float a, float b) {
+    return (isnan(a) && isnan(b)) || a == b;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: bedpe_intervals <test.hic> [threads]" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    int32_t threads = argc > 2 ? atoi(argv[2]) : 8;
+    const int32_t binsize = 2500000;
+    const string chromosomes[] = {"1", "2", "3", "5", "X"};
+    setServerSocket(""); // always read the file in this process
+
+    HiCFile hiCFile(fileName);
+    mt19937 rng(2024);
+    vector<bedpeInterval> intervals;
+    for (int i = 0; i < 5000; i++) {
+        bedpeInterval interval;
+        interval.chr1 = chromosomes[rng() % 5];
+        interval.chr2 = chromosomes[rng() % 5];
+        int64_t length1 = hiCFile.getChromosome(interval.chr1).length;
+        int64_t length2 = hiCFile.getChromosome(interval.chr2).length;
+        interval.start1 = static_cast<int64_t>(rng() % static_cast<uint32_t>(length1));
+        interval.end1 = interval.start1 + 1 + static_cast<int64_t>(rng() % 40000000);
+        interval.start2 = static_cast<int64_t>(rng() % static_cast<uint32_t>(length2));
+        interval.end2 = interval.start2 + 1 + static_cast<int64_t>(rng() % 40000000);
+        intervals.push_back(interval);
+    }
+    intervals.push_back({"Z", 0, 1000, "1", 0, 1000}); // unknown chromosome, reported empty
+
+    int failures = 0;
+    for (const string &matrixType : {string("observed"), string("oe")}) {
+        string norm = matrixType == "oe" ? "VC" : "NONE";
+
+        // one interval at a time, from a matrix per pair opened once
+        map<pair<string, string>, unique_ptr<MatrixZoomData>> matrices;
+        vector<vector<contactRecord>> expected(intervals.size());
+        for (size_t i = 0; i + 1 < intervals.size(); i++) {
+            const bedpeInterval &interval = intervals[i];
+            bool flipped = hiCFile.getChromosome(interval.chr1).index > hiCFile.getChromosome(interval.chr2).index;
+            pair<string, string> key = flipped ? make_pair(interval.chr2, interval.chr1)
+                                               : make_pair(interval.chr1, interval.chr2);
+            unique_ptr<MatrixZoomData> &mzd = matrices[key];
+            if (!mzd) {
+                mzd.reset(hiCFile.getMatrixZoomData(key.first, key.second, matrixType, norm, "BP", binsize));
+            }
+            if (!flipped) {
+                expected[i] = mzd->getRecords(interval.start1, interval.end1 - 1, interval.start2, interval.end2 - 1);
+            } else {
+                expected[i] = mzd->getRecords(interval.start2, interval.end2 - 1, interval.start1, interval.end1 - 1);
+                for (contactRecord &record : expected[i]) {
+                    swap(record.binX, record.binY);
+                }
+            }
+        }
+
+        for (const string &output : {string("records"), string("sum"), string("dense")}) {
+            for (int32_t workers : {1, threads}) {
+                vector<bedpeResult> results(intervals.size());
+                vector<int> seen(intervals.size(), 0);
+                strawBedpe(matrixType, norm, fileName, "BP", binsize, intervals, output, workers,
+                           [&](const bedpeResult &result) {
+                    results[result.index] = result;
+                    seen[result.index]++;
+                });
+                for (size_t i = 0; i < intervals.size(); i++) {
+                    const bedpeInterval &interval = intervals[i];
+                    const bedpeResult &result = results[i];
+                    bool ok = seen[i] == 1;
+                    if (output == "records") {
+                        ok = ok && result.records.size() == expected[i].size();
+                        for (size_t r = 0; ok && r < expected[i].size(); r++) {
+                            ok = result.records[r].binX == expected[i][r].binX &&
+                                 result.records[r].binY == expected[i][r].binY &&
+                                 sameCounts(result.records[r].counts, expected[i][r].counts);
+                        }
+                    } else if (output == "sum") {
+                        double sum = 0;
+                        for (const contactRecord &record : expected[i]) {
+                            if (!isnan(record.counts) && !isinf(record.counts)) {
+                                sum += record.counts;
+                            }
+                        }
+                        ok = ok && fabs(result.sum - sum) <= 1e-9 * max(1.0, fabs(sum));
+                    } else if (i + 1 < intervals.size()) {
+                        // rows on chr1 and columns on chr2, mirrored when both are the same chromosome
+                        int64_t originR = interval.start1 / binsize, originC = interval.start2 / binsize;
+                        int64_t numRows = (interval.end1 - 1) / binsize - originR + 1;
+                        int64_t numCols = (interval.end2 - 1) / binsize - originC + 1;
+                        vector<float> matrix(static_cast<size_t>(numRows * numCols), 0);
+                        for (const contactRecord &record : expected[i]) {
+                            if (isnan(record.counts) || isinf(record.counts)) {
+                                continue;
+                            }
+                            int64_t r = record.binX / binsize - originR, c = record.binY / binsize - originC;
+                            if (r >= 0 && r < numRows && c >= 0 && c < numCols) {
+                                matrix[r * numCols + c] = record.counts;
+                            }
+                            r = record.binY / binsize - originR;
+                            c = record.binX / binsize - originC;
+                            if (interval.chr1 == interval.chr2 && r >= 0 && r < numRows && c >= 0 && c < numCols) {
+                                matrix[r * numCols + c] = record.counts;
+                            }
+                        }
+                        ok = ok && result.numRows == numRows && result.numCols == numCols && result.matrix == matrix;
+                    }
+                    if (!ok) {
+                        if (failures < 10) {
+                            cerr << matrixType << " " << output << " with " << workers << " threads differs for "
+                                 << interval.chr1 << ":" << interval.start1 << "-" << interval.end1 << " "
+                                 << interval.chr2 << ":" << interval.start2 << "-" << interval.end2 << endl;
+                        }
+                        failures++;
+                    }
+                }
+            }
+        }
+    }
+
+    if (failures > 0) {
+        cerr << failures << " intervals differ" << endl;
+        return 1;
+    }
+    cout << "bedpe intervals ok" << endl;
+    return 0;
+}
@@ -0,0 +1,137 @@
+/*
+  Stress test for querying one .hic file from many threads at once: straw() calls that each open the file, and
+  getRecords calls on MatrixZoomData instances shared between threads, with the block cache and prefetcher on and
+  with some of the queries stopped part way by their own queryControl. Every query that isn't stopped has to come
+  back with exactly the records a single threaded run gave.
+
+  usage: concurrent_queries <test.hic> [threads]
+ */
+#include "../straw.cpp"
+
+struct Query {
+    string matrixType, norm, chr1, chr2;
+    int32_t binsize;
+};
+
+static bool sameRecords(const vector<contactRecord> &a, const vector<contactRecord> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        bool bothNan = isnan(a[i].counts) && isnan(b[i].counts);
+        if (a[i].binX != b[i].binX || a[i].binY != b[i].binY || (!bothNan && a[i].counts != b[i].counts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void runThreads(size_t count, const function<void(size_t)> &work) {
+    vector<thread> threads;
+    for (size_t t = 0; t < count; t++) {
+        threads.emplace_back(work, t);
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: concurrent_queries <test.hic> [threads]" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    size_t numThreads = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 16;
+    setServerSocket(""); // always read the file in this process
+    atomic<int> failures(0);
+
+    // straw() from every thread, each call opening the file itself
+    vector<Query> queries = {
+            {"observed", "NONE", "1", "1", 2500000},
+            {"observed", "KR", "1:10000000:80000000", "1:50000000:150000000", 2500000},
+            {"oe", "VC", "4", "7", 2500000},
+            {"expected", "KR", "2", "2", 2500000},
+            {"observed", "VC_SQRT", "X", "X", 2500000},
+            {"oe", "NONE", "2", "1", 2500000},
+    };
+    vector<vector<contactRecord>> expected;
+    for (const Query &q : queries) {
+        expected.push_back(straw(q.matrixType, q.norm, fileName, q.chr1, q.chr2, "BP", q.binsize));
+    }
+    runThreads(numThreads, [&](size_t t) {
+        for (size_t i = 0; i < 4 * queries.size(); i++) {
+            size_t k = (t + i) % queries.size();
+            const Query &q = queries[k];
+            if (!sameRecords(straw(q.matrixType, q.norm, fileName, q.chr1, q.chr2, "BP", q.binsize), expected[k])) {
+                cerr << "straw " << q.matrixType << " " << q.norm << " " << q.chr1 << " " << q.chr2
+                     << " differs on thread " << t << endl;
+                failures++;
+            }
+        }
+    });
+
+    // getRecords on matrices shared by every thread. regions are windows of the chromosome, worked out single
+    // threaded first
+    HiCFile hiCFile(fileName);
+    vector<unique_ptr<MatrixZoomData>> matrices;
+    matrices.emplace_back(hiCFile.getMatrixZoomData("1", "1", "observed", "NONE", "BP", 2500000));
+    matrices.emplace_back(hiCFile.getMatrixZoomData("1", "2", "oe", "KR", "BP", 2500000));
+    matrices.emplace_back(hiCFile.getMatrixZoomData("3", "3", "observed", "VC", "BP", 2500000));
+    prefetchOptions prefetch;
+    prefetch.cacheBytes = 1 << 20;
+    matrices[0]->enablePrefetch(prefetch);
+    matrices[1]->setBlockCacheSize(1 << 18);
+
+    const int64_t step = 25000000;
+    const int windows = 8;
+    vector<vector<vector<contactRecord>>> windowRecords(matrices.size());
+    for (size_t m = 0; m < matrices.size(); m++) {
+        for (int w = 0; w < windows; w++) {
+            windowRecords[m].push_back(matrices[m]->getRecords(w * step, (w + 2) * step, 0, (w + 1) * step));
+        }
+    }
+    runThreads(numThreads, [&](size_t t) {
+        for (int i = 0; i < 40; i++) {
+            size_t m = (t + i) % matrices.size();
+            int w = static_cast<int>((t * 7 + i) % windows);
+            MatrixZoomData &mzd = *matrices[m];
+            if (t % 4 == 3) {
+                // a query that is cancelled before it starts reads nothing, and must not stop anyone else's
+                queryControl control;
+                control.cancel();
+                vector<contactRecord> records = mzd.getRecords(w * step, (w + 2) * step, 0, (w + 1) * step, &control);
+                if (!records.empty() || (!windowRecords[m][w].empty() && !control.interrupted())) {
+                    cerr << "cancelled query on matrix " << m << " was not stopped" << endl;
+                    failures++;
+                }
+                continue;
+            }
+            queryControl control;
+            control.setTimeout(60000);
+            vector<contactRecord> records = mzd.getRecords(w * step, (w + 2) * step, 0, (w + 1) * step,
+                                                           i % 2 == 0 ? &control : nullptr);
+            if (!sameRecords(records, windowRecords[m][w]) || control.interrupted()) {
+                cerr << "getRecords on matrix " << m << " window " << w << " differs on thread " << t << endl;
+                failures++;
+            }
+        }
+    });
+
+    // matrices opened from the same HiCFile on many threads at once
+    runThreads(numThreads, [&](size_t t) {
+        unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData("3", "3", "observed", "VC", "BP", 2500000));
+        int w = static_cast<int>(t % windows);
+        if (!sameRecords(mzd->getRecords(w * step, (w + 2) * step, 0, (w + 1) * step), windowRecords[2][w])) {
+            cerr << "matrix opened on thread " << t << " differs" << endl;
+            failures++;
+        }
+    });
+
+    if (failures > 0) {
+        cerr << failures << " concurrent queries failed" << endl;
+        return 1;
+    }
+    cout << "concurrent queries ok" << endl;
+    return 0;
+}
@@ -0,0 +1,175 @@
+/*
+  Hedged reads against a local HTTP server that serves byte ranges of test.hic and holds back every fifth answer.
+  Queries over http with hedging on have to return exactly the records of the local file, and the held back reads
+  have to be hedged, some of them won by the duplicate.
+
+  usage: hedged_reads <test.hic>
+ */
+#include "../straw.cpp"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/*
+  Just enough of HTTP/1.1 for curl's range requests: keep-alive connections, one thread each, answering
+  "Range: bytes=a-b" with a 206 and the bytes of the file. Every delayEvery'th request waits delayMs first.
+ */
+class RangeServer {
+public:
+    static const int delayEvery = 5;
+    static const int delayMs = 200;
+
+    explicit RangeServer(const string &fileName) {
+        ifstream fin(fileName, ios::binary);
+        contents.assign(istreambuf_iterator<char>(fin), istreambuf_iterator<char>());
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = 0;
+        socklen_t length = sizeof(address);
+        if (bind(listener, (sockaddr *) &address, sizeof(address)) != 0 || listen(listener, 64) != 0 ||
+            getsockname(listener, (sockaddr *) &address, &length) != 0) {
+            perror("RangeServer");
+            exit(2);
+        }
+        port = ntohs(address.sin_port);
+        thread(&RangeServer::acceptLoop, this).detach(); // runs until the test exits
+    }
+
+    string url() const {
+        return "http://127.0.0.1:" + to_string(port) + "/test.hic";
+    }
+
+    int64_t requests() const {
+        return served;
+    }
+
+private:
+    vector<char> contents;
+    int listener = -1;
+    int port = 0;
+    atomic<int64_t> served{0};
+
+    void acceptLoop() {
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd >= 0) {
+                thread(&RangeServer::serve, this, fd).detach();
+            }
+        }
+    }
+
+    void serve(int fd) {
+        string pending;
+        char buffer[4096];
+        while (true) {
+            size_t end;
+            while ((end = pending.find("\r\n\r\n")) == string::npos) {
+                ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+                if (n <= 0) {
+                    close(fd);
+                    return;
+                }
+                pending.append(buffer, static_cast<size_t>(n));
+            }
+            string request = pending.substr(0, end);
+            pending.erase(0, end + 4);
+            for (char &c : request) {
+                c = static_cast<char>(tolower(c));
+            }
+            int64_t total = static_cast<int64_t>(contents.size());
+            int64_t first = 0, last = total - 1;
+            size_t range = request.find("range: bytes=");
+            if (range != string::npos) {
+                first = static_cast<int64_t>(strtoll(request.c_str() + range + 13, nullptr, 10));
+                size_t dash = request.find('-', range + 13);
+                last = min(total - 1, static_cast<int64_t>(strtoll(request.c_str() + dash + 1, nullptr, 10)));
+            }
+            if (++served % delayEvery == 0) {
+                this_thread::sleep_for(chrono::milliseconds(delayMs));
+            }
+            string head = "HTTP/1.1 206 Partial Content\r\nContent-Type: application/octet-stream\r\n"
+                          "ETag: \"test\"\r\nContent-Range: bytes " + to_string(first) + "-" + to_string(last) + "/" +
+                          to_string(total) + "\r\nContent-Length: " + to_string(last - first + 1) + "\r\n\r\n";
+            // a request dropped by the hedging client closes its connection under us
+            if (!sendAll(fd, head.data(), head.size()) ||
+                !sendAll(fd, contents.data() + first, static_cast<size_t>(last - first + 1))) {
+                close(fd);
+                return;
+            }
+        }
+    }
+
+    static bool sendAll(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+};
+
+const int RangeServer::delayEvery;
+const int RangeServer::delayMs;
+
+static bool sameRecords(const vector<contactRecord> &a, const vector<contactRecord> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        bool bothNan = isnan(a[i].counts) && isnan(b[i].counts);
+        if (a[i].binX != b[i].binX || a[i].binY != b[i].binY || (!bothNan && a[i].counts != b[i].counts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: hedged_reads <test.hic>" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    setServerSocket(""); // always read the file in this process
+    setDiskCache("", 0);
+    RangeServer server(fileName);
+
+    hedgeOptions options;
+    options.percentile = 0.9;
+    options.minDelayMs = 30;
+    options.maxExtraLoad = 0.5;
+    setHedging(options);
+
+    const char *pairs[][2] = {{"1", "1"}, {"1", "2"}, {"2", "2"}, {"3", "5"}, {"X", "X"}, {"4", "4"}, {"7", "1"}};
+    int failures = 0;
+    for (auto &pair : pairs) {
+        for (const string &norm : {string("NONE"), string("KR")}) {
+            vector<contactRecord> local = straw("observed", norm, fileName, pair[0], pair[1], "BP", 2500000);
+            vector<contactRecord> remote = straw("observed", norm, server.url(), pair[0], pair[1], "BP", 2500000);
+            if (!sameRecords(local, remote)) {
+                cerr << "records over http differ for " << pair[0] << " " << pair[1] << " " << norm << endl;
+                failures++;
+            }
+        }
+    }
+
+    hedgeStats stats = getHedgeStats();
+    cout << stats.reads << " block reads, " << stats.hedgesIssued << " hedged, " << stats.hedgesWon << " won by the "
+         << "duplicate, " << stats.hedgesDenied << " denied; " << server.requests() << " requests served" << endl;
+    if (stats.reads == 0 || stats.hedgesIssued == 0 || stats.hedgesWon == 0) {
+        cerr << "slow reads were not hedged" << endl;
+        failures++;
+    }
+
+    if (failures > 0) {
+        return 1;
+    }
+    cout << "hedged reads ok" << endl;
+    return 0;
+}
@@ -0,0 +1,80 @@
+/*
+  Checks planQuery on matrices the file doesn't have. test.hic lists one resolution, 2500000; in a copy of it the
+  1_1 matrix is relabelled to another binsize, so the header still lists 2500000 but the pair has nothing stored at
+  it. Planning 1 x 1 on the copy must find no resolution to pick rather than an empty one that fits any budget, a
+  pair missing from the file (ALL x 1) can't be planned either, and the pairs left alone plan as before.
+
+  usage: plan_query <test.hic>
+ */
+#include "../straw.cpp"
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: plan_query <test.hic>" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    const int32_t binsize = 2500000;
+    int failures = 0;
+
+    queryPlan plan = planQuery(fileName, "1", "1", "BP", 0, 0);
+    if (plan.resolution != binsize || !plan.fits || plan.blocks <= 0 || plan.bytes <= 0) {
+        cerr << "1 x 1 of " << fileName << " planned at " << plan.resolution << " with " << plan.bytes << " bytes"
+             << endl;
+        failures++;
+    }
+    plan = planQuery(fileName, "ALL", "1", "BP", 0, 0);
+    if (plan.resolution != 0) {
+        cerr << "a pair missing from the file planned at " << plan.resolution << endl;
+        failures++;
+    }
+
+    // the copy, with the binsize of the one zoom of 1_1 changed: c1, c2 and the zoom count, the unit, the old zoom
+    // index and four floats come before it
+    char copyName[] = "/tmp/straw-plan-XXXXXX";
+    int fd = mkstemp(copyName);
+    if (fd < 0) {
+        perror("mkstemp");
+        return 2;
+    }
+    close(fd);
+    {
+        HiCFile hiCFile(fileName);
+        stringstream key;
+        key << hiCFile.getChromosome("1").index << "_" << hiCFile.getChromosome("1").index;
+        int64_t position = hiCFile.getMasterIndex()[key.str()].position;
+        ifstream fin(fileName, ios::binary);
+        string contents((istreambuf_iterator<char>(fin)), istreambuf_iterator<char>());
+        size_t unitAt = static_cast<size_t>(position) + 3 * sizeof(int32_t);
+        size_t binsizeAt = unitAt + 3 + sizeof(int32_t) + 4 * sizeof(float);
+        int32_t stored;
+        memcpy(&stored, &contents[binsizeAt], sizeof(stored));
+        if (contents.compare(unitAt, 3, string("BP\0", 3)) != 0 || stored != binsize) {
+            cerr << "1_1 of " << fileName << " is not laid out as expected" << endl;
+            unlink(copyName);
+            return 2;
+        }
+        int32_t relabelled = binsize + 1;
+        memcpy(&contents[binsizeAt], &relabelled, sizeof(relabelled));
+        ofstream(copyName, ios::binary) << contents;
+    }
+
+    plan = planQuery(copyName, "1", "1", "BP", 0, 0);
+    if (plan.resolution != 0 || plan.fits || plan.considered.size() != 1 || plan.considered[0].available) {
+        cerr << "1 x 1 without a matrix at " << binsize << " planned at " << plan.resolution << endl;
+        failures++;
+    }
+    plan = planQuery(copyName, "1", "2", "BP", 0, 1);
+    if (plan.resolution != binsize || plan.fits || plan.bytes <= 1) {
+        cerr << "1 x 2 of the copy planned at " << plan.resolution << ", over a budget of 1 byte: "
+             << (plan.fits ? "fits" : "doesn't fit") << endl;
+        failures++;
+    }
+    unlink(copyName);
+
+    if (failures > 0) {
+        return 1;
+    }
+    cout << "plan query ok" << endl;
+    return 0;
+}
@@ -0,0 +1,180 @@
+/*
+  Runs a straw serve daemon in this process and sends it straw() queries from many threads: answers have to match
+  the file read directly, queries that fail (a malformed locus, an unknown chromosome, a missing file) have to come
+  back as serveErrors without taking the daemon down, a matrix the file lacks has to be reported to the client, and
+  SIGTERM has to stop it with clients still connected.
+
+  usage: serve_queries <test.hic> [threads]
+ */
+#include "../straw.cpp"
+
+static bool sameRecords(const vector<contactRecord> &a, const vector<contactRecord> &b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        bool bothNan = isnan(a[i].counts) && isnan(b[i].counts);
+        if (a[i].binX != b[i].binX || a[i].binY != b[i].binY || (!bothNan && a[i].counts != b[i].counts)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the daemon's answer to a query for a matrix, the type of its last frame and what an 'E' frame said; 0 if the
+// daemon turned the connection away
+static char rawAnswer(const string &socketPath, const string &matrixType, const string &fileName, int32_t binsize,
+                      string &message) {
+    int fd = connectToSocket(socketPath);
+    FrameWriter out;
+    out.put(serveProtocolVersion);
+    for (const string &field : {matrixType, string("NONE"), fileName, string("1"), string("1"), string("BP")}) {
+        out.putString(field);
+    }
+    out.put(binsize);
+    out.put(static_cast<int64_t>(0));
+    char type = 0;
+    string payload;
+    if (fd < 0 || !sendFrame(fd, 'Q', out.payload)) {
+        return 0;
+    }
+    while (receiveFrame(fd, type, payload) && type == 'R') {
+        // records before the end of the answer, if any
+    }
+    if (type == 'E') {
+        FrameReader in(payload);
+        in.get<int32_t>();
+        message = in.getString();
+    }
+    close(fd);
+    return type;
+}
+
+// the status of the serveError the query throws, or -1 if it doesn't
+static int32_t failureStatus(const string &fileName, const string &chr1loc, const string &chr2loc) {
+    try {
+        straw("observed", "NONE", fileName, chr1loc, chr2loc, "BP", 2500000);
+    } catch (const serveError &e) {
+        return e.status;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        cerr << "usage: serve_queries <test.hic> [threads]" << endl;
+        return 2;
+    }
+    string fileName = argv[1];
+    size_t numThreads = argc > 2 ? static_cast<size_t>(atoi(argv[2])) : 8;
+    char directory[] = "/tmp/straw-test-XXXXXX";
+    if (mkdtemp(directory) == nullptr) {
+        perror("mkdtemp");
+        return 2;
+    }
+    string socketPath = string(directory) + "/straw.sock";
+    int failures = 0;
+
+    const char *pairs[][2] = {{"1", "1"}, {"1:10000000:80000000", "2"}, {"3", "5"}, {"X", "X"}, {"7", "1"}};
+    setServerSocket("");
+    vector<vector<contactRecord>> expected;
+    for (auto &pair : pairs) {
+        expected.push_back(straw("observed", "KR", fileName, pair[0], pair[1], "BP", 2500000));
+    }
+
+    serveOptions options;
+    options.maxConnections = 4;
+    int status = -1;
+    thread daemon([&] { status = strawServe(socketPath, options); });
+    for (int i = 0; i < 100; i++) { // until the daemon listens
+        int fd = connectToSocket(socketPath);
+        if (fd >= 0) {
+            close(fd);
+            break;
+        }
+        this_thread::sleep_for(chrono::milliseconds(20));
+    }
+    setServerSocket(socketPath);
+
+    // more clients than the daemon takes at once; the ones it turns away read the file themselves
+    atomic<int> wrong(0);
+    vector<thread> clients;
+    for (size_t t = 0; t < numThreads; t++) {
+        clients.emplace_back([&, t] {
+            for (size_t i = 0; i < 10; i++) {
+                size_t k = (t + i) % expected.size();
+                if (!sameRecords(straw("observed", "KR", fileName, pairs[k][0], pairs[k][1], "BP", 2500000),
+                                 expected[k])) {
+                    wrong++;
+                }
+            }
+        });
+    }
+    for (thread &client : clients) {
+        client.join();
+    }
+    if (wrong > 0) {
+        cerr << wrong << " answers from the daemon differ from the file" << endl;
+        failures++;
+    }
+    // the daemon's threads notice their clients hung up a moment later; until then new clients may be turned away,
+    // and a failed query run here would end the test
+    this_thread::sleep_for(chrono::milliseconds(200));
+
+    // failed queries, each followed by one that has to work
+    const char *bad[][3] = {{"", "1:abc:def", "1"}, {"", "1", "1:5:99999999999999999999"}, {"", "Q", "1"},
+                            {"/nonexistent.hic", "1", "1"}};
+    for (auto &query : bad) {
+        string file = query[0][0] != '\0' ? query[0] : fileName;
+        int32_t failed = failureStatus(file, query[1], query[2]);
+        if (failed <= 0) {
+            cerr << "query " << file << " " << query[1] << " " << query[2] << " did not fail, status " << failed
+                 << endl;
+            failures++;
+        }
+        if (!sameRecords(straw("observed", "KR", fileName, pairs[0][0], pairs[0][1], "BP", 2500000), expected[0])) {
+            cerr << "daemon did not answer after " << query[1] << " " << query[2] << endl;
+            failures++;
+        }
+    }
+
+    // matrices the file doesn't have, asked for twice: what a local query prints comes back to the client each time
+    // rather than to the daemon's stderr, and the missing matrix isn't kept
+    const char *missing[][2] = {{"oe", "File did not contain expected values vectors"}, {"observed", "Error finding"}};
+    for (auto &query : missing) {
+        for (int i = 0; i < 2; i++) {
+            string message;
+            char type = 0;
+            // the daemon may not have noticed the last connection hang up yet, and turn this one away
+            for (int attempt = 0; attempt < 50 && type == 0; attempt++) {
+                type = rawAnswer(socketPath, query[0], fileName, 500000, message);
+                if (type == 0) {
+                    this_thread::sleep_for(chrono::milliseconds(20));
+                }
+            }
+            if (type != 'E' || message.find(query[1]) != 0) {
+                cerr << query[0] << " at a resolution the file lacks answered '" << type << "' " << message << endl;
+                failures++;
+            }
+        }
+    }
+
+    // stopped with a client connected and idle
+    int idle = connectToSocket(socketPath);
+    kill(getpid(), SIGTERM);
+    daemon.join();
+    if (idle >= 0) {
+        close(idle);
+    }
+    if (status != 0 || connectToSocket(socketPath) >= 0 || access(socketPath.c_str(), F_OK) == 0) {
+        cerr << "daemon did not shut down cleanly, status " << status << endl;
+        failures++;
+    }
+    rmdir(directory);
+
+    if (failures > 0) {
+        return 1;
+    }
+    cout << "serve queries ok" << endl;
+    return 0;
+}
@@ -6,8 +6,8 @@
 using namespace Rcpp;
 
 // straw
-Rcpp::DataFrame straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, const std::string& unit, int32_t binsize, std::string matrix);
-RcppExport SEXP _strawr_straw(SEXP normSEXP, SEXP fnameSEXP, SEXP chr1locSEXP, SEXP chr2locSEXP, SEXP unitSEXP, SEXP binsizeSEXP, SEXP matrixSEXP) {
+Rcpp::DataFrame straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, const std::string& unit, int32_t binsize, std::string matrix, double timeout);
+RcppExport SEXP _strawr_straw(SEXP normSEXP, SEXP fnameSEXP, SEXP chr1locSEXP, SEXP chr2locSEXP, SEXP unitSEXP, SEXP binsizeSEXP, SEXP matrixSEXP, SEXP timeoutSEXP) {
 BEGIN_RCPP
     Rcpp::RObject rcpp_result_gen;
     Rcpp::RNGScope rcpp_rngScope_gen;
@@ -18,7 +18,30 @@ BEGIN_RCPP
     Rcpp::traits::input_parameter< const std::string& >::type unit(unitSEXP);
     Rcpp::traits::input_parameter< int32_t >::type binsize(binsizeSEXP);
     Rcpp::traits::input_parameter< std::string >::type matrix(matrixSEXP);
-    rcpp_result_gen = Rcpp::wrap(straw(norm, fname, chr1loc, chr2loc, unit, binsize, matrix));
+    Rcpp::traits::input_parameter< double >::type timeout(timeoutSEXP);
+    rcpp_result_gen = Rcpp::wrap(straw(norm, fname, chr1loc, chr2loc, unit, binsize, matrix, timeout));
+    return rcpp_result_gen;
+END_RCPP
+}
+// strawRegions
+Rcpp::DataFrame strawRegions(std::string norm, std::string fname, std::string chr1, std::string chr2, Rcpp::NumericVector x1, Rcpp::NumericVector x2, Rcpp::NumericVector y1, Rcpp::NumericVector y2, const std::string& unit, int32_t binsize, std::string matrix, double timeout);
+RcppExport SEXP _strawr_strawRegions(SEXP normSEXP, SEXP fnameSEXP, SEXP chr1SEXP, SEXP chr2SEXP, SEXP x1SEXP, SEXP x2SEXP, SEXP y1SEXP, SEXP y2SEXP, SEXP unitSEXP, SEXP binsizeSEXP, SEXP matrixSEXP, SEXP timeoutSEXP) {
+BEGIN_RCPP
+    Rcpp::RObject rcpp_result_gen;
+    Rcpp::RNGScope rcpp_rngScope_gen;
+    Rcpp::traits::input_parameter< std::string >::type norm(normSEXP);
+    Rcpp::traits::input_parameter< std::string >::type fname(fnameSEXP);
+    Rcpp::traits::input_parameter< std::string >::type chr1(chr1SEXP);
+    Rcpp::traits::input_parameter< std::string >::type chr2(chr2SEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type x1(x1SEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type x2(x2SEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type y1(y1SEXP);
+    Rcpp::traits::input_parameter< Rcpp::NumericVector >::type y2(y2SEXP);
+    Rcpp::traits::input_parameter< const std::string& >::type unit(unitSEXP);
+    Rcpp::traits::input_parameter< int32_t >::type binsize(binsizeSEXP);
+    Rcpp::traits::input_parameter< std::string >::type matrix(matrixSEXP);
+    Rcpp::traits::input_parameter< double >::type timeout(timeoutSEXP);
+    rcpp_result_gen = Rcpp::wrap(strawRegions(norm, fname, chr1, chr2, x1, x2, y1, y2, unit, binsize, matrix, timeout));
     return rcpp_result_gen;
 END_RCPP
 }
@@ -46,7 +69,8 @@ END_RCPP
 }
 
 static const R_CallMethodDef CallEntries[] = {
-    {"_strawr_straw", (DL_FUNC) &_strawr_straw, 7},
+    {"_strawr_straw", (DL_FUNC) &_strawr_straw, 8},
+    {"_strawr_strawRegions", (DL_FUNC) &_strawr_strawRegions, 12},
     {"_strawr_readHicBpResolutions", (DL_FUNC) &_strawr_readHicBpResolutions, 1},
     {"_strawr_readHicChroms", (DL_FUNC) &_strawr_readHicChroms, 1},
     {NULL, NULL, 0}
@@ -25,11 +25,19 @@
 #include <fstream>
 #include <sstream>
 #include <map>
+#include <array>
 #include <cmath>
 #include <set>
 #include <vector>
 #include <streambuf>
+#include <chrono>
 #include <curl/curl.h>
+#ifndef _WIN32
+#include <cerrno>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
 #include <Rcpp.h>
 #include "zlib.h"
 #include "straw.h"
@@ -88,6 +96,11 @@ char *getData(CURL *curl, int64_t position, int64_t chunksize) {
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &chunk);
     curl_easy_setopt(curl, CURLOPT_RANGE, oss.str().c_str());
     CURLcode res = curl_easy_perform(curl);
+    if (res == CURLE_OPERATION_TIMEDOUT) {
+        // only block reads have a timeout, set from the query's deadline; the caller drops the block
+        free(chunk.memory);
+        return nullptr;
+    }
     if (res != CURLE_OK) {
         Rcpp::stop("curl_easy_perform() failed: %s.",
                 curl_easy_strerror(res));
@@ -611,6 +624,10 @@ vector<contactRecord> readBlock(istream &fin, CURL *curl, bool isHttp, indexEntr
 
     if (isHttp) {
         compressedBytes = getData(curl, idx.position, idx.size);
+        if (compressedBytes == nullptr) {
+            delete[] uncompressedBytes;
+            return vector<contactRecord>();
+        }
     } else {
         fin.seekg(idx.position, ios::beg);
         fin.read(compressedBytes, idx.size);
@@ -786,6 +803,7 @@ public:
     ifstream fin;
     CURL *curl;
     bool isHttp = false;
+    bool closed = false;
 
     static CURL *initCURL(const char *url) {
         CURL *curl = curl_easy_init();
@@ -815,7 +833,16 @@ public:
         }
     }
 
+    // a FileReader on the stack is closed however its scope is left, Rcpp::stop included
+    ~FileReader() {
+        close();
+    }
+
     void close(){
+        if (closed) {
+            return;
+        }
+        closed = true;
         if(isHttp){
             curl_easy_cleanup(curl);
         } else {
@@ -828,6 +855,7 @@ class HiCFile {
 public:
     string prefix = "http"; // HTTP code
     bool isHttp = false;
+    bool closed = false;
     ifstream fin;
     CURL *curl;
     int64_t master = 0LL;
@@ -899,7 +927,16 @@ public:
         }
     }
 
+    // like FileReader; close() may already have been called
+    ~HiCFile() {
+        close();
+    }
+
     void close(){
+        if (closed) {
+            return;
+        }
+        closed = true;
         if(isHttp){
             curl_easy_cleanup(curl);
         } else {
@@ -1026,6 +1063,50 @@ void parsePositions(const string &chrLoc, string &chrom, int64_t &pos1, int64_t
     }
 }
 
+// the time limit of a query, timeout seconds from its start (none when timeout <= 0). blocks are read only while there
+// is time left, a remote read is cut off when the time runs out, and R interrupts are checked between blocks
+class QueryDeadline {
+public:
+    int64_t blocksRead = 0;
+    int64_t blocksSkipped = 0; // blocks needed but not read in time
+    double timeout;
+
+    explicit QueryDeadline(double timeout) : timeout(timeout),
+            end(chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(
+                    chrono::duration<double>(max(timeout, 0.0)))) {}
+
+    bool expired() const {
+        return timeout > 0 && chrono::steady_clock::now() >= end;
+    }
+
+    // whether to read the next block; gives a remote read the time left
+    bool beforeBlock(FileReader *fileReader) {
+        Rcpp::checkUserInterrupt();
+        if (expired()) {
+            blocksSkipped++;
+            return false;
+        }
+        if (fileReader->isHttp && timeout > 0) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(end - chrono::steady_clock::now());
+            curl_easy_setopt(fileReader->curl, CURLOPT_TIMEOUT_MS, static_cast<long>(max<int64_t>(1, left.count())));
+        }
+        return true;
+    }
+
+    // whether to keep the block just read; one that ran past the deadline may have been cut off
+    bool afterBlock() {
+        if (expired()) {
+            blocksSkipped++;
+            return false;
+        }
+        blocksRead++;
+        return true;
+    }
+
+private:
+    chrono::steady_clock::time_point end;
+};
+
 class BlocksRecords {
 public:
     float sumCounts;
@@ -1067,65 +1148,119 @@ public:
         return blockNumbers;
     }
 
+    // turns a record read from a block into the one returned to R (genomic positions, normalized counts); false if it
+    // is outside the region
+    bool toRegionRecord(const contactRecord &rec, const int64_t origRegionIndices[4], const footerInfo &footer,
+                        contactRecord &record) {
+        int64_t x = rec.binX * footer.resolution;
+        int64_t y = rec.binY * footer.resolution;
+
+        if (!((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
+               y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
+              // or check regions that overlap with lower left
+              (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
+               x <= origRegionIndices[3]))) {
+            return false;
+        }
+
+        float c = rec.counts;
+        if (footer.norm != "NONE") {
+            c = static_cast<float>(c / (footer.c1Norm[rec.binX] * footer.c2Norm[rec.binY]));
+        }
+        if (footer.matrixType == "oe") {
+            if (isIntra) {
+                c = static_cast<float>(c / footer.expectedValues[min(footer.expectedValues.size() - 1,
+                                                                     (size_t) floor(abs(y - x) /
+                                                                                    footer.resolution))]);
+            } else {
+                c = static_cast<float>(c / avgCount);
+            }
+        } else if (footer.matrixType == "expected") {
+            if (isIntra) {
+                c = static_cast<float>(footer.expectedValues[min(footer.expectedValues.size() - 1,
+                                                                 (size_t) floor(abs(y - x) /
+                                                                                footer.resolution))]);
+            } else {
+                c = static_cast<float>(avgCount);
+            }
+        }
+
+        record = contactRecord();
+        record.binX = static_cast<int32_t>(x);
+        record.binY = static_cast<int32_t>(y);
+        record.counts = c;
+        return true;
+    }
+
     vector<contactRecord>
     getRecords(FileReader *fileReader, int64_t regionIndices[4],
-               const int64_t origRegionIndices[4], const footerInfo &footer) {
+               const int64_t origRegionIndices[4], const footerInfo &footer, QueryDeadline &deadline) {
 
         set<int32_t> blockNumbers = getBlockNumbers(footer.version, isIntra, regionIndices, blockBinCount,
                                                 blockColumnCount);
 
         vector<contactRecord> records;
         for (int32_t blockNumber : blockNumbers) {
+            if (!deadline.beforeBlock(fileReader)) {
+                continue;
+            }
             // get contacts in this block
-            //cout << *it << " -- " << blockMap.size() << endl;
-            //cout << blockMap[*it].size << " " <<  blockMap[*it].position << endl;
             vector<contactRecord> tmp_records = readBlock(fileReader->fin, fileReader->curl, fileReader->isHttp,
                                                           blockMap[blockNumber], footer.version);
-            for (contactRecord rec : tmp_records) {
-                int64_t x = rec.binX * footer.resolution;
-                int64_t y = rec.binY * footer.resolution;
-
-                if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
-                     y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
-                    // or check regions that overlap with lower left
-                    (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
-                     x <= origRegionIndices[3])) {
-
-                    float c = rec.counts;
-                    if (footer.norm != "NONE") {
-                        c = static_cast<float>(c / (footer.c1Norm[rec.binX] * footer.c2Norm[rec.binY]));
-                    }
-                    if (footer.matrixType == "oe") {
-                        if (isIntra) {
-                            c = static_cast<float>(c / footer.expectedValues[min(footer.expectedValues.size() - 1,
-                                                                                 (size_t) floor(abs(y - x) /
-                                                                                                footer.resolution))]);
-                        } else {
-                            c = static_cast<float>(c / avgCount);
-                        }
-                    } else if (footer.matrixType == "expected") {
-                        if (isIntra) {
-                            c = static_cast<float>(footer.expectedValues[min(footer.expectedValues.size() - 1,
-                                                                                 (size_t) floor(abs(y - x) /
-                                                                                                footer.resolution))]);
-                        } else {
-                            c = static_cast<float>(avgCount);
-                        }
-                    }
-
-                    contactRecord record = contactRecord();
-                    record.binX = static_cast<int32_t>(x);
-                    record.binY = static_cast<int32_t>(y);
-                    record.counts = c;
+            if (!deadline.afterBlock()) {
+                continue;
+            }
+            contactRecord record;
+            for (const contactRecord &rec : tmp_records) {
+                if (toRegionRecord(rec, origRegionIndices, footer, record)) {
                     records.push_back(record);
                 }
             }
         }
         return records;
     }
+
+    // getRecords for several regions at once; a block needed by more than one region is read only once
+    vector<vector<contactRecord>>
+    getRecordsForRegions(FileReader *fileReader, const vector<array<int64_t, 4>> &origRegions,
+                         const footerInfo &footer, QueryDeadline &deadline) {
+        map<int32_t, vector<size_t>> blockRegions;
+        for (size_t r = 0; r < origRegions.size(); r++) {
+            int64_t regionIndices[4];
+            for (int q = 0; q < 4; q++) {
+                regionIndices[q] = origRegions[r][q] / footer.resolution;
+            }
+            for (int32_t blockNumber : getBlockNumbers(footer.version, isIntra, regionIndices, blockBinCount,
+                                                       blockColumnCount)) {
+                blockRegions[blockNumber].push_back(r);
+            }
+        }
+
+        vector<vector<contactRecord>> records(origRegions.size());
+        for (const auto &blockAndRegions : blockRegions) {
+            if (!deadline.beforeBlock(fileReader)) {
+                continue;
+            }
+            vector<contactRecord> tmp_records = readBlock(fileReader->fin, fileReader->curl, fileReader->isHttp,
+                                                          blockMap[blockAndRegions.first], footer.version);
+            if (!deadline.afterBlock()) {
+                continue;
+            }
+            contactRecord record;
+            for (size_t r : blockAndRegions.second) {
+                for (const contactRecord &rec : tmp_records) {
+                    if (toRegionRecord(rec, origRegions[r].data(), footer, record)) {
+                        records[r].push_back(record);
+                    }
+                }
+            }
+        }
+        return records;
+    }
 };
 
-vector<contactRecord> getBlockRecords(FileReader *fileReader, int64_t origRegionIndices[4], const footerInfo &footer) {
+vector<contactRecord> getBlockRecords(FileReader *fileReader, int64_t origRegionIndices[4], const footerInfo &footer,
+                                      QueryDeadline &deadline) {
     if (!footer.foundFooter) {
         vector<contactRecord> v;
         return v;
@@ -1138,7 +1273,17 @@ vector<contactRecord> getBlockRecords(FileReader *fileReader, int64_t origRegion
     regionIndices[3] = origRegionIndices[3] / footer.resolution;
 
     BlocksRecords *blocksRecords = new BlocksRecords(fileReader, footer);
-    return blocksRecords->getRecords(fileReader, regionIndices, origRegionIndices, footer);
+    return blocksRecords->getRecords(fileReader, regionIndices, origRegionIndices, footer, deadline);
+}
+
+vector<vector<contactRecord>>
+getBlockRecordsForRegions(FileReader *fileReader, const vector<array<int64_t, 4>> &origRegions,
+                          const footerInfo &footer, QueryDeadline &deadline) {
+    if (!footer.foundFooter) {
+        return vector<vector<contactRecord>>(origRegions.size());
+    }
+    BlocksRecords blocksRecords(fileReader, footer);
+    return blocksRecords.getRecordsForRegions(fileReader, origRegions, footer, deadline);
 }
 
 footerInfo getNormalizationInfoForRegion(string fname, string chr1, string chr2,
@@ -1173,7 +1318,8 @@ getBlockRecordsWithNormalization(string fname,
                                  int32_t resolution, bool foundFooter, int32_t version, int32_t c1, int32_t c2,
                                  int32_t numBins1, int32_t numBins2, int64_t myFilePos, string unit, string norm,
                                  string matrixType,
-                                 vector<double> c1Norm, vector<double> c2Norm, vector<double> expectedValues) {
+                                 vector<double> c1Norm, vector<double> c2Norm, vector<double> expectedValues,
+                                 QueryDeadline &deadline) {
     int64_t origRegionIndices[4]; // as given by user
     origRegionIndices[0] = c1pos1;
     origRegionIndices[1] = c1pos2;
@@ -1196,11 +1342,206 @@ getBlockRecordsWithNormalization(string fname,
     footer.c1Norm = c1Norm;
     footer.c2Norm = c2Norm;
     footer.expectedValues = expectedValues;
-    vector<contactRecord> v = getBlockRecords(fileReader, origRegionIndices, footer);
+    vector<contactRecord> v = getBlockRecords(fileReader, origRegionIndices, footer, deadline);
     fileReader->close();
     return v;
 }
 
+/*
+  Client for a straw serve daemon (see the C++ straw), which keeps files, matrices and blocks cached between the
+  queries of many processes. straw() sends its query to the daemon listening on STRAW_SOCKET, if that is set and the
+  daemon runs as the same user, and reads the file itself otherwise. Frames are a one byte type, a uint32 payload
+  length and the payload, in native byte order; strings are a uint32 length and their bytes.
+ */
+#ifndef _WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const uint8_t serveProtocolVersion = 1;
+
+// closes the connection however the query ends, R interrupts included
+class ServerConnection {
+public:
+    int fd = -1;
+
+    explicit ServerConnection(const string &path) {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            return;
+        }
+        memcpy(address.sun_path, path.c_str(), path.size());
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd >= 0 && connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0 && !peerIsThisUser()) {
+            Rcpp::warning("Not sending the query to %s, whose daemon runs as another user.", path);
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    ~ServerConnection() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool send(const string &data) {
+        size_t done = 0;
+        while (done < data.size()) {
+            ssize_t n = ::send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                return false;
+            }
+            done += n > 0 ? static_cast<size_t>(n) : 0;
+        }
+        return true;
+    }
+
+    bool receive(char *data, size_t size) {
+        while (size > 0) {
+            ssize_t n = recv(fd, data, size, 0);
+            if (n <= 0 && !(n < 0 && errno == EINTR)) {
+                return false;
+            }
+            if (n > 0) {
+                data += n;
+                size -= static_cast<size_t>(n);
+            }
+        }
+        return true;
+    }
+
+private:
+    bool peerIsThisUser() {
+#ifdef SO_PEERCRED
+        ucred credentials{};
+        socklen_t length = sizeof(credentials);
+        return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+        uid_t uid;
+        gid_t gid;
+        return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+    }
+};
+
+template <typename T>
+static void putField(string &payload, T value) {
+    payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+static T getField(const string &payload, size_t &at) {
+    T value = T();
+    if (at + sizeof(value) <= payload.size()) {
+        memcpy(&value, payload.data() + at, sizeof(value));
+    }
+    at += sizeof(value);
+    return value;
+}
+
+// runs a straw query on the daemon, if one is listening; false means the query has to run in this session. the
+// daemon's counts of blocks read and skipped go to deadline
+static bool strawFromServer(const string &matrix, const string &norm, const string &fname, const string &chr1loc,
+                            const string &chr2loc, const string &unit, int32_t binsize, QueryDeadline &deadline,
+                            vector<contactRecord> &records) {
+    const char *socketPath = getenv("STRAW_SOCKET");
+    if (socketPath == nullptr) {
+        return false;
+    }
+    ServerConnection connection(socketPath);
+    if (connection.fd < 0) {
+        return false;
+    }
+    string file = fname;
+    char cwd[4096];
+    if (file.compare(0, 4, "http") != 0 && !file.empty() && file[0] != '/' && getcwd(cwd, sizeof(cwd)) != nullptr) {
+        file = string(cwd) + "/" + file; // the daemon runs in a directory of its own
+    }
+    string payload;
+    putField(payload, serveProtocolVersion);
+    for (const string &field : {matrix, norm, file, chr1loc, chr2loc, unit}) {
+        putField(payload, static_cast<uint32_t>(field.size()));
+        payload.append(field);
+    }
+    putField(payload, binsize);
+    putField(payload, static_cast<int64_t>(deadline.timeout > 0 ? max(1.0, deadline.timeout * 1000) : 0));
+    string frame(1, 'Q');
+    putField(frame, static_cast<uint32_t>(payload.size()));
+    if (!connection.send(frame + payload)) {
+        return false;
+    }
+    while (true) {
+        char head[5];
+        if (!connection.receive(head, sizeof(head))) {
+            records.clear(); // the daemon went away mid-answer; start over here
+            return false;
+        }
+        uint32_t length;
+        memcpy(&length, head + 1, sizeof(length));
+        payload.resize(length);
+        if (length > 0 && !connection.receive(&payload[0], length)) {
+            records.clear();
+            return false;
+        }
+        size_t at = 0;
+        if (head[0] == 'R') {
+            size_t count = payload.size() / sizeof(contactRecord);
+            size_t first = records.size();
+            records.resize(first + count);
+            memcpy(&records[first], payload.data(), count * sizeof(contactRecord));
+            Rcpp::checkUserInterrupt();
+        } else if (head[0] == 'E') {
+            getField<int32_t>(payload, at);
+            uint32_t size = getField<uint32_t>(payload, at);
+            Rcpp::stop(payload.substr(at, size));
+        } else if (head[0] == 'D') {
+            getField<uint8_t>(payload, at);
+            deadline.blocksRead = getField<int64_t>(payload, at);
+            deadline.blocksSkipped = getField<int64_t>(payload, at);
+            return true;
+        } else {
+            records.clear();
+            return false;
+        }
+    }
+}
+#else
+static bool strawFromServer(const string &, const string &, const string &, const string &, const string &,
+                            const string &, int32_t, QueryDeadline &, vector<contactRecord> &) {
+    return false;
+}
+#endif
+
+// a result cut short by its timeout gets a warning and a "complete" attribute of FALSE
+void flagPartialResult(Rcpp::DataFrame &result, const QueryDeadline &deadline) {
+    if (deadline.blocksSkipped > 0) {
+        Rcpp::warning("Stopped at the %g second timeout with %d of %d blocks read; the result is partial.",
+                      deadline.timeout, deadline.blocksRead, deadline.blocksRead + deadline.blocksSkipped);
+        result.attr("complete") = false;
+    }
+}
+
+// the data.frame straw returns
+Rcpp::DataFrame recordsFrame(const vector<contactRecord> &records, const QueryDeadline &deadline) {
+    vector<int32_t> xActual_vec, yActual_vec;
+    vector<float> counts_vec;
+    for (vector<contactRecord>::const_iterator it=records.begin(); it!=records.end(); ++it) {
+      xActual_vec.push_back(it->binX);
+      yActual_vec.push_back(it->binY);
+      counts_vec.push_back(it->counts);
+    }
+    Rcpp::DataFrame result = Rcpp::DataFrame::create(Rcpp::Named("x") = xActual_vec, Rcpp::Named("y") = yActual_vec, Rcpp::Named("counts") = counts_vec);
+    flagPartialResult(result, deadline);
+    return result;
+}
+
 //' Straw Quick Dump
 //'
 //' fast C++ implementation of dump. Not as fully featured as the
@@ -1210,6 +1551,10 @@ getBlockRecordsWithNormalization(string fname,
 //'
 //' Usage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize> [observed/oe/expected]
 //'
+//' When STRAW_SOCKET is set and a straw serve daemon (from the C++ straw) of the same
+//' user listens on it, the query is answered by the daemon from the files, matrices
+//' and blocks it keeps cached.
+//'
 //' @param norm Normalization to apply. Must be one of NONE/VC/VC_SQRT/KR.
 //'     VC is vanilla coverage, VC_SQRT is square root of vanilla coverage, and KR is Knight-Ruiz or
 //'     Balanced normalization.
@@ -1222,17 +1567,26 @@ getBlockRecordsWithNormalization(string fname,
 //'     100, 50, 20, 5, 2, 1>.
 //' @param matrix Type of matrix to output. Must be one of observed/oe/expected.
 //'     observed is observed counts, oe is observed/expected counts, expected is expected counts.
+//' @param timeout Seconds after which to stop reading blocks, 0 for no limit. A query stopped
+//'     this way returns the records read so far with a warning, and its result has a "complete"
+//'     attribute of FALSE.
 //' @return Data.frame of a sparse matrix of data from hic file. x,y,counts
 //' @examples
 //' straw("NONE", system.file("extdata", "test.hic", package = "strawr"), "1", "1", "BP", 2500000)
 //' @export
 // [[Rcpp::export]]
 Rcpp::DataFrame
-straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, const std::string &unit, int32_t binsize, std::string matrix = "observed") {
+straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2loc, const std::string &unit, int32_t binsize, std::string matrix = "observed", double timeout = 0) {
+    QueryDeadline deadline(timeout);
     if (!(unit == "BP" || unit == "FRAG")) {
         Rcpp::stop("Norm specified incorrectly, must be one of <BP/FRAG>.\nUsage: straw <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize> [observed/oe/expected].");
     }
 
+    vector<contactRecord> records;
+    if (strawFromServer(matrix, norm, fname, chr1loc, chr2loc, unit, binsize, deadline, records)) {
+        return recordsFrame(records, deadline);
+    }
+
     HiCFile *hiCFile = new HiCFile(std::move(fname));
 
     string chr1, chr2;
@@ -1259,21 +1613,94 @@ straw(std::string norm, std::string fname, std::string chr1loc, std::string chr2
 
     footerInfo footer = getNormalizationInfoForRegion(fname, chr1, chr2, matrix, norm, unit, binsize);
 
-    vector<contactRecord> records = getBlockRecordsWithNormalization(fname,
+    records = getBlockRecordsWithNormalization(fname,
                                             origRegionIndices[0], origRegionIndices[1],
                                             origRegionIndices[2], origRegionIndices[3],
                                             footer.resolution, footer.foundFooter, footer.version,
                                             footer.c1, footer.c2, footer.numBins1, footer.numBins2,
                                             footer.myFilePos, footer.unit, footer.norm, footer.matrixType,
-                                            footer.c1Norm, footer.c2Norm, footer.expectedValues);
-    vector<int32_t> xActual_vec, yActual_vec;
+                                            footer.c1Norm, footer.c2Norm, footer.expectedValues, deadline);
+    return recordsFrame(records, deadline);
+}
+
+//' Straw Quick Dump for many regions
+//'
+//' Reads the records of many rectangles on the same pair of chromosomes at once. The file is opened
+//' once and each block is read once, however many of the regions need it, which makes this much
+//' faster than calling straw for each region.
+//'
+//' @param norm Normalization to apply. Must be one of NONE/VC/VC_SQRT/KR.
+//' @param fname path to .hic file
+//' @param chr1 first chromosome
+//' @param chr2 second chromosome
+//' @param x1 start of each region on chr1
+//' @param x2 end of each region on chr1
+//' @param y1 start of each region on chr2
+//' @param y2 end of each region on chr2
+//' @param unit BP (BasePair) or FRAG (FRAGment)
+//' @param binsize The bin size
+//' @param matrix Type of matrix to output. Must be one of observed/oe/expected.
+//' @param timeout Seconds after which to stop reading blocks, 0 for no limit. As for straw, a
+//'     query stopped this way returns what it read with a warning and a "complete" attribute of FALSE.
+//' @return Data.frame of the records of all regions. region,x,y,counts where region is the index of
+//'     the region (starting at 1) the record belongs to
+//' @examples
+//' strawRegions("NONE", system.file("extdata", "test.hic", package = "strawr"), "1", "1",
+//'              c(0, 50000000), c(25000000, 75000000), c(0, 50000000), c(25000000, 75000000), "BP", 2500000)
+//' @export
+// [[Rcpp::export]]
+Rcpp::DataFrame
+strawRegions(std::string norm, std::string fname, std::string chr1, std::string chr2, Rcpp::NumericVector x1,
+             Rcpp::NumericVector x2, Rcpp::NumericVector y1, Rcpp::NumericVector y2, const std::string &unit,
+             int32_t binsize, std::string matrix = "observed", double timeout = 0) {
+    QueryDeadline deadline(timeout);
+    if (!(unit == "BP" || unit == "FRAG")) {
+        Rcpp::stop("Norm specified incorrectly, must be one of <BP/FRAG>.");
+    }
+    if (x2.size() != x1.size() || y1.size() != x1.size() || y2.size() != x1.size()) {
+        Rcpp::stop("x1, x2, y1 and y2 must have the same length.");
+    }
+
+    HiCFile hiCFile(fname);
+    if (hiCFile.chromosomeMap.count(chr1) == 0) {
+        Rcpp::stop("%s not found in the file.", chr1);
+    }
+    if (hiCFile.chromosomeMap.count(chr2) == 0) {
+        Rcpp::stop("%s not found in the file.", chr2);
+    }
+    // reverse order if necessary
+    bool flip = hiCFile.chromosomeMap[chr1].index > hiCFile.chromosomeMap[chr2].index;
+    hiCFile.close();
+
+    vector<array<int64_t, 4>> origRegions(x1.size());
+    for (R_xlen_t i = 0; i < x1.size(); i++) {
+        array<int64_t, 4> region = {{static_cast<int64_t>(x1[i]), static_cast<int64_t>(x2[i]),
+                                     static_cast<int64_t>(y1[i]), static_cast<int64_t>(y2[i])}};
+        if (flip) {
+            region = {{region[2], region[3], region[0], region[1]}};
+        }
+        origRegions[i] = region;
+    }
+
+    footerInfo footer = getNormalizationInfoForRegion(fname, chr1, chr2, matrix, norm, unit, binsize);
+    FileReader fileReader(fname);
+    vector<vector<contactRecord>> records = getBlockRecordsForRegions(&fileReader, origRegions, footer, deadline);
+    fileReader.close();
+
+    vector<int32_t> region_vec, xActual_vec, yActual_vec;
     vector<float> counts_vec;
-    for (vector<contactRecord>::iterator it=records.begin(); it!=records.end(); ++it) {
-      xActual_vec.push_back(it->binX);
-      yActual_vec.push_back(it->binY);
-      counts_vec.push_back(it->counts);
+    for (size_t r = 0; r < records.size(); r++) {
+        for (const contactRecord &record : records[r]) {
+            region_vec.push_back(static_cast<int32_t>(r + 1));
+            xActual_vec.push_back(record.binX);
+            yActual_vec.push_back(record.binY);
+            counts_vec.push_back(record.counts);
+        }
     }
-    return Rcpp::DataFrame::create(Rcpp::Named("x") = xActual_vec, Rcpp::Named("y") = yActual_vec, Rcpp::Named("counts") = counts_vec);
+    Rcpp::DataFrame result = Rcpp::DataFrame::create(Rcpp::Named("region") = region_vec, Rcpp::Named("x") = xActual_vec,
+                                                     Rcpp::Named("y") = yActual_vec, Rcpp::Named("counts") = counts_vec);
+    flagPartialResult(result, deadline);
+    return result;
 }
 
 vector<chromosome> getChromosomes(string fname){
@@ -21,6 +21,7 @@
  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  THE SOFTWARE.
 */
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <fstream>
@@ -33,6 +34,43 @@
 #include <streambuf>
 #include <curl/curl.h>
 #include <algorithm>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <list>
+#include <deque>
+#include <atomic>
+#include <functional>
+#include <ctime>
+#include <cerrno>
+#include <stdexcept>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <csignal>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define STRAW_HAVE_IO_URING 1
+#endif
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 #include "zlib.h"
 #include "straw.h"
 #include <pybind11/pybind11.h>
@@ -72,21 +110,28 @@ WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
     return realsize;
 }
 
-// get a buffer that can be used as an input stream from the URL
-char *getData(CURL *curl, int64_t position, int64_t chunksize) {
+// fetches the inclusive byte range [position, position + chunksize] from the URL into chunk
+static bool getRange(CURL *curl, int64_t position, int64_t chunksize, MemoryStruct &chunk) {
     std::ostringstream oss;
-    struct MemoryStruct chunk{};
     chunk.memory = static_cast<char *>(malloc(1));
     chunk.size = 0;    /* no data at this point */
     oss << position << "-" << position + chunksize;
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, (void *) &chunk);
     curl_easy_setopt(curl, CURLOPT_RANGE, oss.str().c_str());
     CURLcode res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
+    // a transfer stopped by a queryControl is not an error worth reporting
+    if (res != CURLE_OK && res != CURLE_ABORTED_BY_CALLBACK && res != CURLE_OPERATION_TIMEDOUT) {
         fprintf(stderr, "curl_easy_perform() failed: %s\n",
                 curl_easy_strerror(res));
+        return false;
     }
+    return true;
+}
 
+// get a buffer that can be used as an input stream from the URL
+char *getData(CURL *curl, int64_t position, int64_t chunksize) {
+    struct MemoryStruct chunk{};
+    getRange(curl, position, chunksize, chunk);
     return chunk.memory;
 }
 
@@ -139,7 +184,48 @@ void convertGenomeToBinPos(const int64_t origRegionIndices[4], int64_t regionInd
     }
 }
 
+// false unless the whole of text is a decimal integer
+static bool parseInt64(const string &text, int64_t &value) {
+    char *end = nullptr;
+    errno = 0;
+    long long parsed = strtoll(text.c_str(), &end, 10);
+    if (end == text.c_str() || *end != '\0' || errno == ERANGE) {
+        return false;
+    }
+    value = parsed;
+    return true;
+}
+
+// set on the threads of a straw serve daemon, whose queries must not take the whole daemon down with them
+static thread_local bool servingQuery = false;
+
+// a query that can't go on ends the process with status, as straw always has; on a daemon thread it throws a
+// serveError instead, which the daemon hands to its client
+[[noreturn]] static void failQuery(int32_t status, const string &message) {
+    if (servingQuery) {
+        throw serveError(status, message);
+    }
+    cerr << message << endl;
+    exit(status);
+}
+
+// what the query running on a daemon thread would have printed before giving up on its matrix
+static thread_local string servedDiagnostic;
+
+// a matrix the file doesn't have, which a local query reports on stderr and answers with no records; a daemon thread
+// keeps the message for its client instead
+static void reportMissingMatrix(const string &message) {
+    if (servingQuery) {
+        servedDiagnostic += (servedDiagnostic.empty() ? "" : "\n") + message;
+        return;
+    }
+    cerr << message << endl;
+}
+
 static CURL *initCURL(const char *url) {
+    // curl_easy_init would otherwise do this lazily, which is not thread safe
+    static const bool curlGlobalInit = curl_global_init(CURL_GLOBAL_DEFAULT) == CURLE_OK;
+    (void) curlGlobalInit;
     CURL *curl = curl_easy_init();
     if (curl) {
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
@@ -147,32 +233,483 @@ static CURL *initCURL(const char *url) {
         curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
         curl_easy_setopt(curl, CURLOPT_USERAGENT, "straw");
     } else {
-        cerr << "Unable to initialize curl " << endl;
-        exit(2);
+        failQuery(2, "Unable to initialize curl ");
     }
     return curl;
 }
 
+/*
+  Opt-in on-disk cache of byte ranges fetched from remote .hic files.
+
+  Enabled with setDiskCache() or the STRAW_CACHE_DIR / STRAW_CACHE_SIZE environment variables. Every URL gets
+  its own directory, named by a hash of the URL, holding fixed-size chunk files and a small meta file recording
+  the ETag and Content-Length the chunks were fetched under. When the validator changes the chunks are dropped.
+  The validator is only re-checked every STRAW_CACHE_REVALIDATE seconds (default one day), so repeated runs
+  against the same URL are served entirely from disk.
+
+  Chunk and meta files are written to a temporary name and renamed into place, so concurrent processes only ever
+  see complete files. Reads touch a chunk's mtime, and eviction removes the least recently used chunks once the
+  cache grows past its size cap; an flock on the cache directory keeps two processes from evicting at once.
+ */
+class DiskRangeCache {
+public:
+    static const int64_t chunkSize = 1 << 16;
+
+    static DiskRangeCache &instance() {
+        static DiskRangeCache cache;
+        return cache;
+    }
+
+    void configure(const string &dir, int64_t maxSize) {
+        lock_guard<mutex> lock(mtx);
+        directory = dir;
+        while (!directory.empty() && directory[directory.size() - 1] == '/') {
+            directory.erase(directory.size() - 1);
+        }
+        maxBytes = maxSize;
+        entries.clear();
+        generation++;
+#ifndef _WIN32
+        if (!directory.empty()) {
+            mkdir(directory.c_str(), 0777);
+        }
+#endif
+    }
+
+    bool enabled() {
+        lock_guard<mutex> lock(mtx);
+        return !directory.empty() && maxBytes > 0;
+    }
+
+    // total size of the remote file as recorded by the validator, or -1 if unknown
+    int64_t contentLength(const string &url) {
+        return getEntry(url).length;
+    }
+
+    // fills out with chunksize bytes starting at position; bytes past the end of the file are zeroed. only the
+    // lookup of the URL's entry is serialized, chunk files are safe to read and write from many threads
+    bool read(const string &url, CURL *curl, int64_t position, int64_t chunksize, char *out) {
+        Entry entry = getEntry(url);
+        if (entry.length < 0) {
+            return false;
+        }
+        int64_t end = min(position + chunksize, entry.length);
+        memset(out, 0, static_cast<size_t>(chunksize));
+        if (end <= position) {
+            return true;
+        }
+
+        int64_t firstChunk = position / chunkSize;
+        int64_t lastChunk = (end - 1) / chunkSize;
+        vector<string> chunks(static_cast<size_t>(lastChunk - firstChunk + 1));
+        int64_t missingStart = -1;
+        for (int64_t c = firstChunk; c <= lastChunk + 1; c++) {
+            bool missing = c <= lastChunk && !loadChunk(entry, c, chunks[c - firstChunk]);
+            if (missing && missingStart < 0) {
+                missingStart = c;
+            } else if (!missing && missingStart >= 0) {
+                // fetch each run of missing chunks with a single range request
+                if (!fetchChunks(entry, curl, missingStart, c - 1, chunks, firstChunk)) {
+                    return false;
+                }
+                missingStart = -1;
+            }
+        }
+
+        for (int64_t c = firstChunk; c <= lastChunk; c++) {
+            const string &data = chunks[c - firstChunk];
+            int64_t chunkStart = c * chunkSize;
+            int64_t from = max(position, chunkStart);
+            int64_t to = min(end, chunkStart + static_cast<int64_t>(data.size()));
+            if (to > from) {
+                memcpy(out + (from - position), data.data() + (from - chunkStart), static_cast<size_t>(to - from));
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Entry {
+        string path;
+        string etag;
+        int64_t length = -1;
+        bool validating = false;
+    };
+
+    mutex mtx;
+    condition_variable validatorReady;
+    string directory;
+    int64_t maxBytes = 0;
+    int64_t generation = 0;
+    atomic<int64_t> bytesSinceEviction{0};
+    map<string, Entry> entries;
+
+    DiskRangeCache() {
+        const char *dir = getenv("STRAW_CACHE_DIR");
+        if (dir != nullptr && dir[0] != '\0') {
+            const char *size = getenv("STRAW_CACHE_SIZE");
+            configure(dir, size != nullptr ? parseSize(size) : 4LL << 30);
+        }
+    }
+
+    // accepts plain byte counts or a K/M/G suffix
+    static int64_t parseSize(const string &size) {
+        char *suffix = nullptr;
+        double value = strtod(size.c_str(), &suffix);
+        switch (suffix != nullptr ? toupper(*suffix) : 0) {
+            case 'K': value *= 1LL << 10; break;
+            case 'M': value *= 1LL << 20; break;
+            case 'G': value *= 1LL << 30; break;
+            case 'T': value *= 1LL << 40; break;
+            default: break;
+        }
+        return static_cast<int64_t>(value);
+    }
+
+    // FNV-1a, so that every process maps a URL to the same directory
+    static string hashKey(const string &key) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (unsigned char ch : key) {
+            hash = (hash ^ ch) * 1099511628211ULL;
+        }
+        char hex[17];
+        snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+        return string(hex);
+    }
+
+    static string uniqueSuffix() {
+        static atomic<int> counter(0);
+        stringstream ss;
+#ifndef _WIN32
+        ss << ".tmp." << getpid() << "." << counter++;
+#else
+        ss << ".tmp." << counter++;
+#endif
+        return ss.str();
+    }
+
+    static bool writeAtomically(const string &path, const char *data, size_t size) {
+        string tmp = path + uniqueSuffix();
+        FILE *f = fopen(tmp.c_str(), "wb");
+        if (f == nullptr) {
+            return false;
+        }
+        bool ok = fwrite(data, 1, size, f) == size;
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static size_t headerCallback(char *b, size_t size, size_t nitems, void *userdata) {
+        size_t numbytes = size * nitems;
+        Entry *entry = static_cast<Entry *>(userdata);
+        string line(b, numbytes);
+        string lower = line;
+        transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        if (lower.compare(0, 5, "http/") == 0) {
+            // a new response after a redirect; only the final response counts
+            entry->etag.clear();
+            entry->length = -1;
+        } else if (lower.compare(0, 5, "etag:") == 0) {
+            size_t first = line.find_first_not_of(" \t", 5);
+            size_t last = line.find_last_not_of(" \t\r\n");
+            if (first != string::npos && last != string::npos && last >= first) {
+                entry->etag = line.substr(first, last - first + 1);
+            }
+        } else if (lower.compare(0, 14, "content-range:") == 0) {
+            size_t slash = line.find('/');
+            size_t last = line.find_last_not_of(" \t\r\n");
+            int64_t length;
+            // an unknown total ("*") or a malformed header leaves the length unknown
+            if (slash != string::npos && parseInt64(line.substr(slash + 1, last - slash), length)) {
+                entry->length = length;
+            }
+        }
+        return numbytes;
+    }
+
+    // asks the server for the current ETag and Content-Length with a one byte range request
+    static bool fetchValidator(const string &url, Entry &entry) {
+        CURL *curl = initCURL(url.c_str());
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, headerCallback);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *) &entry);
+        struct MemoryStruct chunk{};
+        bool ok = getRange(curl, 0, 0, chunk);
+        free(chunk.memory);
+        curl_easy_cleanup(curl);
+        return ok && entry.length >= 0;
+    }
+
+    static bool readMeta(const string &path, Entry &entry, int64_t &validated) {
+        ifstream fin(path + "/meta");
+        string url, etag, length, time;
+        if (!getline(fin, url) || !getline(fin, etag) || !getline(fin, length) || !getline(fin, time)) {
+            return false;
+        }
+        // a truncated or garbled meta file is treated as if there were none
+        if (!parseInt64(length, entry.length) || !parseInt64(time, validated)) {
+            return false;
+        }
+        entry.etag = etag;
+        return true;
+    }
+
+    static void writeMeta(const string &path, const string &url, const Entry &entry) {
+        stringstream ss;
+        ss << url << "\n" << entry.etag << "\n" << entry.length << "\n" << static_cast<int64_t>(time(nullptr)) << "\n";
+        string meta = ss.str();
+        writeAtomically(path + "/meta", meta.data(), meta.size());
+    }
+
+    static int64_t revalidateSeconds() {
+        const char *seconds = getenv("STRAW_CACHE_REVALIDATE");
+        int64_t value;
+        return seconds != nullptr && parseInt64(seconds, value) ? value : 86400;
+    }
+
+    // the validator may need a round trip to the server, which happens outside mtx so that a slow server only
+    // holds up reads of its own URL; other threads asking for the same URL wait for the first one's answer
+    Entry getEntry(const string &url) {
+        unique_lock<mutex> lock(mtx);
+        auto it = entries.find(url);
+        while (it != entries.end() && it->second.validating) {
+            validatorReady.wait(lock);
+            it = entries.find(url);
+        }
+        if (it != entries.end()) {
+            return it->second;
+        }
+        entries[url].validating = true;
+        string dir = directory;
+        int64_t started = generation;
+        lock.unlock();
+
+        Entry entry = validate(url, dir);
+
+        lock.lock();
+        if (generation == started) {
+            entries[url] = entry;
+        }
+        validatorReady.notify_all();
+        return entry;
+    }
+
+    static Entry validate(const string &url, const string &dir) {
+        Entry entry;
+#ifndef _WIN32
+        entry.path = dir + "/" + hashKey(url);
+        mkdir(entry.path.c_str(), 0777);
+
+        Entry stored;
+        int64_t validated = 0;
+        bool haveMeta = readMeta(entry.path, stored, validated);
+        if (haveMeta && time(nullptr) - validated < revalidateSeconds()) {
+            entry.etag = stored.etag;
+            entry.length = stored.length;
+            return entry;
+        }
+
+        Entry current;
+        if (!fetchValidator(url, current)) {
+            if (haveMeta) {
+                // server unreachable; keep serving what we have
+                entry.etag = stored.etag;
+                entry.length = stored.length;
+            }
+            return entry;
+        }
+        if (haveMeta && (stored.etag != current.etag || stored.length != current.length)) {
+            removeChunks(entry.path);
+        }
+        entry.etag = current.etag;
+        entry.length = current.length;
+        writeMeta(entry.path, url, entry);
+#endif
+        return entry;
+    }
+
+    string chunkPath(const Entry &entry, int64_t c) const {
+        stringstream ss;
+        ss << entry.path << "/" << c;
+        return ss.str();
+    }
+
+    int64_t expectedChunkSize(const Entry &entry, int64_t c) const {
+        return min(chunkSize, entry.length - c * chunkSize);
+    }
+
+    bool loadChunk(const Entry &entry, int64_t c, string &data) {
+        string path = chunkPath(entry, c);
+        ifstream fin(path, fstream::in | fstream::binary);
+        if (!fin) {
+            return false;
+        }
+        data.resize(static_cast<size_t>(expectedChunkSize(entry, c)));
+        fin.read(&data[0], static_cast<streamsize>(data.size()));
+        if (fin.gcount() != static_cast<streamsize>(data.size()) || fin.peek() != EOF) {
+            return false;
+        }
+#ifndef _WIN32
+        utime(path.c_str(), nullptr); // mark as recently used
+#endif
+        return true;
+    }
+
+    bool fetchChunks(const Entry &entry, CURL *curl, int64_t first, int64_t last, vector<string> &chunks,
+                     int64_t offset) {
+        int64_t start = first * chunkSize;
+        int64_t end = min((last + 1) * chunkSize, entry.length);
+        struct MemoryStruct range{};
+        if (!getRange(curl, start, end - start - 1, range) || static_cast<int64_t>(range.size) < end - start) {
+            free(range.memory);
+            return false;
+        }
+        int64_t written = 0;
+        for (int64_t c = first; c <= last; c++) {
+            int64_t size = expectedChunkSize(entry, c);
+            chunks[c - offset].assign(range.memory + (c - first) * chunkSize, static_cast<size_t>(size));
+            if (writeAtomically(chunkPath(entry, c), chunks[c - offset].data(), static_cast<size_t>(size))) {
+                written += size;
+            }
+        }
+        free(range.memory);
+
+        if ((bytesSinceEviction += written) > maxBytes / 16) {
+            bytesSinceEviction = 0;
+            evict();
+        }
+        return true;
+    }
+
+    static void removeChunks(const string &path) {
+#ifndef _WIN32
+        DIR *dir = opendir(path.c_str());
+        if (dir == nullptr) {
+            return;
+        }
+        while (struct dirent *ent = readdir(dir)) {
+            string name = ent->d_name;
+            if (name != "." && name != ".." && name != "meta") {
+                remove((path + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+#endif
+    }
+
+    // drops least recently used chunks across all URLs until the cache is back under 90% of its cap
+    void evict() {
+#ifndef _WIN32
+        string lockPath = directory + "/.lock";
+        int lockFd = open(lockPath.c_str(), O_CREAT | O_RDWR, 0666);
+        if (lockFd < 0) {
+            return;
+        }
+        if (flock(lockFd, LOCK_EX | LOCK_NB) != 0) {
+            close(lockFd); // someone else is already evicting
+            return;
+        }
+
+        struct CachedChunk {
+            string path;
+            time_t used;
+            int64_t size;
+        };
+        vector<CachedChunk> chunks;
+        int64_t total = 0;
+        DIR *root = opendir(directory.c_str());
+        while (root != nullptr) {
+            struct dirent *ent = readdir(root);
+            if (ent == nullptr) {
+                break;
+            }
+            string entryPath = directory + "/" + ent->d_name;
+            if (ent->d_name[0] == '.') {
+                continue;
+            }
+            DIR *dir = opendir(entryPath.c_str());
+            while (dir != nullptr) {
+                struct dirent *chunk = readdir(dir);
+                if (chunk == nullptr) {
+                    break;
+                }
+                string name = chunk->d_name;
+                struct stat st{};
+                if (name[0] == '.' || name == "meta" || stat((entryPath + "/" + name).c_str(), &st) != 0) {
+                    continue;
+                }
+                chunks.push_back({entryPath + "/" + name, st.st_mtime, static_cast<int64_t>(st.st_size)});
+                total += st.st_size;
+            }
+            if (dir != nullptr) {
+                closedir(dir);
+            }
+        }
+        if (root != nullptr) {
+            closedir(root);
+        }
+
+        if (total > maxBytes) {
+            sort(chunks.begin(), chunks.end(), [](const CachedChunk &a, const CachedChunk &b) {
+                return a.used < b.used;
+            });
+            int64_t target = maxBytes / 10 * 9;
+            for (const CachedChunk &chunk : chunks) {
+                if (total <= target) {
+                    break;
+                }
+                if (remove(chunk.path.c_str()) == 0) {
+                    total -= chunk.size;
+                }
+            }
+        }
+        flock(lockFd, LOCK_UN); // other threads of this process hold their own descriptor, so they are excluded too
+        close(lockFd);
+#endif
+    }
+};
+
+const int64_t DiskRangeCache::chunkSize;
+
+void setDiskCache(const string &directory, int64_t maxBytes) {
+    DiskRangeCache::instance().configure(directory, maxBytes);
+}
+
+// reads from the disk cache when one is configured, otherwise straight from the URL
+char *getData(CURL *curl, const string &url, int64_t position, int64_t chunksize) {
+    DiskRangeCache &cache = DiskRangeCache::instance();
+    if (cache.enabled()) {
+        char *buffer = static_cast<char *>(malloc(static_cast<size_t>(chunksize + 1)));
+        if (cache.read(url, curl, position, chunksize + 1, buffer)) {
+            return buffer;
+        }
+        free(buffer);
+    }
+    return getData(curl, position, chunksize);
+}
+
 class HiCFileStream {
 public:
     string prefix = "http"; // HTTP code
     ifstream fin;
     CURL *curl;
     bool isHttp = false;
+    string fileName;
 
-    explicit HiCFileStream(const string &fileName) {
+    explicit HiCFileStream(const string &fileName) : fileName(fileName) {
         if (std::strncmp(fileName.c_str(), prefix.c_str(), prefix.size()) == 0) {
             isHttp = true;
             curl = initCURL(fileName.c_str());
             if (!curl) {
-                cerr << "URL " << fileName << " cannot be opened for reading" << endl;
-                exit(3);
+                failQuery(3, "URL " + fileName + " cannot be opened for reading");
             }
         } else {
             fin.open(fileName, fstream::in | fstream::binary);
             if (!fin) {
-                cerr << "File " << fileName << " cannot be opened for reading" << endl;
-                exit(4);
+                failQuery(4, "File " + fileName + " cannot be opened for reading");
             }
         }
     }
@@ -187,7 +724,7 @@ public:
 
     char *readCompressedBytes(indexEntry idx) {
         if (isHttp) {
-            return getData(curl, idx.position, idx.size);
+            return getData(curl, fileName, idx.position, idx.size);
         } else {
             char *buffer = new char[idx.size];
             fin.seekg(idx.position, ios::beg);
@@ -205,1040 +742,4983 @@ char *readCompressedBytesFromFile(const string &fileName, indexEntry idx) {
     return compressedBytes;
 }
 
-// reads the header, storing the positions of the normalization vectors and returning the masterIndexPosition pointer
-map<string, chromosome> readHeader(istream &fin, int64_t &masterIndexPosition, string &genomeID, int32_t &numChromosomes,
-                                   int32_t &version, int64_t &nviPosition, int64_t &nviLength) {
-    map<string, chromosome> chromosomeMap;
-    if (!readMagicString(fin)) {
-        cerr << "Hi-C magic string is missing, does not appear to be a hic file" << endl;
-        masterIndexPosition = -1;
-        return chromosomeMap;
+/*
+  Backends for reading all the blocks of a query from a local file in one go:
+    ifstream  - one seekg + read per block, in order (the original behavior)
+    pread     - a pool of threads issuing positional reads, each decompressing what it read
+    io_uring  - reads submitted in batches to the kernel, decompressed as they complete (Linux 5.1+)
+  Selected with setLocalReadBackend() or STRAW_IO_BACKEND; io_uring falls back to pread where the kernel or a
+  sandbox doesn't allow it. Remote files are always read one range request after another.
+ */
+enum class ReadBackend { IFSTREAM, PREAD, IO_URING };
+
+static ReadBackend parseReadBackend(const string &name) {
+    if (name == "pread") {
+        return ReadBackend::PREAD;
+    } else if (name == "io_uring") {
+        return ReadBackend::IO_URING;
+    } else if (name != "ifstream") {
+        cerr << "Unknown read backend " << name << ", must be one of <ifstream/pread/io_uring>" << endl;
     }
+    return ReadBackend::IFSTREAM;
+}
 
-    version = readInt32FromFile(fin);
-    if (version < 6) {
-        cerr << "Version " << version << " no longer supported" << endl;
-        masterIndexPosition = -1;
-        return chromosomeMap;
-    }
-    masterIndexPosition = readInt64FromFile(fin);
-    getline(fin, genomeID, '\0');
+static atomic<ReadBackend> &localReadBackend() {
+    static atomic<ReadBackend> backend(parseReadBackend(getenv("STRAW_IO_BACKEND") != nullptr
+                                                        ? getenv("STRAW_IO_BACKEND") : "ifstream"));
+    return backend;
+}
 
-    if (version > 8) {
-        nviPosition = readInt64FromFile(fin);
-        nviLength = readInt64FromFile(fin);
-    }
+void setLocalReadBackend(const string &name) {
+    localReadBackend() = parseReadBackend(name);
+}
 
-    int32_t nattributes = readInt32FromFile(fin);
+/*
+  One scheduler for the block reads of every file in the process, off until setIoScheduler() turns it on. A read takes
+  a slot before it starts and gives it back once its bytes are in: at most maxInFlight reads run at once, and each
+  priority class has a cap of its own so bulk queries can never hold every slot. Reads that have to wait queue up per
+  class, first come first served. A freed slot goes to a waiting interactive read ahead of batch reads queued before
+  it, except that batch gets one slot for every interactiveShare given to interactive while both were waiting, so
+  bulk queries slow down under interactive load without stalling. A read whose query is stopped leaves the queue.
+ */
+class IoScheduler {
+public:
+    static const int numClasses = 2;
+    static const size_t histogramBuckets = 32;
 
-    // reading and ignoring attribute-value dictionary
-    for (int i = 0; i < nattributes; i++) {
-        string key, value;
-        getline(fin, key, '\0');
-        getline(fin, value, '\0');
+    static IoScheduler &instance() {
+        static IoScheduler scheduler;
+        return scheduler;
     }
 
-    numChromosomes = readInt32FromFile(fin);
-    // chromosome map for finding matrixType
-    for (int i = 0; i < numChromosomes; i++) {
-        string name;
-        int64_t length;
-        getline(fin, name, '\0');
-        if (version > 8) {
-            length = readInt64FromFile(fin);
-        } else {
-            length = (int64_t) readInt32FromFile(fin);
+    void configure(const ioSchedulerOptions &newOptions) {
+        lock_guard<mutex> lock(mtx);
+        options = newOptions;
+        on = options.maxInFlight > 0;
+        for (int c = 0; c < numClasses; c++) {
+            reads[c] = 0;
+            bytes[c] = 0;
+            histograms[c].assign(histogramBuckets, 0);
         }
+        dispatch(); // turning it off, or raising the limits, lets waiting reads go
+    }
 
-        chromosome chr;
-        chr.index = i;
-        chr.name = name;
-        chr.length = length;
-        chromosomeMap[name] = chr;
+    bool enabled() const {
+        return on;
     }
-    return chromosomeMap;
-}
 
-vector<int32_t> readResolutionsFromHeader(istream &fin) {
-    int numBpResolutions = readInt32FromFile(fin);
-    vector<int32_t> resolutions;
-    for (int i = 0; i < numBpResolutions; i++) {
-        int32_t res = readInt32FromFile(fin);
-        resolutions.push_back(res);
+    // waits for a slot; false if the query's control expired first, and the read must then not be issued
+    bool acquire(ioPriority priority, const queryControl *control) {
+        unique_lock<mutex> lock(mtx);
+        deque<Waiter *> &queue = queues[static_cast<int>(priority)];
+        Waiter waiter;
+        queue.push_back(&waiter);
+        dispatch();
+        while (!waiter.granted) {
+            if (control && control->expired()) {
+                queue.erase(find(queue.begin(), queue.end(), &waiter));
+                return false;
+            }
+            if (control) {
+                wakeup.wait_for(lock, chrono::milliseconds(5)); // cancel() doesn't signal, so look every few ms
+            } else {
+                wakeup.wait(lock);
+            }
+        }
+        return true;
     }
-    return resolutions;
-}
 
-//https://www.techiedelight.com/get-slice-sub-vector-from-vector-cpp/
-vector<double> slice(vector<double> &v, int64_t m, int64_t n){
-    vector<double> vec;
-    copy(v.begin() + m, v.begin() + n + 1, back_inserter(vec));
-    return vec;
-}
+    // takes a slot only if one can be had without waiting
+    bool tryAcquire(ioPriority priority) {
+        lock_guard<mutex> lock(mtx);
+        deque<Waiter *> &queue = queues[static_cast<int>(priority)];
+        Waiter waiter;
+        queue.push_back(&waiter);
+        dispatch();
+        if (!waiter.granted) {
+            queue.erase(find(queue.begin(), queue.end(), &waiter));
+        }
+        return waiter.granted;
+    }
 
+    // gives back the slot of a read of size bytes that was queued at the given time
+    void release(ioPriority priority, chrono::steady_clock::time_point queued, int64_t size) {
+        int64_t micros = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - queued).count();
+        size_t bucket = 0;
+        while (bucket + 1 < histogramBuckets && (int64_t(2) << bucket) <= micros) {
+            bucket++;
+        }
+        int c = static_cast<int>(priority);
+        lock_guard<mutex> lock(mtx);
+        running--;
+        classRunning[c]--;
+        reads[c]++;
+        bytes[c] += size;
+        histograms[c][bucket]++;
+        dispatch();
+    }
 
+    vector<ioClassStats> getStats() {
+        lock_guard<mutex> lock(mtx);
+        vector<ioClassStats> stats(numClasses);
+        const char *names[numClasses] = {"interactive", "batch"};
+        for (int c = 0; c < numClasses; c++) {
+            stats[c].name = names[c];
+            stats[c].reads = reads[c];
+            stats[c].bytes = bytes[c];
+            stats[c].waiting = static_cast<int64_t>(queues[c].size());
+            stats[c].inFlight = classRunning[c];
+            stats[c].latencyHistogram = histograms[c];
+        }
+        return stats;
+    }
 
-void populateVectorWithFloats(istream &fin, vector<double> &vector, int64_t nValues) {
-    for (int j = 0; j < nValues; j++) {
-        double v = readFloatFromFile(fin);
-        vector.push_back(v);
+private:
+    struct Waiter {
+        bool granted = false;
+    };
+
+    mutex mtx;
+    condition_variable wakeup;
+    ioSchedulerOptions options;
+    atomic<bool> on{false};
+    deque<Waiter *> queues[numClasses];
+    int64_t running = 0;
+    int64_t classRunning[numClasses] = {0, 0};
+    int64_t interactiveStreak = 0;      // slots given to interactive in a row while batch was waiting
+    int64_t reads[numClasses] = {0, 0};
+    int64_t bytes[numClasses] = {0, 0};
+    vector<int64_t> histograms[numClasses] = {vector<int64_t>(histogramBuckets), vector<int64_t>(histogramBuckets)};
+
+    bool canStart(int c) const {
+        if (queues[c].empty()) {
+            return false;
+        }
+        if (!on) {
+            return true;
+        }
+        int32_t cap = c == static_cast<int>(ioPriority::INTERACTIVE) ? options.maxInteractive : options.maxBatch;
+        return running < options.maxInFlight && (cap <= 0 || classRunning[c] < cap);
     }
-}
 
-void populateVectorWithDoubles(istream &fin, vector<double> &vector, int64_t nValues) {
-    for (int j = 0; j < nValues; j++) {
-        double v = readDoubleFromFile(fin);
-        vector.push_back(v);
+    // hands free slots to the heads of the queues; called with mtx held
+    void dispatch() {
+        const int interactive = static_cast<int>(ioPriority::INTERACTIVE), batch = static_cast<int>(ioPriority::BATCH);
+        bool granted = false;
+        while (true) {
+            bool canInteractive = canStart(interactive), canBatch = canStart(batch);
+            int c;
+            if (canInteractive && canBatch) {
+                bool batchTurn = options.interactiveShare > 0 && interactiveStreak >= options.interactiveShare;
+                c = batchTurn ? batch : interactive;
+            } else if (canInteractive || canBatch) {
+                c = canInteractive ? interactive : batch;
+            } else {
+                break;
+            }
+            queues[c].front()->granted = true;
+            queues[c].pop_front();
+            running++;
+            classRunning[c]++;
+            interactiveStreak = c == interactive && !queues[batch].empty() ? interactiveStreak + 1 : 0;
+            granted = true;
+        }
+        if (granted) {
+            wakeup.notify_all();
+        }
     }
+};
+
+const int IoScheduler::numClasses;
+const size_t IoScheduler::histogramBuckets;
+
+void setIoScheduler(const ioSchedulerOptions &options) {
+    IoScheduler::instance().configure(options);
 }
 
-void readThroughExpectedVector(int32_t version, istream &fin, vector<double> &expectedValues, int64_t nValues,
-                               bool store, int32_t resolution) {
-    if (store) {
-        if (version > 8) {
-            populateVectorWithFloats(fin, expectedValues, nValues);
-        } else {
-            populateVectorWithDoubles(fin, expectedValues, nValues);
-        }
-    } else if (nValues > 0) {
-        if (version > 8) {
-            fin.seekg(nValues*sizeof(float), ios_base::cur);
-        } else {
-            fin.seekg(nValues*sizeof(double), ios_base::cur);
+vector<ioClassStats> getIoSchedulerStats() {
+    return IoScheduler::instance().getStats();
+}
+
+// the scheduler slot of one block read, taken on construction when the scheduler is on. granted is false if the
+// query was stopped while waiting for it; the slot is given back by done() or on destruction
+class IoSlot {
+public:
+    bool granted = true;
+
+    IoSlot(ioPriority priority, const queryControl *control, int64_t size) :
+            priority(priority), size(size), queued(chrono::steady_clock::now()) {
+        if (IoScheduler::instance().enabled()) {
+            held = granted = IoScheduler::instance().acquire(priority, control);
         }
     }
-}
 
-void readThroughNormalizationFactors(istream &fin, int32_t version, bool store, vector<double> &expectedValues,
-                                     int32_t c1) {
-    int32_t nNormalizationFactors = readInt32FromFile(fin);
-    if (store){
-        for (int j = 0; j < nNormalizationFactors; j++) {
-            int32_t chrIdx = readInt32FromFile(fin);
-            double v;
-            if (version > 8) {
-                v = readFloatFromFile(fin);
-            } else {
-                v = readDoubleFromFile(fin);
-            }
-            if(chrIdx == c1) {
-                for (double &expectedValue : expectedValues) {
-                    expectedValue = expectedValue / v;
-                }
-            }
+    IoSlot(const IoSlot &) = delete;
+    IoSlot &operator=(const IoSlot &) = delete;
+
+    ~IoSlot() {
+        done();
+    }
+
+    void done() {
+        if (held) {
+            IoScheduler::instance().release(priority, queued, size);
+            held = false;
         }
-    } else if (nNormalizationFactors > 0) {
-        if (version > 8) {
-            fin.seekg(nNormalizationFactors * (sizeof(int32_t)+sizeof(float)), ios_base::cur);
-        } else {
-            fin.seekg(nNormalizationFactors * (sizeof(int32_t)+sizeof(double)), ios_base::cur);
+    }
+
+private:
+    ioPriority priority;
+    int64_t size;
+    chrono::steady_clock::time_point queued;
+    bool held = false;
+};
+
+// called once for every block read, with the block's position in the batch and its compressed bytes
+typedef function<void(size_t, char *)> BlockReadCallback;
+
+#ifndef _WIN32
+static void preadFully(int fd, char *buffer, int64_t size, int64_t position) {
+    int64_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buffer + done, static_cast<size_t>(size - done), static_cast<off_t>(position + done));
+        if (n <= 0) {
+            memset(buffer + done, 0, static_cast<size_t>(size - done)); // truncated file; decodes to nothing
+            return;
         }
+        done += n;
     }
 }
 
-// reads the footer from the master pointer location. takes in the chromosomes,
-// norm, unit (BP or FRAG) and resolution or binsize, and sets the file
-// position of the matrix and the normalization vectors for those chromosomes
-// at the given normalization and resolution
-bool readFooter(istream &fin, int64_t master, int32_t version, int32_t c1, int32_t c2, const string &matrixType, const string &norm,
-                const string &unit, int32_t resolution, int64_t &myFilePos,
-                indexEntry &c1NormEntry, indexEntry &c2NormEntry, vector<double> &expectedValues) {
+static int openForPread(const string &fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        failQuery(4, "File " + fileName + " cannot be opened for reading");
+    }
+    return fd;
+}
 
-    if (version > 8) {
-        int64_t nBytes = readInt64FromFile(fin);
-    } else {
-        int32_t nBytes = readInt32FromFile(fin);
+/*
+  The threads behind the pread backend, started on first use and kept for the life of the process. A batch queues one
+  task per helper it wants and also works on the calling thread; tasks no helper has picked up by the time the caller
+  runs out of reads are withdrawn again, so a pool busy with other batches never holds a batch up.
+ */
+class PreadPool {
+public:
+    static PreadPool &instance() {
+        // never destroyed, so that exit() doesn't have to stop its threads
+        static PreadPool *pool = new PreadPool(max(2u, min(8u, thread::hardware_concurrency())) - 1);
+        return *pool;
     }
 
-    stringstream ss;
-    ss << c1 << "_" << c2;
-    string key = ss.str();
+    // runs work on the calling thread and on up to helpers pool threads, and returns once every copy has finished
+    void run(size_t helpers, const function<void()> &work) {
+        Batch batch{&work, 0};
+        {
+            lock_guard<mutex> lock(mtx);
+            for (size_t h = 0; h < min(helpers, threads.size()); h++) {
+                tasks.push_back(&batch);
+            }
+        }
+        wakeup.notify_all();
+        work();
+        unique_lock<mutex> lock(mtx);
+        tasks.erase(remove(tasks.begin(), tasks.end(), &batch), tasks.end());
+        finished.wait(lock, [&batch] { return batch.running == 0; });
+    }
 
-    int32_t nEntries = readInt32FromFile(fin);
-    bool found = false;
-    for (int i = 0; i < nEntries; i++) {
-        string str;
-        getline(fin, str, '\0');
-        int64_t fpos = readInt64FromFile(fin);
-        int32_t sizeinbytes = readInt32FromFile(fin);
-        if (str == key) {
-            myFilePos = fpos;
-            found = true;
+private:
+    struct Batch {
+        const function<void()> *work;
+        size_t running;
+    };
+
+    mutex mtx;
+    condition_variable wakeup;
+    condition_variable finished;
+    deque<Batch *> tasks;
+    vector<thread> threads;
+
+    explicit PreadPool(size_t size) {
+        for (size_t t = 0; t < size; t++) {
+            threads.emplace_back(&PreadPool::runHelper, this);
         }
     }
-    if (!found) {
-        cerr << "File doesn't have the given chr_chr map " << key << endl;
-        return false;
+
+    void runHelper() {
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            wakeup.wait(lock, [this] { return !tasks.empty(); });
+            Batch *batch = tasks.front();
+            tasks.pop_front();
+            batch->running++;
+            lock.unlock();
+            (*batch->work)();
+            lock.lock();
+            batch->running--;
+            finished.notify_all();
+        }
     }
+};
 
-    if ((matrixType == "observed" && norm == "NONE") || ((matrixType == "oe" || matrixType == "expected") && norm == "NONE" && c1 != c2))
-        return true; // no need to read norm vector index
+static void readBlocksWithPread(const string &fileName, const vector<indexEntry> &entries,
+                                const BlockReadCallback &onRead, const queryControl *control, ioPriority priority) {
+    int fd = openForPread(fileName);
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        vector<char> buffer;
+        for (size_t i = next++; i < entries.size(); i = next++) {
+            if (control && control->expired()) {
+                break;
+            }
+            IoSlot slot(priority, control, entries[i].size);
+            if (!slot.granted) {
+                break;
+            }
+            buffer.resize(static_cast<size_t>(entries[i].size));
+            preadFully(fd, buffer.data(), entries[i].size, entries[i].position);
+            slot.done();
+            onRead(i, buffer.data());
+        }
+    };
+    PreadPool::instance().run(entries.size() - 1, worker);
+    close(fd);
+}
+#endif
 
-    // read in and ignore expected value maps; don't store; reading these to
-    // get to norm vector index
-    int32_t nExpectedValues = readInt32FromFile(fin);
-    for (int i = 0; i < nExpectedValues; i++) {
-        string unit0;
-        getline(fin, unit0, '\0'); //unit
-        int32_t binSize = readInt32FromFile(fin);
+#ifdef STRAW_HAVE_IO_URING
+// bare bones io_uring ring (no liburing dependency) used only for batches of reads
+class IoUring {
+public:
+    static const unsigned depth = 64;
 
-        int64_t nValues;
-        if (version > 8) {
-            nValues = readInt64FromFile(fin);
-        } else {
-            nValues = (int64_t) readInt32FromFile(fin);
+    IoUring() {
+        io_uring_params params{};
+        ringFd = static_cast<int>(syscall(__NR_io_uring_setup, depth, &params));
+        if (ringFd < 0) {
+            return;
         }
-
-        bool store = c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE" && unit0 == unit && binSize == resolution;
-        readThroughExpectedVector(version, fin, expectedValues, nValues, store, resolution);
-        readThroughNormalizationFactors(fin, version, store, expectedValues, c1);
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (singleMmap) {
+            sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+        }
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd,
+                      IORING_OFF_SQ_RING);
+        cqRing = singleMmap ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                            ringFd, IORING_OFF_CQ_RING);
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                ringFd, IORING_OFF_SQES));
+        if (sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+            close(ringFd);
+            ringFd = -1;
+            return;
+        }
+        char *sq = static_cast<char *>(sqRing);
+        char *cq = static_cast<char *>(cqRing);
+        sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
     }
 
-    if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE") {
-        if (expectedValues.empty()) {
-            cerr << "File did not contain expected values vectors at " << resolution << " " << unit << endl;
-            return false;
+    ~IoUring() {
+        if (ringFd < 0) {
+            return;
         }
-        return true;
+        munmap(sqes, sqesSize);
+        if (cqRing != sqRing) {
+            munmap(cqRing, cqRingSize);
+        }
+        munmap(sqRing, sqRingSize);
+        close(ringFd);
     }
 
-    nExpectedValues = readInt32FromFile(fin);
-    for (int i = 0; i < nExpectedValues; i++) {
-        string type, unit0;
-        getline(fin, type, '\0'); //typeString
-        getline(fin, unit0, '\0'); //unit
-        int32_t binSize = readInt32FromFile(fin);
+    bool usable() const {
+        return ringFd >= 0 && !broken;
+    }
 
-        int64_t nValues;
-        if (version > 8) {
-            nValues = readInt64FromFile(fin);
-        } else {
-            nValues = (int64_t) readInt32FromFile(fin);
+    void queueRead(int fd, iovec *iov, int64_t offset, uint64_t userData) {
+        unsigned tail = *sqTail;
+        unsigned index = tail & sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READV;
+        sqe->fd = fd;
+        sqe->off = static_cast<uint64_t>(offset);
+        sqe->addr = reinterpret_cast<uint64_t>(iov);
+        sqe->len = 1;
+        sqe->user_data = userData;
+        sqArray[index] = index;
+        __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+        pending++;
+    }
+
+    // submits what has been queued and waits for at least one completion
+    bool submitAndWait(unsigned toSubmit) {
+        while (true) {
+            long ret = syscall(__NR_io_uring_enter, ringFd, toSubmit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (ret >= 0) {
+                return true;
+            }
+            if (errno != EINTR) {
+                return false;
+            }
         }
-        bool store = c1 == c2 && (matrixType == "oe" || matrixType == "expected") && type == norm && unit0 == unit && binSize == resolution;
-        readThroughExpectedVector(version, fin, expectedValues, nValues, store, resolution);
-        readThroughNormalizationFactors(fin, version, store, expectedValues, c1);
     }
 
-    if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm != "NONE") {
-        if (expectedValues.empty()) {
-            cerr << "File did not contain normalized expected values vectors at " << resolution << " " << unit << endl;
+    bool nextCompletion(uint64_t &userData, int &result) {
+        unsigned head = *cqHead;
+        if (head == __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
             return false;
         }
+        io_uring_cqe *cqe = &cqes[head & cqMask];
+        userData = cqe->user_data;
+        result = cqe->res;
+        __atomic_store_n(cqHead, head + 1, __ATOMIC_RELEASE);
+        pending--;
+        return true;
     }
 
-    // Index of normalization vectors
-    nEntries = readInt32FromFile(fin);
-    bool found1 = false;
-    bool found2 = false;
-    for (int i = 0; i < nEntries; i++) {
-        string normtype;
-        getline(fin, normtype, '\0'); //normalization type
-        int32_t chrIdx = readInt32FromFile(fin);
-        string unit1;
-        getline(fin, unit1, '\0'); //unit
-        int32_t resolution1 = readInt32FromFile(fin);
-        int64_t filePosition = readInt64FromFile(fin);
-        int64_t sizeInBytes;
-        if (version > 8) {
-            sizeInBytes = readInt64FromFile(fin);
-        } else {
-            sizeInBytes = (int64_t) readInt32FromFile(fin);
+    // empties the ring after a failed submitAndWait: reads the kernel hasn't taken yet are withdrawn, and the
+    // completions of the ones it has are waited for and dropped, so that none of them outlives the batch or turns up
+    // in the next one. returns false, and gives the ring up for good, if even waiting fails
+    bool drain() {
+        unsigned head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        pending -= *sqTail - head;
+        __atomic_store_n(sqTail, head, __ATOMIC_RELEASE);
+        uint64_t userData;
+        int result;
+        while (pending > 0) {
+            if (!nextCompletion(userData, result) && !submitAndWait(0)) {
+                broken = true;
+                return false;
+            }
         }
+        return true;
+    }
 
-        if (chrIdx == c1 && normtype == norm && unit1 == unit && resolution1 == resolution) {
-            c1NormEntry.position = filePosition;
-            c1NormEntry.size = sizeInBytes;
-            found1 = true;
+private:
+    int ringFd = -1;
+    unsigned pending = 0;
+    bool broken = false;
+    void *sqRing = MAP_FAILED;
+    void *cqRing = MAP_FAILED;
+    size_t sqRingSize = 0, cqRingSize = 0, sqesSize = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr, *cqHead = nullptr, *cqTail = nullptr;
+    unsigned sqMask = 0, cqMask = 0;
+    io_uring_cqe *cqes = nullptr;
+};
+
+const unsigned IoUring::depth;
+
+// returns false without reading anything if io_uring isn't available
+static bool readBlocksWithIoUring(const string &fileName, const vector<indexEntry> &entries,
+                                  const BlockReadCallback &onRead, const queryControl *control, ioPriority priority) {
+    thread_local IoUring ring;
+    if (!ring.usable()) {
+        return false;
+    }
+    int fd = openForPread(fileName);
+    vector<vector<char>> buffers(entries.size());
+    vector<iovec> iovecs(entries.size());
+    vector<bool> completed(entries.size(), false);
+    // with the scheduler on every read in the ring holds a slot. the ring only blocks on a slot while it is empty,
+    // since the reads it has in flight only give theirs back once their completions are reaped
+    IoScheduler &scheduler = IoScheduler::instance();
+    vector<chrono::steady_clock::time_point> queued(entries.size());
+    vector<bool> holding(entries.size(), false);
+    size_t next = 0, inFlight = 0, done = 0;
+    while (done < entries.size()) {
+        unsigned toSubmit = 0;
+        // once the query is stopped nothing new is queued, and only the reads in flight are waited for
+        bool stopped = control && control->expired();
+        while (!stopped && next < entries.size() && inFlight < IoUring::depth) {
+            if (scheduler.enabled()) {
+                queued[next] = chrono::steady_clock::now();
+                bool slot = inFlight == 0 ? scheduler.acquire(priority, control) : scheduler.tryAcquire(priority);
+                if (!slot) {
+                    break;
+                }
+                holding[next] = true;
+            }
+            buffers[next].resize(static_cast<size_t>(entries[next].size));
+            iovecs[next].iov_base = buffers[next].data();
+            iovecs[next].iov_len = buffers[next].size();
+            ring.queueRead(fd, &iovecs[next], entries[next].position, next);
+            next++;
+            inFlight++;
+            toSubmit++;
         }
-        if (chrIdx == c2 && normtype == norm && unit1 == unit && resolution1 == resolution) {
-            c2NormEntry.position = filePosition;
-            c2NormEntry.size = sizeInBytes;
-            found2 = true;
+        if (inFlight == 0) {
+            break;
+        }
+        if (!ring.submitAndWait(toSubmit)) {
+            // ring broke mid-batch; finish what is left synchronously
+            if (!ring.drain()) {
+                // the kernel may still be writing into these, so they are leaked rather than freed under it
+                new vector<vector<char>>(std::move(buffers));
+                new vector<iovec>(std::move(iovecs));
+            }
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (holding[i] && !completed[i]) {
+                    scheduler.release(priority, queued[i], 0);
+                }
+            }
+            vector<char> buffer;
+            for (size_t i = 0; i < entries.size(); i++) {
+                if (control && control->expired()) {
+                    break;
+                }
+                if (!completed[i]) {
+                    IoSlot slot(priority, control, entries[i].size);
+                    if (!slot.granted) {
+                        break;
+                    }
+                    buffer.resize(static_cast<size_t>(entries[i].size));
+                    preadFully(fd, buffer.data(), entries[i].size, entries[i].position);
+                    slot.done();
+                    onRead(i, buffer.data());
+                }
+            }
+            close(fd);
+            return true;
+        }
+        uint64_t i;
+        int result;
+        while (ring.nextCompletion(i, result)) {
+            inFlight--;
+            done++;
+            completed[i] = true;
+            if (result < static_cast<int>(entries[i].size)) {
+                // short read or error; redo it the plain way
+                preadFully(fd, buffers[i].data(), entries[i].size, entries[i].position);
+            }
+            if (holding[i]) {
+                scheduler.release(priority, queued[i], entries[i].size);
+            }
+            onRead(i, buffers[i].data()); // decompress while the device works on the rest
+            vector<char>().swap(buffers[i]);
         }
     }
-    if (!found1 || !found2) {
-        cerr << "File did not contain " << norm << " normalization vectors for one or both chromosomes at "
-             << resolution << " " << unit << endl;
-    }
+    close(fd);
     return true;
 }
+#endif
 
-indexEntry readIndexEntry(istream &fin) {
-    int64_t filePosition = readInt64FromFile(fin);
-    int32_t blockSizeInBytes = readInt32FromFile(fin);
-    indexEntry entry = indexEntry();
-    entry.size = (int64_t) blockSizeInBytes;
-    entry.position = filePosition;
-    return entry;
+// curl progress callback for the reads of a stopped query; returning non-zero aborts the transfer
+static int abortStoppedQuery(void *control, curl_off_t, curl_off_t, curl_off_t, curl_off_t) {
+    return static_cast<const queryControl *>(control)->expired() ? 1 : 0;
 }
 
-void setValuesForMZD(istream &fin, const string &myunit, float &mySumCounts, int32_t &mybinsize, int32_t &myBlockBinCount,
-                     int32_t &myBlockColumnCount, bool &found) {
-    string unit;
-    getline(fin, unit, '\0'); // unit
-    readInt32FromFile(fin); // Old "zoom" index -- not used
-    float sumCounts = readFloatFromFile(fin); // sumCounts
-    readFloatFromFile(fin); // occupiedCellCount
-    readFloatFromFile(fin); // stdDev
-    readFloatFromFile(fin); // percent95
-    int32_t binSize = readInt32FromFile(fin);
-    int32_t blockBinCount = readInt32FromFile(fin);
-    int32_t blockColumnCount = readInt32FromFile(fin);
-    found = false;
-    if (myunit == unit && mybinsize == binSize) {
-        mySumCounts = sumCounts;
-        myBlockBinCount = blockBinCount;
-        myBlockColumnCount = blockColumnCount;
-        found = true;
+/*
+  Hedging for the range requests that read the blocks of remote files, off until setHedging() or
+  STRAW_HEDGE_PERCENTILE turns it on. A read still running after the configured percentile of the latencies of the
+  last few hundred block reads gets a duplicate request on a second connection; the first answer is used and the
+  other request is dropped. Duplicates draw on a budget that grows by maxExtraLoad with every read, so they stay a
+  bounded share of the traffic even when the whole server slows down.
+ */
+class HedgePolicy {
+public:
+    static const size_t window = 256;       // latencies the percentile is taken over
+    static const size_t minSamples = 16;    // latencies needed before minDelayMs gives way to the percentile
+    static constexpr double maxBudget = 8;  // duplicates that can be saved up for a burst of slow reads
+
+    static HedgePolicy &instance() {
+        static HedgePolicy policy;
+        return policy;
     }
-}
 
-void populateBlockMap(istream &fin, int32_t nBlocks, map<int32_t, indexEntry> &blockMap) {
-    for (int b = 0; b < nBlocks; b++) {
-        int32_t blockNumber = readInt32FromFile(fin);
-        blockMap[blockNumber] = readIndexEntry(fin);
+    void configure(const hedgeOptions &newOptions) {
+        lock_guard<mutex> lock(mtx);
+        options = newOptions;
+        on = options.percentile > 0 && options.maxExtraLoad > 0;
+        latencies.clear();
+        next = 0;
+        budget = 1;
+        stats = hedgeStats();
     }
-}
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
-map<int32_t, indexEntry> readMatrixZoomData(istream &fin, const string &myunit, int32_t mybinsize, float &mySumCounts,
-                                            int32_t &myBlockBinCount, int32_t &myBlockColumnCount, bool &found) {
+    bool enabled() const {
+        return on;
+    }
 
-    map<int32_t, indexEntry> blockMap;
-    setValuesForMZD(fin, myunit, mySumCounts, mybinsize, myBlockBinCount, myBlockColumnCount, found);
+    // a read is starting; returns how long it may run before it should be hedged
+    chrono::microseconds startRead() {
+        lock_guard<mutex> lock(mtx);
+        stats.reads++;
+        budget = min(maxBudget, budget + options.maxExtraLoad);
+        return delay();
+    }
 
-    int32_t nBlocks = readInt32FromFile(fin);
-    if (found){
-        populateBlockMap(fin, nBlocks, blockMap);
-    } else {
-        fin.seekg(nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)), ios_base::cur);
+    // whether a read past its delay may send a duplicate
+    bool takeHedge() {
+        lock_guard<mutex> lock(mtx);
+        if (budget < 1) {
+            stats.hedgesDenied++;
+            return false;
+        }
+        budget -= 1;
+        stats.hedgesIssued++;
+        return true;
     }
-    return blockMap;
-}
 
-// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
-map<int32_t, indexEntry> readMatrixZoomDataHttp(CURL *curl, int64_t &myFilePosition, const string &myunit, int32_t mybinsize,
-                                                float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount,
-                                                bool &found) {
+    // a read got its answer after latency. when the duplicate won, latency is the duplicate's own and the request
+    // it duplicated, dropped unfinished, counts as taking primaryElapsed: censored at the win, but without it only
+    // the fast duplicates would be recorded and the percentile would drift down while the server is slow
+    void finishRead(chrono::microseconds latency, bool hedgeWon,
+                    chrono::microseconds primaryElapsed = chrono::microseconds::zero()) {
+        lock_guard<mutex> lock(mtx);
+        record(latency);
+        if (hedgeWon) {
+            record(primaryElapsed);
+            stats.hedgesWon++;
+        }
+    }
 
-    map<int32_t, indexEntry> blockMap;
-    int32_t header_size = 5 * sizeof(int32_t) + 4 * sizeof(float);
-    char *first = getData(curl, myFilePosition, 1);
-    if (first[0] == 'B') {
-        header_size += 3;
-    } else if (first[0] == 'F') {
-        header_size += 5;
-    } else {
-        cerr << "Unit not understood" << endl;
+    hedgeStats getStats() {
+        lock_guard<mutex> lock(mtx);
+        hedgeStats current = stats;
+        current.delayMs = chrono::duration_cast<chrono::milliseconds>(delay()).count();
+        return current;
+    }
+
+private:
+    mutex mtx;
+    hedgeOptions options;
+    atomic<bool> on{false};
+    vector<int64_t> latencies;  // microseconds, a ring once window are in
+    size_t next = 0;
+    double budget = 1;
+    hedgeStats stats;
+
+    HedgePolicy() {
+        const char *percentile = getenv("STRAW_HEDGE_PERCENTILE");
+        if (percentile != nullptr && percentile[0] != '\0') {
+            hedgeOptions fromEnvironment;
+            fromEnvironment.percentile = strtod(percentile, nullptr) / 100;
+            configure(fromEnvironment);
+        }
+    }
+
+    // called with mtx held
+    void record(chrono::microseconds latency) {
+        if (latencies.size() < window) {
+            latencies.push_back(latency.count());
+        } else {
+            latencies[next] = latency.count();
+            next = (next + 1) % window;
+        }
+    }
+
+    // called with mtx held
+    chrono::microseconds delay() const {
+        chrono::microseconds floor = chrono::milliseconds(options.minDelayMs);
+        if (latencies.size() < minSamples) {
+            return floor;
+        }
+        vector<int64_t> sorted(latencies);
+        size_t rank = min(sorted.size() - 1, static_cast<size_t>(options.percentile * sorted.size()));
+        nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+        return max(floor, chrono::microseconds(sorted[rank]));
+    }
+};
+
+const size_t HedgePolicy::window;
+const size_t HedgePolicy::minSamples;
+constexpr double HedgePolicy::maxBudget;
+
+void setHedging(const hedgeOptions &options) {
+    HedgePolicy::instance().configure(options);
+}
+
+hedgeStats getHedgeStats() {
+    return HedgePolicy::instance().getStats();
+}
+
+// reads blocks of one remote file with hedging. the request goes out on the caller's connection and a duplicate, if
+// one is sent, on a second connection kept for the reader's lifetime; both are driven from the calling thread
+// through a curl multi handle, and the slower one is dropped as soon as the other has answered
+class HedgedRangeReader {
+public:
+    explicit HedgedRangeReader(const string &url) : url(url) {}
+
+    HedgedRangeReader(const HedgedRangeReader &) = delete;
+    HedgedRangeReader &operator=(const HedgedRangeReader &) = delete;
+
+    ~HedgedRangeReader() {
+        if (duplicate) {
+            curl_easy_cleanup(duplicate);
+        }
+        if (multi) {
+            curl_multi_cleanup(multi);
+        }
+    }
+
+    // the bytes of the block in a malloc'd buffer, as getData returns them. with a control, both requests stop
+    // once it has expired
+    char *read(CURL *curl, indexEntry idx, const queryControl *control) {
+        HedgePolicy &policy = HedgePolicy::instance();
+        chrono::microseconds delay = policy.startRead();
+        if (!multi) {
+            multi = curl_multi_init();
+        }
+        string range = to_string(idx.position) + "-" + to_string(idx.position + idx.size);
+        Attempt attempts[2];
+        start(attempts[0], curl, range);
+        auto begin = chrono::steady_clock::now();
+        auto hedgeBegin = begin;
+        int winner = -1, running = 1;
+        bool hedged = false;
+        while (running > 0 && !(control && control->expired())) {
+            int active;
+            curl_multi_perform(multi, &active);
+            int left;
+            CURLMsg *message;
+            while ((message = curl_multi_info_read(multi, &left)) != nullptr) {
+                if (message->msg != CURLMSG_DONE) {
+                    continue;
+                }
+                int a = message->easy_handle == attempts[0].handle ? 0 : 1;
+                attempts[a].result = message->data.result;
+                attempts[a].running = false;
+                running--;
+                if (attempts[a].result == CURLE_OK && winner < 0) {
+                    winner = a;
+                }
+            }
+            if (winner >= 0) {
+                break;
+            }
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - begin);
+            if (!hedged && running > 0 && elapsed >= delay) {
+                hedged = true;
+                if (policy.takeHedge()) {
+                    if (!duplicate) {
+                        duplicate = initCURL(url.c_str());
+                    }
+                    stopWith(duplicate, control);
+                    start(attempts[1], duplicate, range);
+                    hedgeBegin = chrono::steady_clock::now();
+                    running++;
+                }
+            }
+            // wakes up on any transfer activity; the cap is how often a stopped query is noticed
+            int64_t waitMs = 50;
+            if (!hedged) {
+                waitMs = min(waitMs, max<int64_t>(1, chrono::duration_cast<chrono::milliseconds>(delay - elapsed).count()));
+            }
+            curl_multi_wait(multi, nullptr, 0, static_cast<int>(waitMs), nullptr);
+        }
+
+        for (Attempt &attempt : attempts) {
+            if (attempt.handle) {
+                curl_multi_remove_handle(multi, attempt.handle);
+            }
+        }
+        if (winner >= 0) {
+            auto now = chrono::steady_clock::now();
+            auto elapsed = chrono::duration_cast<chrono::microseconds>(now - begin);
+            if (winner == 1) {
+                policy.finishRead(chrono::duration_cast<chrono::microseconds>(now - hedgeBegin), true, elapsed);
+            } else {
+                policy.finishRead(elapsed, false);
+            }
+        } else {
+            // a transfer stopped by a queryControl is not an error worth reporting
+            for (Attempt &attempt : attempts) {
+                if (attempt.handle && !attempt.running && attempt.result != CURLE_ABORTED_BY_CALLBACK &&
+                    attempt.result != CURLE_OPERATION_TIMEDOUT) {
+                    fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(attempt.result));
+                }
+            }
+        }
+        int kept = winner >= 0 ? winner : 0;
+        free(attempts[1 - kept].data.memory);
+        return attempts[kept].data.memory;
+    }
+
+private:
+    struct Attempt {
+        CURL *handle = nullptr;
+        MemoryStruct data{nullptr, 0};
+        bool running = false;
+        CURLcode result = CURLE_OK;
+    };
+
+    string url;
+    CURLM *multi = nullptr;
+    CURL *duplicate = nullptr;
+
+    void start(Attempt &attempt, CURL *handle, const string &range) {
+        attempt.handle = handle;
+        attempt.data.memory = static_cast<char *>(malloc(1));
+        attempt.data.size = 0;
+        attempt.running = true;
+        curl_easy_setopt(handle, CURLOPT_WRITEDATA, (void *) &attempt.data);
+        curl_easy_setopt(handle, CURLOPT_RANGE, range.c_str());
+        curl_multi_add_handle(multi, handle);
+    }
+
+    // gives the duplicate connection the same stopping rules readBlocks gave the caller's
+    static void stopWith(CURL *handle, const queryControl *control) {
+        if (!control) {
+            return;
+        }
+        curl_easy_setopt(handle, CURLOPT_XFERINFOFUNCTION, abortStoppedQuery);
+        curl_easy_setopt(handle, CURLOPT_XFERINFODATA, (void *) control);
+        curl_easy_setopt(handle, CURLOPT_NOPROGRESS, 0L);
+        if (control->deadline.load() != chrono::steady_clock::time_point::max()) {
+            auto left = chrono::duration_cast<chrono::milliseconds>(control->deadline.load() - chrono::steady_clock::now());
+            curl_easy_setopt(handle, CURLOPT_TIMEOUT_MS, static_cast<long>(max<int64_t>(1, left.count())));
+        }
+    }
+};
+
+// reads every entry of a query from the file, in whatever order the backend completes them. with a control, entries
+// are no longer read once it has expired and onRead isn't called for them; remote reads in flight are aborted. each
+// read waits for a slot of the I/O scheduler in the given class when the scheduler is on, and slow remote reads are
+// hedged when hedging is on
+void readBlocks(const string &fileName, const vector<indexEntry> &entries, const BlockReadCallback &onRead,
+                const queryControl *control = nullptr, ioPriority priority = ioPriority::INTERACTIVE) {
+    if (entries.empty()) {
+        return;
+    }
+    bool isHttp = std::strncmp(fileName.c_str(), "http", 4) == 0;
+    ReadBackend backend = localReadBackend();
+#ifdef STRAW_HAVE_IO_URING
+    if (!isHttp && backend == ReadBackend::IO_URING) {
+        if (readBlocksWithIoUring(fileName, entries, onRead, control, priority)) {
+            return;
+        }
+        backend = ReadBackend::PREAD;
+    }
+#endif
+#ifndef _WIN32
+    if (!isHttp && backend != ReadBackend::IFSTREAM) {
+        readBlocksWithPread(fileName, entries, onRead, control, priority);
+        return;
+    }
+#endif
+    HiCFileStream stream(fileName);
+    bool hasDeadline = control && control->deadline.load() != chrono::steady_clock::time_point::max();
+    bool hedge = stream.isHttp && HedgePolicy::instance().enabled() && !DiskRangeCache::instance().enabled();
+    HedgedRangeReader hedgedReader(fileName);
+    if (stream.isHttp && control) {
+        curl_easy_setopt(stream.curl, CURLOPT_XFERINFOFUNCTION, abortStoppedQuery);
+        curl_easy_setopt(stream.curl, CURLOPT_XFERINFODATA, (void *) control);
+        curl_easy_setopt(stream.curl, CURLOPT_NOPROGRESS, 0L);
+    }
+    for (size_t i = 0; i < entries.size(); i++) {
+        if (control && control->expired()) {
+            break;
+        }
+        IoSlot slot(priority, control, entries[i].size);
+        if (!slot.granted) {
+            break;
+        }
+        if (stream.isHttp && hasDeadline) {
+            // progress callbacks can be a second apart while a server stalls, so the deadline is also a timeout
+            auto left = chrono::duration_cast<chrono::milliseconds>(control->deadline.load() - chrono::steady_clock::now());
+            curl_easy_setopt(stream.curl, CURLOPT_TIMEOUT_MS, static_cast<long>(max<int64_t>(1, left.count())));
+        }
+        char *compressedBytes = hedge ? hedgedReader.read(stream.curl, entries[i], control)
+                                      : stream.readCompressedBytes(entries[i]);
+        slot.done();
+        // an aborted transfer leaves a partial block behind
+        if (!(stream.isHttp && control && control->expired())) {
+            onRead(i, compressedBytes);
+        }
+        if (stream.isHttp) {
+            free(compressedBytes);
+        } else {
+            delete[] compressedBytes;
+        }
+    }
+    stream.close();
+}
+
+// reads the header, storing the positions of the normalization vectors and returning the masterIndexPosition pointer
+map<string, chromosome> readHeader(istream &fin, int64_t &masterIndexPosition, string &genomeID, int32_t &numChromosomes,
+                                   int32_t &version, int64_t &nviPosition, int64_t &nviLength) {
+    map<string, chromosome> chromosomeMap;
+    if (!readMagicString(fin)) {
+        cerr << "Hi-C magic string is missing, does not appear to be a hic file" << endl;
+        masterIndexPosition = -1;
+        return chromosomeMap;
+    }
+
+    version = readInt32FromFile(fin);
+    if (version < 6) {
+        cerr << "Version " << version << " no longer supported" << endl;
+        masterIndexPosition = -1;
+        return chromosomeMap;
+    }
+    masterIndexPosition = readInt64FromFile(fin);
+    getline(fin, genomeID, '\0');
+
+    if (version > 8) {
+        nviPosition = readInt64FromFile(fin);
+        nviLength = readInt64FromFile(fin);
+    }
+
+    int32_t nattributes = readInt32FromFile(fin);
+
+    // reading and ignoring attribute-value dictionary
+    for (int i = 0; i < nattributes; i++) {
+        string key, value;
+        getline(fin, key, '\0');
+        getline(fin, value, '\0');
+    }
+
+    numChromosomes = readInt32FromFile(fin);
+    // chromosome map for finding matrixType
+    for (int i = 0; i < numChromosomes; i++) {
+        string name;
+        int64_t length;
+        getline(fin, name, '\0');
+        if (version > 8) {
+            length = readInt64FromFile(fin);
+        } else {
+            length = (int64_t) readInt32FromFile(fin);
+        }
+
+        chromosome chr;
+        chr.index = i;
+        chr.name = name;
+        chr.length = length;
+        chromosomeMap[name] = chr;
+    }
+    return chromosomeMap;
+}
+
+vector<int32_t> readResolutionsFromHeader(istream &fin) {
+    int numBpResolutions = readInt32FromFile(fin);
+    vector<int32_t> resolutions;
+    for (int i = 0; i < numBpResolutions; i++) {
+        int32_t res = readInt32FromFile(fin);
+        resolutions.push_back(res);
+    }
+    return resolutions;
+}
+
+//https://www.techiedelight.com/get-slice-sub-vector-from-vector-cpp/
+vector<double> slice(vector<double> &v, int64_t m, int64_t n){
+    vector<double> vec;
+    copy(v.begin() + m, v.begin() + n + 1, back_inserter(vec));
+    return vec;
+}
+
+// assume always an odd number for length of vector;
+// eve if even, this calculation should be close enough
+double median(vector<double> &v){
+    size_t n = v.size() / 2;
+    nth_element(v.begin(), v.begin()+n, v.end());
+    return v[n];
+}
+
+void rollingMedian(vector<double> &initialValues, vector<double> &finalResult, int32_t window) {
+    // window is actually a ~wing-span
+    if (window < 1) {
+        finalResult = initialValues;
+        return;
+    }
+
+    finalResult.push_back(initialValues[0]);
+    int64_t length = initialValues.size();
+    for (int64_t index = 1; index < length; index++) {
+        int64_t initialIndex;
+        int64_t finalIndex;
+        if (index < window){
+            initialIndex = 0;
+            finalIndex = 2*index;
+        } else {
+            initialIndex = index - window;
+            finalIndex = index + window;
+        }
+
+        if(finalIndex > length - 1){
+            finalIndex = length - 1;
+        }
+
+        vector<double> subVector = slice(initialValues, initialIndex, finalIndex);
+        finalResult.push_back(median(subVector));
+    }
+}
+
+void populateVectorWithFloats(istream &fin, vector<double> &vector, int64_t nValues) {
+    for (int j = 0; j < nValues; j++) {
+        double v = readFloatFromFile(fin);
+        vector.push_back(v);
+    }
+}
+
+void populateVectorWithDoubles(istream &fin, vector<double> &vector, int64_t nValues) {
+    for (int j = 0; j < nValues; j++) {
+        double v = readDoubleFromFile(fin);
+        vector.push_back(v);
+    }
+}
+
+void readThroughExpectedVector(int32_t version, istream &fin, vector<double> &expectedValues, int64_t nValues,
+                               bool store, int32_t resolution) {
+    if (store) {
+        vector<double> initialExpectedValues;
+        if (version > 8) {
+            populateVectorWithFloats(fin, initialExpectedValues, nValues);
+        } else {
+            populateVectorWithDoubles(fin, initialExpectedValues, nValues);
+        }
+        int32_t window = 5000000 / resolution;
+        rollingMedian(initialExpectedValues, expectedValues, window);
+    } else if (nValues > 0) {
+        if (version > 8) {
+            fin.seekg(nValues*sizeof(float), ios_base::cur);
+        } else {
+            fin.seekg(nValues*sizeof(double), ios_base::cur);
+        }
+    }
+}
+
+void readThroughNormalizationFactors(istream &fin, int32_t version, bool store, vector<double> &expectedValues,
+                                     int32_t c1) {
+    int32_t nNormalizationFactors = readInt32FromFile(fin);
+    if (store){
+        for (int j = 0; j < nNormalizationFactors; j++) {
+            int32_t chrIdx = readInt32FromFile(fin);
+            double v;
+            if (version > 8) {
+                v = readFloatFromFile(fin);
+            } else {
+                v = readDoubleFromFile(fin);
+            }
+            if(chrIdx == c1) {
+                for (double &expectedValue : expectedValues) {
+                    expectedValue = expectedValue / v;
+                }
+            }
+        }
+    } else if (nNormalizationFactors > 0) {
+        if (version > 8) {
+            fin.seekg(nNormalizationFactors * (sizeof(int32_t)+sizeof(float)), ios_base::cur);
+        } else {
+            fin.seekg(nNormalizationFactors * (sizeof(int32_t)+sizeof(double)), ios_base::cur);
+        }
+    }
+}
+
+// the master index at the start of the footer: where the matrix of each chromosome pair is, keyed by "c1_c2"
+map<string, indexEntry> readMasterIndex(istream &fin, int32_t version) {
+    if (version > 8) {
+        int64_t nBytes = readInt64FromFile(fin);
+    } else {
+        int32_t nBytes = readInt32FromFile(fin);
+    }
+
+    map<string, indexEntry> masterIndex;
+    int32_t nEntries = readInt32FromFile(fin);
+    for (int i = 0; i < nEntries; i++) {
+        string str;
+        getline(fin, str, '\0');
+        int64_t fpos = readInt64FromFile(fin);
+        int32_t sizeinbytes = readInt32FromFile(fin);
+        masterIndex[str] = indexEntry{sizeinbytes, fpos};
+    }
+    return masterIndex;
+}
+
+// reads the footer from the master pointer location. takes in the chromosomes,
+// norm, unit (BP or FRAG) and resolution or binsize, and sets the file
+// position of the matrix and the normalization vectors for those chromosomes
+// at the given normalization and resolution
+bool readFooter(istream &fin, int64_t master, int32_t version, int32_t c1, int32_t c2, const string &matrixType, const string &norm,
+                const string &unit, int32_t resolution, int64_t &myFilePos,
+                indexEntry &c1NormEntry, indexEntry &c2NormEntry, vector<double> &expectedValues) {
+
+    stringstream ss;
+    ss << c1 << "_" << c2;
+    string key = ss.str();
+
+    map<string, indexEntry> masterIndex = readMasterIndex(fin, version);
+    auto entry = masterIndex.find(key);
+    if (entry == masterIndex.end()) {
+        reportMissingMatrix("File doesn't have the given chr_chr map " + key);
+        return false;
+    }
+    myFilePos = entry->second.position;
+
+    if ((matrixType == "observed" && norm == "NONE") || ((matrixType == "oe" || matrixType == "expected") && norm == "NONE" && c1 != c2))
+        return true; // no need to read norm vector index
+
+    // read in and ignore expected value maps; don't store; reading these to
+    // get to norm vector index
+    int32_t nExpectedValues = readInt32FromFile(fin);
+    for (int i = 0; i < nExpectedValues; i++) {
+        string unit0;
+        getline(fin, unit0, '\0'); //unit
+        int32_t binSize = readInt32FromFile(fin);
+
+        int64_t nValues;
+        if (version > 8) {
+            nValues = readInt64FromFile(fin);
+        } else {
+            nValues = (int64_t) readInt32FromFile(fin);
+        }
+
+        bool store = c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE" && unit0 == unit && binSize == resolution;
+        readThroughExpectedVector(version, fin, expectedValues, nValues, store, resolution);
+        readThroughNormalizationFactors(fin, version, store, expectedValues, c1);
+    }
+
+    if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm == "NONE") {
+        if (expectedValues.empty()) {
+            reportMissingMatrix("File did not contain expected values vectors at " + to_string(resolution) + " " +
+                                unit);
+            return false;
+        }
+        return true;
+    }
+
+    nExpectedValues = readInt32FromFile(fin);
+    for (int i = 0; i < nExpectedValues; i++) {
+        string type, unit0;
+        getline(fin, type, '\0'); //typeString
+        getline(fin, unit0, '\0'); //unit
+        int32_t binSize = readInt32FromFile(fin);
+
+        int64_t nValues;
+        if (version > 8) {
+            nValues = readInt64FromFile(fin);
+        } else {
+            nValues = (int64_t) readInt32FromFile(fin);
+        }
+        bool store = c1 == c2 && (matrixType == "oe" || matrixType == "expected") && type == norm && unit0 == unit && binSize == resolution;
+        readThroughExpectedVector(version, fin, expectedValues, nValues, store, resolution);
+        readThroughNormalizationFactors(fin, version, store, expectedValues, c1);
+    }
+
+    if (c1 == c2 && (matrixType == "oe" || matrixType == "expected") && norm != "NONE") {
+        if (expectedValues.empty()) {
+            reportMissingMatrix("File did not contain normalized expected values vectors at " + to_string(resolution) + " " +
+                                unit);
+            return false;
+        }
+    }
+
+    // Index of normalization vectors
+    int32_t nEntries = readInt32FromFile(fin);
+    bool found1 = false;
+    bool found2 = false;
+    for (int i = 0; i < nEntries; i++) {
+        string normtype;
+        getline(fin, normtype, '\0'); //normalization type
+        int32_t chrIdx = readInt32FromFile(fin);
+        string unit1;
+        getline(fin, unit1, '\0'); //unit
+        int32_t resolution1 = readInt32FromFile(fin);
+        int64_t filePosition = readInt64FromFile(fin);
+        int64_t sizeInBytes;
+        if (version > 8) {
+            sizeInBytes = readInt64FromFile(fin);
+        } else {
+            sizeInBytes = (int64_t) readInt32FromFile(fin);
+        }
+
+        if (chrIdx == c1 && normtype == norm && unit1 == unit && resolution1 == resolution) {
+            c1NormEntry.position = filePosition;
+            c1NormEntry.size = sizeInBytes;
+            found1 = true;
+        }
+        if (chrIdx == c2 && normtype == norm && unit1 == unit && resolution1 == resolution) {
+            c2NormEntry.position = filePosition;
+            c2NormEntry.size = sizeInBytes;
+            found2 = true;
+        }
+    }
+    if (!found1 || !found2) {
+        cerr << "File did not contain " << norm << " normalization vectors for one or both chromosomes at "
+             << resolution << " " << unit << endl;
+    }
+    return true;
+}
+
+indexEntry readIndexEntry(istream &fin) {
+    int64_t filePosition = readInt64FromFile(fin);
+    int32_t blockSizeInBytes = readInt32FromFile(fin);
+    indexEntry entry = indexEntry();
+    entry.size = (int64_t) blockSizeInBytes;
+    entry.position = filePosition;
+    return entry;
+}
+
+void setValuesForMZD(istream &fin, const string &myunit, float &mySumCounts, float &myOccupiedCellCount,
+                     int32_t &mybinsize, int32_t &myBlockBinCount, int32_t &myBlockColumnCount, bool &found) {
+    string unit;
+    getline(fin, unit, '\0'); // unit
+    readInt32FromFile(fin); // Old "zoom" index -- not used
+    float sumCounts = readFloatFromFile(fin); // sumCounts
+    float occupiedCellCount = readFloatFromFile(fin); // occupiedCellCount
+    readFloatFromFile(fin); // stdDev
+    readFloatFromFile(fin); // percent95
+    int32_t binSize = readInt32FromFile(fin);
+    int32_t blockBinCount = readInt32FromFile(fin);
+    int32_t blockColumnCount = readInt32FromFile(fin);
+    found = false;
+    if (myunit == unit && mybinsize == binSize) {
+        mySumCounts = sumCounts;
+        myOccupiedCellCount = occupiedCellCount;
+        myBlockBinCount = blockBinCount;
+        myBlockColumnCount = blockColumnCount;
+        found = true;
+    }
+}
+
+void populateBlockMap(istream &fin, int32_t nBlocks, map<int32_t, indexEntry> &blockMap) {
+    for (int b = 0; b < nBlocks; b++) {
+        int32_t blockNumber = readInt32FromFile(fin);
+        blockMap[blockNumber] = readIndexEntry(fin);
+    }
+}
+
+// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
+map<int32_t, indexEntry> readMatrixZoomData(istream &fin, const string &myunit, int32_t mybinsize, float &mySumCounts,
+                                        float &myOccupiedCellCount, int32_t &myBlockBinCount,
+                                        int32_t &myBlockColumnCount, bool &found) {
+
+    map<int32_t, indexEntry> blockMap;
+    setValuesForMZD(fin, myunit, mySumCounts, myOccupiedCellCount, mybinsize, myBlockBinCount, myBlockColumnCount,
+                    found);
+
+    int32_t nBlocks = readInt32FromFile(fin);
+    if (found){
+        populateBlockMap(fin, nBlocks, blockMap);
+    } else {
+        fin.seekg(nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)), ios_base::cur);
+    }
+    return blockMap;
+}
+
+// reads the raw binned contact matrix at specified resolution, setting the block bin count and block column count
+map<int32_t, indexEntry> readMatrixZoomDataHttp(CURL *curl, const string &url, int64_t &myFilePosition, const string &myunit, int32_t mybinsize,
+                                            float &mySumCounts, float &myOccupiedCellCount, int32_t &myBlockBinCount,
+                                            int32_t &myBlockColumnCount, bool &found) {
+
+    map<int32_t, indexEntry> blockMap;
+    int32_t header_size = 5 * sizeof(int32_t) + 4 * sizeof(float);
+    char *first = getData(curl, url, myFilePosition, 1);
+    if (first[0] == 'B') {
+        header_size += 3;
+    } else if (first[0] == 'F') {
+        header_size += 5;
+    } else {
+        cerr << "Unit not understood" << endl;
         return blockMap;
     }
-    delete first;
-    char *buffer = getData(curl, myFilePosition, header_size);
-    memstream fin(buffer, header_size);
-    setValuesForMZD(fin, myunit, mySumCounts, mybinsize, myBlockBinCount, myBlockColumnCount, found);
-    int32_t nBlocks = readInt32FromFile(fin);
-    delete buffer;
+    delete first;
+    char *buffer = getData(curl, url, myFilePosition, header_size);
+    memstream fin(buffer, header_size);
+    setValuesForMZD(fin, myunit, mySumCounts, myOccupiedCellCount, mybinsize, myBlockBinCount, myBlockColumnCount,
+                    found);
+    int32_t nBlocks = readInt32FromFile(fin);
+    delete buffer;
+
+    if (found) {
+        int32_t chunkSize = nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t));
+        buffer = getData(curl, url, myFilePosition + header_size, chunkSize);
+        memstream fin2(buffer, chunkSize);
+        populateBlockMap(fin2, nBlocks, blockMap);
+        delete buffer;
+    } else {
+        myFilePosition = myFilePosition + header_size + (nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)));
+    }
+    return blockMap;
+}
+
+// goes to the specified file pointer in http and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
+// sets blockbincount and blockcolumncount
+map<int32_t, indexEntry> readMatrixHttp(CURL *curl, const string &url, int64_t myFilePosition, const string &unit, int32_t resolution,
+                                    float &mySumCounts, float &myOccupiedCellCount, int32_t &myBlockBinCount,
+                                    int32_t &myBlockColumnCount) {
+    int32_t size = sizeof(int32_t) * 3;
+    char *buffer = getData(curl, url, myFilePosition, size);
+    memstream bufin(buffer, size);
+
+    int32_t c1 = readInt32FromFile(bufin);
+    int32_t c2 = readInt32FromFile(bufin);
+    int32_t nRes = readInt32FromFile(bufin);
+    int32_t i = 0;
+    bool found = false;
+    myFilePosition = myFilePosition + size;
+    delete buffer;
+    map<int32_t, indexEntry> blockMap;
+
+    while (i < nRes && !found) {
+        // myFilePosition gets updated within call
+        blockMap = readMatrixZoomDataHttp(curl, url, myFilePosition, unit, resolution, mySumCounts, myOccupiedCellCount,
+                                          myBlockBinCount, myBlockColumnCount, found);
+        i++;
+    }
+    if (!found) {
+        reportMissingMatrix("Error finding block data");
+    }
+    return blockMap;
+}
+
+// goes to the specified file pointer and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
+// sets blockbincount and blockcolumncount
+map<int32_t, indexEntry> readMatrix(istream &fin, int64_t myFilePosition, const string &unit, int32_t resolution,
+                                float &mySumCounts, float &myOccupiedCellCount, int32_t &myBlockBinCount,
+                                int32_t &myBlockColumnCount) {
+    map<int32_t, indexEntry> blockMap;
+
+    fin.seekg(myFilePosition, ios::beg);
+    int32_t c1 = readInt32FromFile(fin);
+    int32_t c2 = readInt32FromFile(fin);
+    int32_t nRes = readInt32FromFile(fin);
+    int32_t i = 0;
+    bool found = false;
+    while (i < nRes && !found) {
+        blockMap = readMatrixZoomData(fin, unit, resolution, mySumCounts, myOccupiedCellCount, myBlockBinCount,
+                                      myBlockColumnCount, found);
+        i++;
+    }
+    if (!found) {
+        reportMissingMatrix("Error finding block data");
+    }
+    return blockMap;
+}
+
+// gets the blocks that need to be read for this slice of the data.  needs blockbincount, blockcolumncount, and whether
+// or not this is intrachromosomal.
+set<int32_t> getBlockNumbersForRegionFromBinPosition(const int64_t *regionIndices, int32_t blockBinCount, int32_t blockColumnCount,
+                                                 bool intra) {
+    int32_t col1, col2, row1, row2;
+    col1 = static_cast<int32_t>(regionIndices[0] / blockBinCount);
+    col2 = static_cast<int32_t>((regionIndices[1] + 1) / blockBinCount);
+    row1 = static_cast<int32_t>(regionIndices[2] / blockBinCount);
+    row2 = static_cast<int32_t>((regionIndices[3] + 1) / blockBinCount);
+
+    set<int32_t> blocksSet;
+    // first check the upper triangular matrixType
+    for (int r = row1; r <= row2; r++) {
+        for (int c = col1; c <= col2; c++) {
+            int32_t blockNumber = r * blockColumnCount + c;
+            blocksSet.insert(blockNumber);
+        }
+    }
+    // check region part that overlaps with lower left triangle but only if intrachromosomal
+    if (intra) {
+        for (int r = col1; r <= col2; r++) {
+            for (int c = row1; c <= row2; c++) {
+                int32_t blockNumber = r * blockColumnCount + c;
+                blocksSet.insert(blockNumber);
+            }
+        }
+    }
+    return blocksSet;
+}
+
+set<int32_t> getBlockNumbersForRegionFromBinPositionV9Intra(int64_t *regionIndices, int32_t blockBinCount, int32_t blockColumnCount) {
+    // regionIndices is binX1 binX2 binY1 binY2
+    set<int32_t> blocksSet;
+    int32_t translatedLowerPAD, translatedHigherPAD, translatedNearerDepth, translatedFurtherDepth;
+    translatedLowerPAD = static_cast<int32_t>((regionIndices[0] + regionIndices[2]) / 2 / blockBinCount);
+    translatedHigherPAD = static_cast<int32_t>((regionIndices[1] + regionIndices[3]) / 2 / blockBinCount + 1);
+    translatedNearerDepth = static_cast<int32_t>(log2(
+            1 + abs(regionIndices[0] - regionIndices[3]) / sqrt(2) / blockBinCount));
+    translatedFurtherDepth = static_cast<int32_t>(log2(
+            1 + abs(regionIndices[1] - regionIndices[2]) / sqrt(2) / blockBinCount));
+
+    // because code above assume above diagonal; but we could be below diagonal
+    int32_t nearerDepth = min(translatedNearerDepth, translatedFurtherDepth);
+    if ((regionIndices[0] > regionIndices[3] && regionIndices[1] < regionIndices[2]) ||
+        (regionIndices[1] > regionIndices[2] && regionIndices[0] < regionIndices[3])) {
+        nearerDepth = 0;
+    }
+    int32_t furtherDepth = max(translatedNearerDepth, translatedFurtherDepth) + 1; // +1; integer divide rounds down
+
+    for (int depth = nearerDepth; depth <= furtherDepth; depth++) {
+        for (int pad = translatedLowerPAD; pad <= translatedHigherPAD; pad++) {
+            int32_t blockNumber = depth * blockColumnCount + pad;
+            blocksSet.insert(blockNumber);
+        }
+    }
+
+    return blocksSet;
+}
+
+// inflates a block read from the file. the output buffer starts at 10x the compressed size (biggest ratio seen so
+// far is 3) and grows if a block ever turns out to be bigger than that
+vector<char> inflateBlock(char *compressedBytes, int64_t compressedSize) {
+    vector<char> uncompressedBytes(static_cast<size_t>(compressedSize * 10));
+    // zlib struct
+    z_stream infstream;
+    infstream.zalloc = Z_NULL;
+    infstream.zfree = Z_NULL;
+    infstream.opaque = Z_NULL;
+    infstream.avail_in = static_cast<uInt>(compressedSize); // size of input
+    infstream.next_in = (Bytef *) compressedBytes; // input char array
+    infstream.avail_out = static_cast<uInt>(uncompressedBytes.size()); // size of output
+    infstream.next_out = (Bytef *) uncompressedBytes.data(); // output char array
+    // the actual decompression work.
+    inflateInit(&infstream);
+    while (inflate(&infstream, Z_NO_FLUSH) == Z_OK && infstream.avail_out == 0) {
+        size_t used = uncompressedBytes.size();
+        uncompressedBytes.resize(used * 2);
+        infstream.avail_out = static_cast<uInt>(uncompressedBytes.size() - used);
+        infstream.next_out = (Bytef *) uncompressedBytes.data() + used;
+    }
+    inflateEnd(&infstream);
+    uncompressedBytes.resize(static_cast<size_t>(infstream.total_out));
+    return uncompressedBytes;
+}
+
+// reads the block at the given index entry and returns its decompressed bytes
+shared_ptr<const vector<char>> readUncompressedBlock(const string &fileName, indexEntry idx,
+                                                     ioPriority priority = ioPriority::INTERACTIVE) {
+    if (idx.size <= 0) {
+        return make_shared<const vector<char>>();
+    }
+    IoSlot slot(priority, nullptr, idx.size);
+    char *compressedBytes = readCompressedBytesFromFile(fileName, idx);
+    slot.done();
+    auto uncompressedBytes = make_shared<const vector<char>>(inflateBlock(compressedBytes, idx.size));
+    delete[] compressedBytes;
+    return uncompressedBytes;
+}
+
+// cursor over an inflated block. reads past the end return zero and mark the cursor exhausted, so a truncated block
+// stops decoding instead of running off the buffer
+class BlockReader {
+public:
+    const char *position;
+    const char *end;
+    bool exhausted = false;
+
+    BlockReader(const char *data, size_t size) : position(data), end(data + size) {}
+
+    template <typename T>
+    T read() {
+        T value;
+        if (end - position < static_cast<ptrdiff_t>(sizeof(T))) {
+            position = end;
+            exhausted = true;
+            return T();
+        }
+        memcpy(&value, position, sizeof(T));
+        position += sizeof(T);
+        return value;
+    }
+
+    // reads a T at the given byte offset from the cursor without moving it; the caller has checked the bounds
+    template <typename T>
+    T peek(int64_t offset) const {
+        T value;
+        memcpy(&value, position + offset, sizeof(T));
+        return value;
+    }
+
+    void skip(int64_t bytes) {
+        if (bytes < 0 || end - position < bytes) {
+            position = end;
+            exhausted = true;
+            return;
+        }
+        position += bytes;
+    }
+};
+
+// the widest bin window, for decoding every record in a block
+const int64_t allBins[4] = {INT32_MIN, INT32_MAX, INT32_MIN, INT32_MAX};
+
+// type 1 blocks are a list of rows (binY plus a list of binX and counts). the widths of the row and column fields
+// and of the counts depend on the block header. rows are written in ascending binY and the columns of a row in
+// ascending binX, so only the rows inside window (x0, x1, y0, y1, inclusive) are decoded: earlier rows are skipped
+// whole, decoding stops after the last row in range, and within a row the first column in range is binary searched
+// and the rest of the row skipped once past the last one
+template <typename RowT, typename ColT, typename CountT, typename Sink>
+void decodeListBlock(BlockReader &reader, int32_t binXOffset, int32_t binYOffset, const int64_t window[4],
+                     Sink &sink) {
+    const int64_t entrySize = sizeof(ColT) + sizeof(CountT);
+    RowT rowCount = reader.read<RowT>();
+    for (RowT i = 0; i < rowCount && !reader.exhausted; i++) {
+        int32_t binY = binYOffset + reader.read<RowT>();
+        ColT colCount = reader.read<ColT>();
+        if (binY > window[3]) {
+            break;
+        }
+        int64_t rowSize = colCount * entrySize;
+        if (colCount <= 0 || binY < window[2] || reader.end - reader.position < rowSize) {
+            reader.skip(rowSize);
+            continue;
+        }
+        // first column with binX >= x0
+        ColT first = 0, last = colCount;
+        while (first < last) {
+            ColT mid = first + (last - first) / 2;
+            if (binXOffset + reader.peek<ColT>(mid * entrySize) < window[0]) {
+                first = mid + 1;
+            } else {
+                last = mid;
+            }
+        }
+        for (ColT j = first; j < colCount; j++) {
+            int32_t binX = binXOffset + reader.peek<ColT>(j * entrySize);
+            if (binX > window[1]) {
+                break;
+            }
+            float counts = static_cast<float>(reader.peek<CountT>(j * entrySize + sizeof(ColT)));
+            sink(binX, binY, counts);
+        }
+        reader.skip(rowSize);
+    }
+}
+
+template <typename RowT, typename ColT, typename Sink>
+void decodeListBlock(BlockReader &reader, int32_t binXOffset, int32_t binYOffset, bool useShort,
+                     const int64_t window[4], Sink &sink) {
+    if (useShort) {
+        decodeListBlock<RowT, ColT, int16_t>(reader, binXOffset, binYOffset, window, sink);
+    } else {
+        decodeListBlock<RowT, ColT, float>(reader, binXOffset, binYOffset, window, sink);
+    }
+}
+
+inline bool isEmptyCell(int16_t counts) {
+    return counts == -32768;
+}
+
+inline bool isEmptyCell(float counts) {
+    return isnan(counts);
+}
+
+// type 2 blocks are a dense raster w cells wide; empty cells hold -32768 (short) or NaN (float) and are skipped.
+// cells have a fixed size, so only the rows and columns of the raster that overlap window (x0, x1, y0, y1,
+// inclusive) are read
+template <typename CountT, typename Sink>
+void decodeDenseBlock(BlockReader &reader, int32_t binXOffset, int32_t binYOffset, const int64_t window[4],
+                      Sink &sink) {
+    int32_t nPts = reader.read<int32_t>();
+    int16_t w = reader.read<int16_t>();
+    if (reader.exhausted || nPts <= 0 || w <= 0) {
+        return;
+    }
+    // a truncated block only has the cells that are actually there
+    int64_t available = (reader.end - reader.position) / static_cast<int64_t>(sizeof(CountT));
+    int64_t cellCount = min(static_cast<int64_t>(nPts), available);
+    if (cellCount == 0) {
+        return;
+    }
+    int64_t firstRow = max(static_cast<int64_t>(0), window[2] - binYOffset);
+    int64_t lastRow = min((cellCount - 1) / w, window[3] - binYOffset);
+    int64_t firstCol = max(static_cast<int64_t>(0), window[0] - binXOffset);
+    int64_t lastCol = min(static_cast<int64_t>(w - 1), window[1] - binXOffset);
+    for (int64_t row = firstRow; row <= lastRow; row++) {
+        int64_t rowEnd = min(row * w + lastCol, cellCount - 1);
+        for (int64_t i = row * w + firstCol; i <= rowEnd; i++) {
+            CountT counts = reader.peek<CountT>(i * static_cast<int64_t>(sizeof(CountT)));
+            if (isEmptyCell(counts)) {
+                continue;
+            }
+            sink(binXOffset + static_cast<int32_t>(i - row * w), binYOffset + static_cast<int32_t>(row),
+                 static_cast<float>(counts));
+        }
+    }
+    reader.skip(cellCount * static_cast<int64_t>(sizeof(CountT)));
+}
+
+// decodes an inflated block, calling sink(binX, binY, counts) for each contact record in it, in file order. records
+// outside window (x0, x1, y0, y1, inclusive) may be left out where the block layout lets the decoder skip them
+template <typename Sink>
+void decodeBlockRecords(const char *data, size_t size, int32_t version, const int64_t window[4], Sink &sink) {
+    if (size == 0) {
+        return;
+    }
+    BlockReader reader(data, size);
+    int32_t nRecords = reader.read<int32_t>();
+    // different versions have different specific formats
+    if (version < 7) {
+        for (int32_t i = 0; i < nRecords && !reader.exhausted; i++) {
+            int32_t binX = reader.read<int32_t>();
+            int32_t binY = reader.read<int32_t>();
+            float counts = reader.read<float>();
+            sink(binX, binY, counts);
+        }
+        return;
+    }
+    int32_t binXOffset = reader.read<int32_t>();
+    int32_t binYOffset = reader.read<int32_t>();
+    bool useShort = reader.read<char>() == 0; // yes this is opposite of usual
+
+    bool useShortBinX = true;
+    bool useShortBinY = true;
+    if (version > 8) {
+        useShortBinX = reader.read<char>() == 0;
+        useShortBinY = reader.read<char>() == 0;
+    }
+
+    char type = reader.read<char>();
+    if (type == 1) {
+        if (useShortBinX && useShortBinY) {
+            decodeListBlock<int16_t, int16_t>(reader, binXOffset, binYOffset, useShort, window, sink);
+        } else if (useShortBinX && !useShortBinY) {
+            decodeListBlock<int32_t, int16_t>(reader, binXOffset, binYOffset, useShort, window, sink);
+        } else if (!useShortBinX && useShortBinY) {
+            decodeListBlock<int16_t, int32_t>(reader, binXOffset, binYOffset, useShort, window, sink);
+        } else {
+            decodeListBlock<int32_t, int32_t>(reader, binXOffset, binYOffset, useShort, window, sink);
+        }
+    } else if (type == 2) {
+        if (useShort) {
+            decodeDenseBlock<int16_t>(reader, binXOffset, binYOffset, window, sink);
+        } else {
+            decodeDenseBlock<float>(reader, binXOffset, binYOffset, window, sink);
+        }
+    }
+}
+
+vector<contactRecord> decodeBlock(const vector<char> &uncompressedBytes, int32_t version) {
+    vector<contactRecord> v;
+    auto append = [&v](int32_t binX, int32_t binY, float counts) {
+        contactRecord record = contactRecord();
+        record.binX = binX;
+        record.binY = binY;
+        record.counts = counts;
+        v.push_back(record);
+    };
+    decodeBlockRecords(uncompressedBytes.data(), uncompressedBytes.size(), version, allBins, append);
+    return v;
+}
+
+// whether a record is inside bin window (x0, x1, y0, y1, inclusive); intrachromosomal records also match mirrored,
+// i.e. in the region that overlaps with the lower left
+inline bool inBinWindow(int32_t binX, int32_t binY, const int64_t window[4], bool intra) {
+    return (binX >= window[0] && binX <= window[1] && binY >= window[2] && binY <= window[3]) ||
+           (intra && binY >= window[0] && binY <= window[1] && binX >= window[2] && binX <= window[3]);
+}
+
+// decoded records of one block as columns, so that the per record scaling runs over contiguous arrays
+class RecordBatch {
+public:
+    vector<int32_t> binX;
+    vector<int32_t> binY;
+    vector<int32_t> distance;
+    vector<float> counts;
+
+    void clear() {
+        binX.clear();
+        binY.clear();
+        distance.clear();
+        counts.clear();
+    }
+
+    size_t size() const {
+        return counts.size();
+    }
+
+    // |binY - binX| for each record, capped at the last entry of an expected vector of the given size
+    const int32_t *diagonalDistances(size_t expectedSize) {
+        int32_t last = static_cast<int32_t>(expectedSize) - 1;
+        distance.resize(counts.size());
+        for (size_t i = 0; i < counts.size(); i++) {
+            distance[i] = min(last, abs(binY[i] - binX[i]));
+        }
+        return distance.data();
+    }
+};
+
+// counts[i] *= values[indices[i]], eight lanes at a time with AVX2 gathers when the build targets it
+void gatherMultiply(float *counts, const int32_t *indices, const float *values, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + i));
+        __m256 scale = _mm256_i32gather_ps(values, index, sizeof(float));
+        _mm256_storeu_ps(counts + i, _mm256_mul_ps(_mm256_loadu_ps(counts + i), scale));
+    }
+#endif
+    for (; i < n; i++) {
+        counts[i] *= values[indices[i]];
+    }
+}
+
+// counts[i] = values[indices[i]]
+void gatherAssign(float *counts, const int32_t *indices, const float *values, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 8 <= n; i += 8) {
+        __m256i index = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(indices + i));
+        _mm256_storeu_ps(counts + i, _mm256_i32gather_ps(values, index, sizeof(float)));
+    }
+#endif
+    for (; i < n; i++) {
+        counts[i] = values[indices[i]];
+    }
+}
+
+// 1 / v for each value, in float, so normalization is a multiply instead of a double division per record
+vector<float> reciprocals(const vector<double> &values) {
+    vector<float> inverse(values.size());
+    for (size_t i = 0; i < values.size(); i++) {
+        inverse[i] = static_cast<float>(1.0 / values[i]);
+    }
+    return inverse;
+}
+
+// this is the meat of reading the data.  takes in the block number and returns the set of contact records corresponding to
+// that block.  the block data is compressed and must be decompressed using the zlib library functions
+vector<contactRecord> readBlock(const string& fileName, indexEntry idx, int32_t version) {
+    return decodeBlock(*readUncompressedBlock(fileName, idx), version);
+}
+
+// reads the normalization vector from the file at the specified location
+vector<double> readNormalizationVector(istream &bufferin, int32_t version) {
+    int64_t nValues;
+    if (version > 8) {
+        nValues = readInt64FromFile(bufferin);
+    } else {
+        nValues = (int64_t) readInt32FromFile(bufferin);
+    }
+
+    uint64_t numValues;
+    numValues = static_cast<uint64_t>(nValues);
+    vector<double> values(numValues);
+
+    if (version > 8) {
+        for (int i = 0; i < nValues; i++) {
+            values[i] = (double) readFloatFromFile(bufferin);
+        }
+    } else {
+        for (int i = 0; i < nValues; i++) {
+            values[i] = readDoubleFromFile(bufferin);
+        }
+    }
+
+    return values;
+}
+
+/*
+  LRU cache of decompressed blocks for a single matrix, bounded by a byte budget. Blocks that are being read are
+  tracked so a query never reads a block the prefetcher already has in flight; it waits for it instead.
+ */
+class BlockCache {
+public:
+    explicit BlockCache(int64_t maxBytes) : maxBytes(maxBytes) {}
+
+    // returns the cached block, or null with reserved set if the caller should read it now. prefetch lookups don't
+    // count towards the hit rate and never wait on a block someone else is reading
+    shared_ptr<const vector<char>> getOrReserve(int32_t blockNumber, bool prefetch, bool &reserved) {
+        reserved = false;
+        unique_lock<mutex> lock(mtx);
+        while (true) {
+            auto it = blocks.find(blockNumber);
+            if (it != blocks.end()) {
+                lru.splice(lru.begin(), lru, it->second.lruPosition);
+                if (!prefetch) {
+                    stats.hits++;
+                    if (it->second.prefetched) {
+                        it->second.prefetched = false;
+                        stats.usefulPrefetches++;
+                    }
+                }
+                return it->second.data;
+            }
+            if (inFlight.count(blockNumber) == 0) {
+                break;
+            }
+            if (prefetch) {
+                return nullptr;
+            }
+            loaded.wait(lock);
+        }
+        inFlight.insert(blockNumber);
+        reserved = true;
+        if (!prefetch) {
+            stats.misses++;
+        }
+        return nullptr;
+    }
+
+    bool contains(int32_t blockNumber) {
+        lock_guard<mutex> lock(mtx);
+        return blocks.count(blockNumber) > 0 || inFlight.count(blockNumber) > 0;
+    }
+
+    void put(int32_t blockNumber, const shared_ptr<const vector<char>> &data, bool prefetched, int64_t compressedSize) {
+        lock_guard<mutex> lock(mtx);
+        inFlight.erase(blockNumber);
+        if (prefetched) {
+            stats.prefetchedBlocks++;
+            stats.prefetchedBytes += compressedSize;
+        }
+        if (static_cast<int64_t>(data->size()) <= maxBytes && blocks.count(blockNumber) == 0) {
+            lru.push_front(blockNumber);
+            blocks[blockNumber] = {data, lru.begin(), prefetched};
+            stats.cachedBytes += data->size();
+            while (stats.cachedBytes > maxBytes) {
+                auto victim = blocks.find(lru.back());
+                stats.cachedBytes -= victim->second.data->size();
+                blocks.erase(victim);
+                lru.pop_back();
+                stats.evictions++;
+            }
+        }
+        loaded.notify_all();
+    }
+
+    // gives up a reservation from getOrReserve without caching anything
+    void release(int32_t blockNumber) {
+        lock_guard<mutex> lock(mtx);
+        inFlight.erase(blockNumber);
+        loaded.notify_all();
+    }
+
+    bool hasRoomFor(int64_t bytes) {
+        lock_guard<mutex> lock(mtx);
+        return stats.cachedBytes + bytes <= maxBytes;
+    }
+
+    prefetchStats getStats() {
+        lock_guard<mutex> lock(mtx);
+        return stats;
+    }
+
+private:
+    struct CachedBlock {
+        shared_ptr<const vector<char>> data;
+        list<int32_t>::iterator lruPosition;
+        bool prefetched;
+    };
+
+    mutex mtx;
+    condition_variable loaded;
+    int64_t maxBytes;
+    map<int32_t, CachedBlock> blocks;
+    list<int32_t> lru;
+    set<int32_t> inFlight;
+    prefetchStats stats;
+};
+
+class MatrixZoomData {
+public:
+    bool isIntra;
+    string fileName;
+    int64_t myFilePos = 0LL;
+    vector<double> expectedValues;
+    bool foundFooter = false;
+    vector<double> c1Norm;
+    vector<double> c2Norm;
+    int32_t c1 = 0;
+    int32_t c2 = 0;
+    string matrixType;
+    string norm;
+    int32_t version = 0;
+    int32_t resolution = 0;
+    int32_t numBins1 = 0;
+    int32_t numBins2 = 0;
+    float sumCounts;
+    float occupiedCellCount = 0;
+    int64_t normVectorBytes = 0; // size in the file of the normalization vectors read for this matrix
+    ioPriority priority = ioPriority::INTERACTIVE; // scheduler class of its block reads, batch if a query's control says so
+    int32_t blockBinCount, blockColumnCount;
+    map<int32_t, indexEntry> blockMap;
+    double avgCount;
+    // float copies of the vectors above used by the record kernel: reciprocals of the norms and expected values,
+    // and the expected values themselves
+    vector<float> c1NormInverse;
+    vector<float> c2NormInverse;
+    vector<float> expectedInverse;
+    vector<float> expectedFloat;
+    float avgCountInverse = 0;
+    unique_ptr<BlockCache> blockCache;
+    prefetchOptions prefetchConfig;
+    thread prefetcher;
+    mutex prefetchMutex;
+    condition_variable prefetchWakeup;
+    bool prefetchEnabled = false;
+    bool hasPendingPrefetch = false;
+    int64_t pendingRegion[4] = {0, 0, 0, 0};
+    int64_t prefetchGeneration = 0;
+
+    MatrixZoomData(const chromosome &chrom1, const chromosome &chrom2, const string &matrixType,
+                   const string &norm, const string &unit, int32_t resolution,
+                   int32_t &version, int64_t &master, int64_t &totalFileSize,
+                   const string &fileName) {
+        this->version = version;
+        this->fileName = fileName;
+        int32_t c01 = chrom1.index;
+        int32_t c02 = chrom2.index;
+        if (c01 <= c02) { // default is ok
+            this->c1 = c01;
+            this->c2 = c02;
+            this->numBins1 = static_cast<int32_t>(chrom1.length / resolution);
+            this->numBins2 = static_cast<int32_t>(chrom2.length / resolution);
+        } else { // flip
+            this->c1 = c02;
+            this->c2 = c01;
+            this->numBins1 = static_cast<int32_t>(chrom2.length / resolution);
+            this->numBins2 = static_cast<int32_t>(chrom1.length / resolution);
+        }
+        isIntra = c1 == c2;
+
+        this->matrixType = matrixType;
+        this->norm = norm;
+        this->resolution = resolution;
+
+        HiCFileStream stream(fileName);
+        indexEntry c1NormEntry{}, c2NormEntry{};
+
+        if (stream.isHttp) {
+            int64_t bytes_to_read = totalFileSize - master;
+            char *buffer = getData(stream.curl, fileName, master, bytes_to_read);
+            memstream bufin2(buffer, bytes_to_read);
+            foundFooter = readFooter(bufin2, master, version, c1, c2, matrixType, norm, unit,
+                                     resolution,
+                                     myFilePos,
+                                     c1NormEntry, c2NormEntry, expectedValues);
+            delete buffer;
+        } else {
+            stream.fin.seekg(master, ios::beg);
+            foundFooter = readFooter(stream.fin, master, version, c1, c2, matrixType, norm,
+                                     unit,
+                                     resolution, myFilePos,
+                                     c1NormEntry, c2NormEntry, expectedValues);
+        }
+
+        stream.close();
+        if (!foundFooter) {
+            return;
+        }
+
+        if (norm != "NONE") {
+            normVectorBytes = c1NormEntry.size + (isIntra ? 0 : c2NormEntry.size);
+            c1Norm = readNormalizationVectorFromFooter(c1NormEntry, version, fileName);
+            if (isIntra) {
+                c2Norm = c1Norm;
+            } else {
+                c2Norm = readNormalizationVectorFromFooter(c2NormEntry, version, fileName);
+            }
+        }
+
+        HiCFileStream stream2(fileName);
+        if (stream2.isHttp) {
+            // readMatrix will assign blockBinCount and blockColumnCount
+            blockMap = readMatrixHttp(stream2.curl, fileName, myFilePos, unit, resolution, sumCounts,
+                                      occupiedCellCount, blockBinCount,
+                                      blockColumnCount);
+        } else {
+            // readMatrix will assign blockBinCount and blockColumnCount
+            blockMap = readMatrix(stream2.fin, myFilePos, unit, resolution, sumCounts,
+                                  occupiedCellCount, blockBinCount,
+                                  blockColumnCount);
+        }
+        stream2.close();
+
+        if (!isIntra) {
+            avgCount = (sumCounts / numBins1) / numBins2;   // <= trying to avoid overflows
+            avgCountInverse = static_cast<float>(1.0 / avgCount);
+        }
+        c1NormInverse = reciprocals(c1Norm);
+        c2NormInverse = reciprocals(c2Norm);
+        expectedInverse = reciprocals(expectedValues);
+        expectedFloat.assign(expectedValues.begin(), expectedValues.end());
+    }
+
+    ~MatrixZoomData() {
+        disablePrefetch();
+    }
+
+    void setIoPriority(ioPriority priority) {
+        this->priority = priority;
+    }
+
+    // class the block reads of a query go in: batch if either the matrix or the query's control asks for it
+    ioPriority readPriority(const queryControl *control) const {
+        bool batch = priority == ioPriority::BATCH || (control && control->priority == ioPriority::BATCH);
+        return batch ? ioPriority::BATCH : ioPriority::INTERACTIVE;
+    }
+
+    // keeps up to maxBytes of decompressed blocks in memory; 0 turns the cache off
+    void setBlockCacheSize(int64_t maxBytes) {
+        disablePrefetch();
+        blockCache.reset(maxBytes > 0 ? new BlockCache(maxBytes) : nullptr);
+    }
+
+    // starts loading the ring of blocks around each query in the background, into a block cache sized by options
+    void enablePrefetch(const prefetchOptions &options) {
+        setBlockCacheSize(options.cacheBytes);
+        prefetchConfig = options;
+        prefetchEnabled = true;
+        prefetcher = thread(&MatrixZoomData::runPrefetcher, this);
+    }
+
+    void disablePrefetch() {
+        {
+            lock_guard<mutex> lock(prefetchMutex);
+            if (!prefetchEnabled) {
+                return;
+            }
+            prefetchEnabled = false;
+            prefetchGeneration++;
+        }
+        prefetchWakeup.notify_all();
+        prefetcher.join();
+    }
+
+    prefetchStats getPrefetchStats() {
+        if (blockCache) {
+            return blockCache->getStats();
+        }
+        return prefetchStats();
+    }
+
+    indexEntry getIndexEntry(int32_t blockNumber) const {
+        auto it = blockMap.find(blockNumber);
+        if (it == blockMap.end()) {
+            return indexEntry{0, 0}; // empty block
+        }
+        return it->second;
+    }
+
+    // decompressed bytes of a block, through the block cache when there is one. read-ahead goes in the batch class
+    shared_ptr<const vector<char>> getUncompressedBlock(int32_t blockNumber, bool prefetch) {
+        indexEntry idx = getIndexEntry(blockNumber);
+        ioPriority readClass = prefetch ? ioPriority::BATCH : readPriority(nullptr);
+        if (!blockCache) {
+            return readUncompressedBlock(fileName, idx, readClass);
+        }
+        bool reserved;
+        shared_ptr<const vector<char>> data = blockCache->getOrReserve(blockNumber, prefetch, reserved);
+        if (!reserved) {
+            return data;
+        }
+        try {
+            data = readUncompressedBlock(fileName, idx, readClass);
+        } catch (...) {
+            blockCache->release(blockNumber);
+            throw;
+        }
+        blockCache->put(blockNumber, data, prefetch, idx.size);
+        return data;
+    }
+
+    // positions into blockNumbers, ordered by where each block sits in the file. block numbers are not in file
+    // order; for v9 intra matrices ascending (depth, pad) jumps back and forth across the whole matrix
+    vector<size_t> getFileOrder(const vector<int32_t> &blockNumbers) const {
+        vector<int64_t> positions(blockNumbers.size());
+        vector<size_t> order(blockNumbers.size());
+        for (size_t i = 0; i < blockNumbers.size(); i++) {
+            positions[i] = getIndexEntry(blockNumbers[i]).position;
+            order[i] = i;
+        }
+        stable_sort(order.begin(), order.end(), [&positions](size_t a, size_t b) {
+            return positions[a] < positions[b];
+        });
+        return order;
+    }
+
+    // decompressed bytes of every listed block, in the same order. whatever isn't cached is read as one batch, front
+    // to back through the file, and decompressed as the reads complete. once control has expired the blocks left to
+    // read come back null
+    vector<shared_ptr<const vector<char>>> getUncompressedBlocks(const vector<int32_t> &blockNumbers,
+                                                                 queryControl *control) {
+        vector<shared_ptr<const vector<char>>> blocks(blockNumbers.size());
+        vector<size_t> toRead;
+        vector<indexEntry> entries;
+        for (size_t i : getFileOrder(blockNumbers)) {
+            indexEntry idx = getIndexEntry(blockNumbers[i]);
+            bool reserved = true;
+            if (blockCache) {
+                blocks[i] = blockCache->getOrReserve(blockNumbers[i], false, reserved);
+            }
+            if (!reserved) {
+                continue;
+            }
+            if (idx.size <= 0) {
+                blocks[i] = make_shared<const vector<char>>();
+                if (blockCache) {
+                    blockCache->put(blockNumbers[i], blocks[i], false, 0);
+                }
+                continue;
+            }
+            toRead.push_back(i);
+            entries.push_back(idx);
+        }
+
+        try {
+            readBlocks(fileName, entries, [&](size_t i, char *compressedBytes) {
+                blocks[toRead[i]] = make_shared<const vector<char>>(inflateBlock(compressedBytes, entries[i].size));
+            }, control, readPriority(control));
+        } catch (...) {
+            if (blockCache) {
+                for (size_t i : toRead) {
+                    blockCache->release(blockNumbers[i]);
+                }
+            }
+            throw;
+        }
+        // blocks a stopped query didn't read are left null
+        int64_t bytesRead = 0, skipped = 0;
+        for (size_t i = 0; i < toRead.size(); i++) {
+            bool read = blocks[toRead[i]] != nullptr;
+            if (read) {
+                bytesRead += entries[i].size;
+            } else {
+                skipped++;
+            }
+            if (blockCache && read) {
+                blockCache->put(blockNumbers[toRead[i]], blocks[toRead[i]], false, entries[i].size);
+            } else if (blockCache) {
+                blockCache->release(blockNumbers[toRead[i]]);
+            }
+        }
+        if (control) {
+            control->bytesRead += bytesRead;
+            control->blocksSkipped += skipped;
+        }
+        return blocks;
+    }
+
+    // the ring of blocks around a region in bin coordinates, ringBlocks wide
+    set<int32_t> getRingBlockNumbers(const int64_t *regionIndices) const {
+        int64_t margin = static_cast<int64_t>(prefetchConfig.ringBlocks) * blockBinCount;
+        int64_t expanded[4] = {
+                max(static_cast<int64_t>(0), regionIndices[0] - margin),
+                min(static_cast<int64_t>(numBins1), regionIndices[1] + margin),
+                max(static_cast<int64_t>(0), regionIndices[2] - margin),
+                min(static_cast<int64_t>(numBins2), regionIndices[3] + margin)};
+        int64_t region[4] = {regionIndices[0], regionIndices[1], regionIndices[2], regionIndices[3]};
+        set<int32_t> ring = getBlockNumbers(expanded);
+        for (int32_t blockNumber : getBlockNumbers(region)) {
+            ring.erase(blockNumber);
+        }
+        return ring;
+    }
+
+    void schedulePrefetch(const int64_t *regionIndices) {
+        {
+            lock_guard<mutex> lock(prefetchMutex);
+            if (!prefetchEnabled) {
+                return;
+            }
+            copy(regionIndices, regionIndices + 4, pendingRegion);
+            hasPendingPrefetch = true;
+            prefetchGeneration++; // abandons whatever ring is still being loaded
+        }
+        prefetchWakeup.notify_all();
+    }
+
+    void runPrefetcher() {
+        auto windowStart = chrono::steady_clock::now();
+        int64_t bytesInWindow = 0;
+        while (true) {
+            int64_t region[4];
+            int64_t generation;
+            {
+                unique_lock<mutex> lock(prefetchMutex);
+                prefetchWakeup.wait(lock, [this] { return hasPendingPrefetch || !prefetchEnabled; });
+                if (!prefetchEnabled) {
+                    return;
+                }
+                copy(pendingRegion, pendingRegion + 4, region);
+                hasPendingPrefetch = false;
+                generation = prefetchGeneration;
+            }
+
+            set<int32_t> ringSet = getRingBlockNumbers(region);
+            vector<int32_t> ring(ringSet.begin(), ringSet.end());
+            int64_t bytesThisQuery = 0;
+            for (size_t i : getFileOrder(ring)) {
+                int32_t blockNumber = ring[i];
+                indexEntry idx = getIndexEntry(blockNumber);
+                if (idx.size <= 0 || blockCache->contains(blockNumber)) {
+                    continue;
+                }
+                if (bytesThisQuery + idx.size > prefetchConfig.maxBytesPerQuery || !blockCache->hasRoomFor(idx.size)) {
+                    break;
+                }
+                if (prefetchConfig.maxBytesPerSecond > 0) {
+                    // simple fixed window rate limit
+                    auto now = chrono::steady_clock::now();
+                    if (now - windowStart >= chrono::seconds(1)) {
+                        windowStart = now;
+                        bytesInWindow = 0;
+                    }
+                    if (bytesInWindow + idx.size > prefetchConfig.maxBytesPerSecond) {
+                        unique_lock<mutex> lock(prefetchMutex);
+                        prefetchWakeup.wait_until(lock, windowStart + chrono::seconds(1),
+                                                  [this, generation] { return prefetchGeneration != generation; });
+                        windowStart = chrono::steady_clock::now();
+                        bytesInWindow = 0;
+                    }
+                }
+                {
+                    lock_guard<mutex> lock(prefetchMutex);
+                    if (prefetchGeneration != generation) {
+                        break;
+                    }
+                }
+                getUncompressedBlock(blockNumber, true);
+                bytesThisQuery += idx.size;
+                bytesInWindow += idx.size;
+            }
+        }
+    }
+
+    static vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t &version, const string &fileName) {
+        char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
+        memstream bufferin(buffer, cNormEntry.size);
+        vector<double> cNorm = readNormalizationVector(bufferin, version);
+        delete buffer;
+        return cNorm;
+    }
+
+    bool isInRange(int32_t r, int32_t c, int32_t numRows, int32_t numCols) {
+        return 0 <= r && r < numRows && 0 <= c && c < numCols;
+    }
+
+    set<int32_t> getBlockNumbers(int64_t *regionIndices) const {
+        if (version > 8 && isIntra) {
+            return getBlockNumbersForRegionFromBinPositionV9Intra(regionIndices, blockBinCount, blockColumnCount);
+        } else {
+            return getBlockNumbersForRegionFromBinPosition(regionIndices, blockBinCount, blockColumnCount, isIntra);
+        }
+    }
+
+    vector<double> getNormVector(int32_t index){
+        if(index == c1){
+            return c1Norm;
+        } else if(index == c2){
+            return c2Norm;
+        }
+        cerr << "Invalid index provided: " << index << endl;
+        cerr << "Should be either " << c1 << " or " << c2 << endl;
+        vector<double> v;
+        return v;
+    }
+
+    vector<double> getExpectedValues(){
+        return expectedValues;
+    }
+
+    enum MatrixKind {OBSERVED, OE, EXPECTED};
+
+    // decodes one block, keeps the records inside the bin window (x0, x1, y0, y1, inclusive) and, given a band
+    // (min, max), with min <= |binX - binY| <= max, then normalizes and divides by or replaces with the expected value
+    // over the whole batch. specialised per query so that the per record work is only what the query needs.
+    // intrachromosomal records can also match mirrored, so the decoder gets the box around both orientations, or with
+    // splitMirror the window and its mirror one after the other; that decodes far less of a thin strip off the
+    // diagonal, but the mirrored records come after the others instead of in block order
+    template <MatrixKind Kind, bool Normalized, bool Intra>
+    void decodeRecords(const vector<char> &block, const int64_t window[4], const int64_t *band, bool splitMirror,
+                       RecordBatch &batch) {
+        int64_t decodeWindow[4] = {window[0], window[1], window[2], window[3]};
+        if (Intra && !splitMirror) {
+            decodeWindow[0] = decodeWindow[2] = min(window[0], window[2]);
+            decodeWindow[1] = decodeWindow[3] = max(window[1], window[3]);
+        }
+        batch.clear();
+        auto clip = [&batch, window, band](int32_t binX, int32_t binY, float counts) {
+            if (band) {
+                int64_t distance = abs(static_cast<int64_t>(binX) - binY);
+                if (distance < band[0] || distance > band[1]) {
+                    return;
+                }
+            }
+            if (inBinWindow(binX, binY, window, Intra)) {
+                batch.binX.push_back(binX);
+                batch.binY.push_back(binY);
+                batch.counts.push_back(counts);
+            }
+        };
+        decodeBlockRecords(block.data(), block.size(), version, decodeWindow, clip);
+        if (Intra && splitMirror) {
+            const int64_t mirror[4] = {window[2], window[3], window[0], window[1]};
+            auto clipMirror = [&clip, window](int32_t binX, int32_t binY, float counts) {
+                if (!inBinWindow(binX, binY, window, false)) {
+                    clip(binX, binY, counts);
+                }
+            };
+            decodeBlockRecords(block.data(), block.size(), version, mirror, clipMirror);
+        }
+
+        size_t n = batch.size();
+        float *counts = batch.counts.data();
+        if (Kind == EXPECTED) {
+            if (Intra) {
+                gatherAssign(counts, batch.diagonalDistances(expectedFloat.size()), expectedFloat.data(), n);
+            } else {
+                fill(counts, counts + n, static_cast<float>(avgCount));
+            }
+        } else {
+            if (Normalized) {
+                gatherMultiply(counts, batch.binX.data(), c1NormInverse.data(), n);
+                gatherMultiply(counts, batch.binY.data(), c2NormInverse.data(), n);
+            }
+            if (Kind == OE) {
+                if (Intra) {
+                    gatherMultiply(counts, batch.diagonalDistances(expectedInverse.size()), expectedInverse.data(), n);
+                } else {
+                    for (size_t i = 0; i < n; i++) {
+                        counts[i] *= avgCountInverse;
+                    }
+                }
+            }
+        }
+    }
+
+    template <MatrixKind Kind, bool Normalized, bool Intra, typename Visit>
+    void decodeBlocks(const vector<shared_ptr<const vector<char>>> &blocks, const vector<array<int64_t, 4>> &windows,
+                      const int64_t *band, bool splitMirror, Visit &visit, queryControl *control) {
+        RecordBatch batch;
+        for (size_t i = 0; i < blocks.size(); i++) {
+            if (!blocks[i]) {
+                continue; // not read, the query was stopped
+            }
+            if (control && control->expired()) {
+                control->blocksSkipped += count_if(blocks.begin() + i, blocks.end(),
+                                                   [](const shared_ptr<const vector<char>> &block) {
+                    return block != nullptr;
+                });
+                return;
+            }
+            decodeRecords<Kind, Normalized, Intra>(*blocks[i], windows[i].data(), band, splitMirror, batch);
+            visit(i, batch);
+            if (control) {
+                control->blocksDecoded++;
+            }
+        }
+    }
+
+    template <MatrixKind Kind, typename Visit>
+    void decodeBlocks(const vector<shared_ptr<const vector<char>>> &blocks, const vector<array<int64_t, 4>> &windows,
+                      const int64_t *band, bool splitMirror, Visit &visit, queryControl *control) {
+        bool normalized = norm != "NONE";
+        if (normalized && isIntra) {
+            decodeBlocks<Kind, true, true>(blocks, windows, band, splitMirror, visit, control);
+        } else if (normalized) {
+            decodeBlocks<Kind, true, false>(blocks, windows, band, splitMirror, visit, control);
+        } else if (isIntra) {
+            decodeBlocks<Kind, false, true>(blocks, windows, band, splitMirror, visit, control);
+        } else {
+            decodeBlocks<Kind, false, false>(blocks, windows, band, splitMirror, visit, control);
+        }
+    }
+
+    // decodes blocks[i] clipped to windows[i], and to the distance band (min, max) in bins when there is one, with
+    // the kernel for this matrix and calls visit(i, batch) with its records, in bin coordinates. see decodeRecords
+    // for splitMirror. once control has expired the blocks left are skipped
+    template <typename Visit>
+    void forEachDecodedBlock(const vector<shared_ptr<const vector<char>>> &blocks,
+                             const vector<array<int64_t, 4>> &windows, Visit &visit, queryControl *control,
+                             const int64_t *band = nullptr, bool splitMirror = false) {
+        if (matrixType == "oe") {
+            decodeBlocks<OE>(blocks, windows, band, splitMirror, visit, control);
+        } else if (matrixType == "expected") {
+            decodeBlocks<EXPECTED>(blocks, windows, band, splitMirror, visit, control);
+        } else {
+            decodeBlocks<OBSERVED>(blocks, windows, band, splitMirror, visit, control);
+        }
+    }
+
+    // the bins whose genomic position is inside the region. a record at bin b sits at b * resolution, so it is inside
+    // [g0, g1] when ceil(g0 / resolution) <= b <= floor(g1 / resolution)
+    array<int64_t, 4> getBinWindow(const int64_t origRegionIndices[4]) const {
+        array<int64_t, 4> window;
+        for (int q = 0; q < 4; q++) {
+            int64_t g = origRegionIndices[q];
+            window[q] = g / resolution;
+            if (q % 2 == 0 && g > 0 && g % resolution != 0) {
+                window[q]++;
+            } else if (q % 2 == 1 && g < 0 && g % resolution != 0) {
+                window[q]--;
+            }
+        }
+        return window;
+    }
+
+    // calls emit(binX, binY, counts) for every contact in the region, in bin coordinates. the queries below all stop
+    // early once their control, if they have one, expires
+    template <typename Emit>
+    void forEachBinRecord(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, Emit emit,
+                          queryControl *control = nullptr) {
+        if (!foundFooter) {
+            return;
+        }
+        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
+        int64_t regionIndices[4];
+        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+
+        set<int32_t> blockNumberSet = getBlockNumbers(regionIndices);
+        vector<int32_t> blockNumbers(blockNumberSet.begin(), blockNumberSet.end());
+        // a batch at a time, so that a query stopped part way still has the records of the batches it finished
+        auto visitBatch = [&emit](RecordBatch &batch) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                emit(batch.binX[i], batch.binY[i], batch.counts[i]);
+            }
+        };
+        forEachBlockBatch(blockNumbers, getBinWindow(origRegionIndices), nullptr, false, visitBatch, control);
+        schedulePrefetch(regionIndices);
+    }
+
+    // calls emit(region, binX, binY, counts) for the contacts of every region, in bin coordinates. a block shared by
+    // several regions is read and decoded once and its records routed to each of them; every region gets its records
+    // in the same order forEachBinRecord would give them. returns whether each region got all of its records, which
+    // only a stopped control makes false
+    template <typename Emit>
+    vector<bool> forEachRegionBinRecord(const vector<queryRegion> &regions, Emit emit,
+                                        queryControl *control = nullptr) {
+        vector<bool> complete(regions.size(), true);
+        if (!foundFooter) {
+            return complete;
+        }
+        // blocks are read this many at a time so that a large batch doesn't hold the whole matrix in memory
+        const size_t blocksPerRead = 64;
+
+        vector<array<int64_t, 4>> regionWindows(regions.size());
+        map<int32_t, vector<size_t>> blockRegions;
+        for (size_t r = 0; r < regions.size(); r++) {
+            int64_t origRegionIndices[] = {regions[r].x0, regions[r].x1, regions[r].y0, regions[r].y1};
+            int64_t regionIndices[4];
+            convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+            regionWindows[r] = getBinWindow(origRegionIndices);
+            for (int32_t blockNumber : getBlockNumbers(regionIndices)) {
+                blockRegions[blockNumber].push_back(r);
+            }
+        }
+
+        auto next = blockRegions.begin();
+        while (next != blockRegions.end()) {
+            vector<int32_t> blockNumbers;
+            vector<const vector<size_t> *> routes;
+            // each block is clipped to the box around the windows of the regions that need it
+            vector<array<int64_t, 4>> windows;
+            for (; next != blockRegions.end() && blockNumbers.size() < blocksPerRead; ++next) {
+                array<int64_t, 4> window = regionWindows[next->second.front()];
+                for (size_t r : next->second) {
+                    window[0] = min(window[0], regionWindows[r][0]);
+                    window[1] = max(window[1], regionWindows[r][1]);
+                    window[2] = min(window[2], regionWindows[r][2]);
+                    window[3] = max(window[3], regionWindows[r][3]);
+                }
+                blockNumbers.push_back(next->first);
+                routes.push_back(&next->second);
+                windows.push_back(window);
+            }
+            vector<shared_ptr<const vector<char>>> blocks = getUncompressedBlocks(blockNumbers, control);
+            bool intra = isIntra;
+            vector<bool> decoded(blocks.size(), false);
+            auto visit = [&](size_t b, RecordBatch &batch) {
+                decoded[b] = true;
+                for (size_t r : *routes[b]) {
+                    const int64_t *window = regionWindows[r].data();
+                    for (size_t i = 0; i < batch.size(); i++) {
+                        if (inBinWindow(batch.binX[i], batch.binY[i], window, intra)) {
+                            emit(r, batch.binX[i], batch.binY[i], batch.counts[i]);
+                        }
+                    }
+                }
+            };
+            forEachDecodedBlock(blocks, windows, visit, control);
+            for (size_t b = 0; b < blocks.size(); b++) {
+                if (!decoded[b]) {
+                    for (size_t r : *routes[b]) {
+                        complete[r] = false;
+                    }
+                }
+            }
+        }
+        return complete;
+    }
+
+    // calls visit(batch) with the records of each of the blocks inside window, and the band when there is one, in
+    // bin coordinates. like forEachRegionBinRecord, blocks are read 64 at a time so that memory stays bounded however
+    // many there are. a null control never expires
+    template <typename Visit>
+    void forEachBlockBatch(const vector<int32_t> &blockNumbers, const array<int64_t, 4> &window, const int64_t *band,
+                           bool splitMirror, Visit &visit, queryControl *control) {
+        const size_t blocksPerRead = 64;
+        auto visitBlock = [&visit](size_t, RecordBatch &batch) {
+            visit(batch);
+        };
+        for (size_t first = 0; first < blockNumbers.size(); first += blocksPerRead) {
+            vector<int32_t> chunk(blockNumbers.begin() + first,
+                                  blockNumbers.begin() + min(blockNumbers.size(), first + blocksPerRead));
+            vector<shared_ptr<const vector<char>>> blocks = getUncompressedBlocks(chunk, control);
+            vector<array<int64_t, 4>> windows(blocks.size(), window);
+            forEachDecodedBlock(blocks, windows, visitBlock, control, band, splitMirror);
+        }
+    }
+
+    // calls visit(batch) with the records of each block of the whole matrix, in bin coordinates and block order
+    template <typename Visit>
+    void forEachMatrixBatch(Visit visit, queryControl *control = nullptr) {
+        if (!foundFooter) {
+            return;
+        }
+        vector<int32_t> blockNumbers;
+        for (const auto &entry : blockMap) {
+            blockNumbers.push_back(entry.first);
+        }
+        array<int64_t, 4> everything = {{allBins[0], allBins[1], allBins[2], allBins[3]}};
+        forEachBlockBatch(blockNumbers, everything, nullptr, false, visit, control);
+    }
+
+    // the blocks that can hold records with minBins <= |binX - binY| <= maxBins. version 9 intrachromosomal blocks
+    // are laid out by depth, log2(1 + |binX - binY| / sqrt(2) / blockBinCount), and position along the diagonal, so
+    // only the depth rows for the band are taken; older files use a square grid, where the distances a block can hold
+    // follow from how far it is off the diagonal
+    vector<int32_t> getBlockNumbersInBand(int64_t minBins, int64_t maxBins) const {
+        vector<int32_t> blockNumbers;
+        if (version > 8) {
+            // widened slightly so that a band edge on a depth boundary can't be lost to rounding in log2
+            auto depthOf = [this](int64_t distance, double slack) {
+                return static_cast<int32_t>(log2(1 + distance / sqrt(2) / blockBinCount * slack));
+            };
+            int32_t nearerDepth = depthOf(minBins, 1 - 1e-9);
+            int32_t furtherDepth = depthOf(maxBins, 1 + 1e-9);
+            for (const auto &entry : blockMap) {
+                int32_t depth = entry.first / blockColumnCount;
+                if (depth >= nearerDepth && depth <= furtherDepth) {
+                    blockNumbers.push_back(entry.first);
+                }
+            }
+        } else {
+            for (const auto &entry : blockMap) {
+                int64_t offDiagonal = abs(entry.first / blockColumnCount - entry.first % blockColumnCount);
+                int64_t nearest = offDiagonal == 0 ? 0 : (offDiagonal - 1) * blockBinCount + 1;
+                int64_t furthest = (offDiagonal + 1) * blockBinCount - 1;
+                if (furthest >= minBins && nearest <= maxBins) {
+                    blockNumbers.push_back(entry.first);
+                }
+            }
+        }
+        return blockNumbers;
+    }
+
+    // calls emit(binX, binY, counts) for every contact of an intrachromosomal matrix whose genomic distance
+    // |x - y| is between minDistance and maxDistance inclusive, in bin coordinates. only the blocks that can hold
+    // such contacts are read
+    template <typename Emit>
+    void forEachBandBinRecord(int64_t minDistance, int64_t maxDistance, Emit emit, queryControl *control = nullptr) {
+        if (!foundFooter) {
+            return;
+        }
+        if (!isIntra) {
+            cerr << "Band queries need an intrachromosomal matrix" << endl;
+            return;
+        }
+        // a record at bin b sits at b * resolution, so these are the bin distances inside the band
+        int64_t band[2] = {(max(minDistance, static_cast<int64_t>(0)) + resolution - 1) / resolution,
+                           maxDistance / resolution};
+        if (maxDistance < 0 || band[0] > band[1]) {
+            return;
+        }
+        auto visit = [&emit](RecordBatch &batch) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                emit(batch.binX[i], batch.binY[i], batch.counts[i]);
+            }
+        };
+        array<int64_t, 4> everything = {{allBins[0], allBins[1], allBins[2], allBins[3]}};
+        forEachBlockBatch(getBlockNumbersInBand(band[0], band[1]), everything, band, false, visit, control);
+    }
+
+    // same as forEachBinRecord, in genomic coordinates
+    template <typename Emit>
+    void forEachRecord(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, Emit emit, queryControl *control = nullptr) {
+        int64_t binSize = resolution;
+        forEachBinRecord(gx0, gx1, gy0, gy1, [&emit, binSize](int32_t binX, int32_t binY, float counts) {
+            emit(static_cast<int32_t>(binX * binSize), static_cast<int32_t>(binY * binSize), counts);
+        }, control);
+    }
+
+    vector<contactRecord> getRecords(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                                     queryControl *control = nullptr) {
+        vector<contactRecord> records;
+        forEachRecord(gx0, gx1, gy0, gy1, [&records](int32_t binX, int32_t binY, float counts) {
+            contactRecord record = contactRecord();
+            record.binX = binX;
+            record.binY = binY;
+            record.counts = counts;
+            records.push_back(record);
+        }, control);
+        return records;
+    }
+
+    // getRecords a batch of blocks at a time: onChunk(records, last) gets the records of each 64 blocks as soon as
+    // they are decoded (possibly none), last being set on the final batch, and no more blocks are read once it
+    // returns false. returns false if it was stopped that way
+    bool getRecordsInChunks(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                            const function<bool(vector<contactRecord> &, bool)> &onChunk,
+                            queryControl *control = nullptr) {
+        vector<contactRecord> records;
+        if (!foundFooter) {
+            return onChunk(records, true);
+        }
+        const size_t blocksPerRead = 64;
+        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
+        int64_t regionIndices[4];
+        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+        set<int32_t> blockNumberSet = getBlockNumbers(regionIndices);
+        vector<int32_t> blockNumbers(blockNumberSet.begin(), blockNumberSet.end());
+        array<int64_t, 4> window = getBinWindow(origRegionIndices);
+        int64_t binSize = resolution;
+        auto visit = [&records, binSize](size_t, RecordBatch &batch) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                contactRecord record = contactRecord();
+                record.binX = static_cast<int32_t>(batch.binX[i] * binSize);
+                record.binY = static_cast<int32_t>(batch.binY[i] * binSize);
+                record.counts = batch.counts[i];
+                records.push_back(record);
+            }
+        };
+        size_t first = 0;
+        do {
+            vector<int32_t> chunk(blockNumbers.begin() + first,
+                                  blockNumbers.begin() + min(blockNumbers.size(), first + blocksPerRead));
+            first += chunk.size();
+            vector<shared_ptr<const vector<char>>> blocks = getUncompressedBlocks(chunk, control);
+            vector<array<int64_t, 4>> windows(blocks.size(), window);
+            records.clear();
+            forEachDecodedBlock(blocks, windows, visit, control);
+            if (!onChunk(records, first >= blockNumbers.size())) {
+                return false;
+            }
+        } while (first < blockNumbers.size());
+        schedulePrefetch(regionIndices);
+        return true;
+    }
+
+    // same records as getRecords, one column per field
+    contactColumns getRecordsAsColumns(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                                       queryControl *control = nullptr) {
+        contactColumns columns;
+        forEachRecord(gx0, gx1, gy0, gy1, [&columns](int32_t binX, int32_t binY, float counts) {
+            columns.binX.push_back(binX);
+            columns.binY.push_back(binY);
+            columns.counts.push_back(counts);
+        }, control);
+        return columns;
+    }
+
+    // the contacts of the whole chromosome within a band around the diagonal, minDistance <= |x - y| <= maxDistance
+    vector<contactRecord> getRecordsInBand(int64_t minDistance, int64_t maxDistance, queryControl *control = nullptr) {
+        vector<contactRecord> records;
+        int64_t binSize = resolution;
+        forEachBandBinRecord(minDistance, maxDistance, [&records, binSize](int32_t binX, int32_t binY, float counts) {
+            contactRecord record = contactRecord();
+            record.binX = static_cast<int32_t>(binX * binSize);
+            record.binY = static_cast<int32_t>(binY * binSize);
+            record.counts = counts;
+            records.push_back(record);
+        }, control);
+        return records;
+    }
+
+    // the blocks holding the cells (bin, t) of the first chromosome's bin against every bin t of the second, or with
+    // onFirst false (t, bin). version 9 intrachromosomal blocks follow the diagonal, so rather than the box
+    // getBlockNumbers would take, the block of each cell of the strip is worked out
+    vector<int32_t> getBlockNumbersForStrip(int64_t bin, bool onFirst) const {
+        set<int32_t> blockNumbers;
+        if (version > 8 && isIntra) {
+            for (int64_t t = 0; t <= numBins1; t++) {
+                double scaled = abs(bin - t) / sqrt(2) / blockBinCount;
+                int32_t pad = static_cast<int32_t>((bin + t) / 2 / blockBinCount);
+                // both sides of a depth boundary, so that rounding in log2 can't lose a block
+                blockNumbers.insert(static_cast<int32_t>(log2(1 + scaled * (1 - 1e-9))) * blockColumnCount + pad);
+                blockNumbers.insert(static_cast<int32_t>(log2(1 + scaled * (1 + 1e-9))) * blockColumnCount + pad);
+            }
+        } else {
+            int64_t regionIndices[4] = {bin, bin, 0, numBins2};
+            if (!onFirst) {
+                regionIndices[0] = 0;
+                regionIndices[1] = numBins1;
+                regionIndices[2] = regionIndices[3] = bin;
+            }
+            blockNumbers = getBlockNumbers(regionIndices);
+        }
+        vector<int32_t> present;
+        for (int32_t blockNumber : blockNumbers) {
+            if (blockMap.count(blockNumber)) {
+                present.push_back(blockNumber);
+            }
+        }
+        return present;
+    }
+
+    // a virtual 4C profile: the contacts of the bin at position on chromosome index (c1 or c2) with every bin of the
+    // other chromosome, as a dense vector indexed by bin. only the blocks crossing the strip are read; list blocks
+    // are decoded just for the viewpoint's row or column and dense blocks only at its cells. intrachromosomal, the
+    // viewpoint's row and its column are decoded separately instead of the box around both. cells without a finite
+    // value are 0, as in getRecordsAsMatrix
+    vector<float> getViewpointProfile(int32_t index, int64_t position, queryControl *control = nullptr) {
+        vector<float> profile;
+        if (!foundFooter) {
+            return profile;
+        }
+        if (index != c1 && index != c2) {
+            cerr << "Invalid index provided: " << index << endl;
+            cerr << "Should be either " << c1 << " or " << c2 << endl;
+            return profile;
+        }
+        bool onFirst = index == c1;
+        profile.assign(static_cast<size_t>(onFirst ? numBins2 : numBins1) + 1, 0);
+        int64_t bin = position / resolution;
+        if (position < 0 || bin > (onFirst ? numBins1 : numBins2)) {
+            return profile;
+        }
+
+        array<int64_t, 4> window = {{bin, bin, allBins[2], allBins[3]}};
+        if (!onFirst) {
+            window = {{allBins[0], allBins[1], bin, bin}};
+        }
+        bool intra = isIntra;
+        auto visit = [&](RecordBatch &batch) {
+            for (size_t i = 0; i < batch.size(); i++) {
+                float counts = batch.counts[i];
+                if (isnan(counts) || isinf(counts)) {
+                    continue;
+                }
+                int64_t other = onFirst ? batch.binY[i] : batch.binX[i];
+                if (intra && batch.binX[i] != bin) {
+                    other = batch.binX[i];
+                }
+                if (other >= 0 && other < static_cast<int64_t>(profile.size())) {
+                    profile[other] = counts;
+                }
+            }
+        };
+        forEachBlockBatch(getBlockNumbersForStrip(bin, onFirst), window, nullptr, true, visit, control);
+        return profile;
+    }
+
+    // compressed size of all the blocks the regions touch, each counted once; a cheap stand-in for the cost of
+    // reading them
+    int64_t getEstimatedBlockBytes(const vector<queryRegion> &regions) {
+        if (!foundFooter) {
+            return 0;
+        }
+        set<int32_t> blockNumbers;
+        for (const queryRegion &region : regions) {
+            int64_t origRegionIndices[] = {region.x0, region.x1, region.y0, region.y1};
+            int64_t regionIndices[4];
+            convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+            set<int32_t> regionBlocks = getBlockNumbers(regionIndices);
+            blockNumbers.insert(regionBlocks.begin(), regionBlocks.end());
+        }
+        int64_t bytes = 0;
+        for (int32_t blockNumber : blockNumbers) {
+            bytes += getIndexEntry(blockNumber).size;
+        }
+        return bytes;
+    }
+
+    // what getRecords for the region would cost, worked out from the footer and the block index without reading a
+    // block. the decompressed size and record count are guesses: blocks typically inflate about threefold, and the
+    // records are the matrix's occupied cells prorated by the share of its compressed bytes the region's blocks hold,
+    // or, in files that leave the occupied cell count at 0, one per 6 decompressed bytes (the usual 2 byte column
+    // and 4 byte count of a list block)
+    queryCost explain(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) const {
+        queryCost cost;
+        cost.resolution = resolution;
+        if (!foundFooter) {
+            return cost;
+        }
+        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
+        int64_t regionIndices[4];
+        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+        vector<indexEntry> entries;
+        for (int32_t blockNumber : getBlockNumbers(regionIndices)) {
+            indexEntry idx = getIndexEntry(blockNumber);
+            if (idx.size > 0) {
+                entries.push_back(idx);
+            }
+        }
+        sort(entries.begin(), entries.end(), [](const indexEntry &a, const indexEntry &b) {
+            return a.position < b.position;
+        });
+        for (size_t i = 0; i < entries.size(); i++) {
+            cost.compressedBytes += entries[i].size;
+            if (i == 0 || entries[i - 1].position + entries[i - 1].size != entries[i].position) {
+                cost.coalescedRequests++;
+            }
+        }
+        cost.blocks = cost.requests = static_cast<int64_t>(entries.size());
+
+        int64_t matrixBytes = 0;
+        for (const auto &entry : blockMap) {
+            matrixBytes += entry.second.size;
+        }
+        cost.estimatedDecompressedBytes = cost.compressedBytes * 3;
+        if (occupiedCellCount > 0 && matrixBytes > 0) {
+            cost.estimatedRecords = static_cast<int64_t>(static_cast<double>(occupiedCellCount) *
+                                                         cost.compressedBytes / matrixBytes);
+        } else {
+            cost.estimatedRecords = cost.estimatedDecompressedBytes / 6;
+        }
+        cost.normVectorBytes = normVectorBytes;
+        // expected vectors are stored as floats from version 9 on, as doubles before
+        cost.expectedVectorBytes = static_cast<int64_t>(expectedValues.size()) * (version > 8 ? 4 : 8);
+        return cost;
+    }
+
+    // getRecords for each region, reading every block the regions share once
+    vector<vector<contactRecord>> getRecordsForRegions(const vector<queryRegion> &regions,
+                                                       queryControl *control = nullptr) {
+        vector<vector<contactRecord>> records(regions.size());
+        int64_t binSize = resolution;
+        forEachRegionBinRecord(regions, [&records, binSize](size_t region, int32_t binX, int32_t binY, float counts) {
+            contactRecord record = contactRecord();
+            record.binX = static_cast<int32_t>(binX * binSize);
+            record.binY = static_cast<int32_t>(binY * binSize);
+            record.counts = counts;
+            records[region].push_back(record);
+        }, control);
+        return records;
+    }
+
+    // getRecordsAsColumns for each region, reading every block the regions share once
+    vector<contactColumns> getRecordsForRegionsAsColumns(const vector<queryRegion> &regions,
+                                                         queryControl *control = nullptr) {
+        vector<contactColumns> columns(regions.size());
+        int64_t binSize = resolution;
+        forEachRegionBinRecord(regions, [&columns, binSize](size_t region, int32_t binX, int32_t binY, float counts) {
+            columns[region].binX.push_back(static_cast<int32_t>(binX * binSize));
+            columns[region].binY.push_back(static_cast<int32_t>(binY * binSize));
+            columns[region].counts.push_back(counts);
+        }, control);
+        return columns;
+    }
+
+    // rows span the x region and columns the y region, one per bin
+    void getMatrixShape(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, int64_t &numRows, int64_t &numCols) const {
+        numRows = gx1 / resolution - gx0 / resolution + 1;
+        numCols = gy1 / resolution - gy0 / resolution + 1;
+    }
+
+    // scatters the region straight from the decoded blocks into a row-major numRows x numCols buffer, which is zeroed
+    // first. intrachromosomal contacts are mirrored into the lower triangle and NaN/inf values are left at zero.
+    // returns whether the region had any records at all
+    bool fillMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, float *matrix, queryControl *control = nullptr) {
+        int64_t numRows, numCols;
+        getMatrixShape(gx0, gx1, gy0, gy1, numRows, numCols);
+        fill(matrix, matrix + numRows * numCols, 0.0f);
+        int64_t originR = gx0 / resolution;
+        int64_t originC = gy0 / resolution;
+        bool found = false;
+        forEachBinRecord(gx0, gx1, gy0, gy1, [&](int32_t binX, int32_t binY, float counts) {
+            found = true;
+            placeInMatrix(matrix, numRows, numCols, originR, originC, binX, binY, counts);
+        }, control);
+        return found;
+    }
+
+    // writes counts into the cell for (binX, binY) of a row-major numRows x numCols matrix whose first cell is bin
+    // (originR, originC), and into the mirrored cell for intrachromosomal matrices. cells outside the matrix and
+    // NaN/inf values are skipped
+    void placeInMatrix(float *matrix, int64_t numRows, int64_t numCols, int64_t originR, int64_t originC,
+                       int32_t binX, int32_t binY, float counts) const {
+        if (isnan(counts) || isinf(counts)) return;
+        int64_t r = binX - originR;
+        int64_t c = binY - originC;
+        if (0 <= r && r < numRows && 0 <= c && c < numCols) {
+            matrix[r * numCols + c] = counts;
+        }
+        if (isIntra) {
+            r = binY - originR;
+            c = binX - originC;
+            if (0 <= r && r < numRows && 0 <= c && c < numCols) {
+                matrix[r * numCols + c] = counts;
+            }
+        }
+    }
+
+    // the region as one contiguous row-major buffer; a 1x1 zero matrix if it has no records
+    vector<float> getRecordsAsDenseMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, int64_t &numRows,
+                                          int64_t &numCols, queryControl *control = nullptr) {
+        getMatrixShape(gx0, gx1, gy0, gy1, numRows, numCols);
+        vector<float> matrix(static_cast<size_t>(numRows * numCols));
+        if (!fillMatrix(gx0, gx1, gy0, gy1, matrix.data(), control)) {
+            numRows = numCols = 1;
+            return vector<float>(1, 0);
+        }
+        return matrix;
+    }
+
+    vector<vector<float>> getRecordsAsMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                                             queryControl *control = nullptr) {
+        int64_t numRows, numCols;
+        vector<float> matrix = getRecordsAsDenseMatrix(gx0, gx1, gy0, gy1, numRows, numCols, control);
+        vector<vector<float>> finalMatrix;
+        for (int64_t i = 0; i < numRows; i++) {
+            finalMatrix.emplace_back(matrix.begin() + i * numCols, matrix.begin() + (i + 1) * numCols);
+        }
+        return finalMatrix;
+    }
+
+    // the expected value of the cell at (binX, binY), the same one decodeRecords gives an "expected" record: the
+    // expected vector at their distance (capped at its last entry) intrachromosomally, the average count otherwise
+    float expectedAt(int64_t binX, int64_t binY) const {
+        if (!isIntra) {
+            return static_cast<float>(avgCount);
+        }
+        size_t distance = static_cast<size_t>(abs(binY - binX));
+        return expectedFloat[min(distance, expectedFloat.size() - 1)];
+    }
+
+    // whether the expected values are loaded, which is the case for "oe" and "expected" matrices
+    bool hasExpectedValues() const {
+        if (foundFooter && (matrixType == "oe" || matrixType == "expected") && (!isIntra || !expectedFloat.empty())) {
+            return true;
+        }
+        cerr << "Expected values need an oe or expected matrix" << endl;
+        return false;
+    }
+
+    // calls emit(binX, binY, expected) for every cell of the region, computed without reading any block. each cell
+    // comes once, in the orientation the file stores it, so intrachromosomal cells have binX <= binY like the records
+    // of getRecords; the cells of the region's mirror image are included the same way. cells past the end of the
+    // chromosomes are left out
+    template <typename Emit>
+    void forEachExpectedBinRecord(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, Emit emit) {
+        if (!hasExpectedValues()) {
+            return;
+        }
+        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
+        array<int64_t, 4> window = getBinWindow(origRegionIndices);
+        int64_t x0 = max(window[0], static_cast<int64_t>(0)), x1 = min(window[1], static_cast<int64_t>(numBins1));
+        int64_t y0 = max(window[2], static_cast<int64_t>(0)), y1 = min(window[3], static_cast<int64_t>(numBins2));
+        for (int64_t x = x0; x <= x1; x++) {
+            for (int64_t y = y0; y <= y1; y++) {
+                if (!isIntra || x <= y) {
+                    emit(static_cast<int32_t>(x), static_cast<int32_t>(y), expectedAt(x, y));
+                } else if (!inBinWindow(static_cast<int32_t>(y), static_cast<int32_t>(x), window.data(), false)) {
+                    // below the diagonal and not also in the region the other way round
+                    emit(static_cast<int32_t>(y), static_cast<int32_t>(x), expectedAt(x, y));
+                }
+            }
+        }
+    }
+
+    // getRecords for an "expected" matrix with every cell of the region filled in, and no block read. getRecords on
+    // the same matrix still gives the expected values only where there are contacts
+    vector<contactRecord> getExpectedRecords(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
+        vector<contactRecord> records;
+        int64_t binSize = resolution;
+        forEachExpectedBinRecord(gx0, gx1, gy0, gy1, [&records, binSize](int32_t binX, int32_t binY, float counts) {
+            contactRecord record = contactRecord();
+            record.binX = static_cast<int32_t>(binX * binSize);
+            record.binY = static_cast<int32_t>(binY * binSize);
+            record.counts = counts;
+            records.push_back(record);
+        });
+        return records;
+    }
+
+    // fillMatrix with the expected value in every cell, laid out the same way, without reading any block. cells past
+    // the end of the chromosomes stay zero. returns whether the expected values were there to fill it with
+    bool fillExpectedMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1, float *matrix) {
+        int64_t numRows, numCols;
+        getMatrixShape(gx0, gx1, gy0, gy1, numRows, numCols);
+        fill(matrix, matrix + numRows * numCols, 0.0f);
+        if (!hasExpectedValues()) {
+            return false;
+        }
+        int64_t originR = gx0 / resolution;
+        int64_t originC = gy0 / resolution;
+        for (int64_t r = 0; r < numRows; r++) {
+            int64_t binX = originR + r;
+            if (binX < 0 || binX > numBins1) {
+                continue;
+            }
+            float *row = matrix + r * numCols;
+            for (int64_t c = 0; c < numCols; c++) {
+                int64_t binY = originC + c;
+                if (binY >= 0 && binY <= numBins2) {
+                    row[c] = expectedAt(binX, binY);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+// header and footer metadata is parsed once in the constructor and never changed afterwards, so one HiCFile (and the
+// MatrixZoomData it hands out) can be queried from any number of threads at once
+class HiCFile {
+public:
+    string prefix = "http"; // HTTP code
+    int64_t master = 0LL;
+    map<string, chromosome> chromosomeMap;
+    string genomeID;
+    int32_t numChromosomes = 0;
+    int32_t version = 0;
+    int64_t nviPosition = 0LL;
+    int64_t nviLength = 0LL;
+    vector<int32_t> resolutions;
+    int64_t totalFileSize = 0LL;
+    string fileName;
+
+    // header callback for the first request to a remote file; userdata is the HiCFile whose size is being read
+    static size_t hdf(char *b, size_t size, size_t nitems, void *userdata) {
+        size_t numbytes = size * nitems;
+        string s(b, numbytes);
+        int32_t found;
+        found = static_cast<int32_t>(s.find("content-range"));
+        if ((size_t)found == string::npos) {
+          found = static_cast<int32_t>(s.find("Content-Range"));
+        }
+        if ((size_t)found != string::npos) {
+            int32_t found2;
+            found2 = static_cast<int32_t>(s.find('/'));
+            //content-range: bytes 0-100000/891471462
+            if ((size_t)found2 != string::npos) {
+                string total = s.substr(found2 + 1);
+                static_cast<HiCFile *>(userdata)->totalFileSize = stol(total);
+            }
+        }
+
+        return numbytes;
+    }
+
+    CURL *oneTimeInitCURL(const char *url) {
+        CURL *curl = initCURL(url);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, hdf);
+        curl_easy_setopt(curl, CURLOPT_HEADERDATA, (void *) this);
+        return curl;
+    }
+
+    explicit HiCFile(const string &fileName) {
+        this->fileName = fileName;
+
+        // read header into buffer; 100K should be sufficient
+        if (std::strncmp(fileName.c_str(), prefix.c_str(), prefix.size()) == 0) {
+            CURL *curl;
+            curl = oneTimeInitCURL(fileName.c_str());
+            char *buffer = getData(curl, fileName, 0, 100000);
+            memstream bufin(buffer, 100000);
+            chromosomeMap = readHeader(bufin, master, genomeID, numChromosomes,
+                                       version, nviPosition, nviLength);
+            resolutions = readResolutionsFromHeader(bufin);
+            curl_easy_cleanup(curl);
+            if (DiskRangeCache::instance().enabled()) {
+                // a cached header never reaches hdf, so take the size from the cache's validator
+                int64_t length = DiskRangeCache::instance().contentLength(fileName);
+                if (length > 0) {
+                    totalFileSize = length;
+                }
+            }
+            delete buffer;
+        } else {
+            ifstream fin;
+            fin.open(fileName, fstream::in | fstream::binary);
+            if (!fin) {
+                failQuery(6, "File " + fileName + " cannot be opened for reading");
+            }
+            chromosomeMap = readHeader(fin, master, genomeID, numChromosomes,
+                                       version, nviPosition, nviLength);
+            resolutions = readResolutionsFromHeader(fin);
+            fin.close();
+        }
+    }
 
-    if (found) {
-        int32_t chunkSize = nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t));
-        buffer = getData(curl, myFilePosition + header_size, chunkSize);
-        memstream fin2(buffer, chunkSize);
-        populateBlockMap(fin2, nBlocks, blockMap);
-        delete buffer;
+    string getGenomeID() const{
+        return genomeID;
+    }
+
+    vector<int32_t> getResolutions() const{
+        return resolutions;
+    }
+
+    // looks a chromosome up without inserting into chromosomeMap; unknown names give an empty chromosome
+    chromosome getChromosome(const string &name) const {
+        auto it = chromosomeMap.find(name);
+        if (it == chromosomeMap.end()) {
+            return chromosome();
+        }
+        return it->second;
+    }
+
+    vector<chromosome> getChromosomes() const {
+        vector<chromosome> chromosomes;
+        auto iter = chromosomeMap.begin();
+        while (iter != chromosomeMap.end()) {
+            chromosomes.push_back(static_cast<chromosome>(iter->second));
+            iter++;
+        }
+        return chromosomes;
+    }
+
+    // the master index of the footer, which lists every chromosome pair that has a matrix
+    map<string, indexEntry> getMasterIndex() const {
+        map<string, indexEntry> masterIndex;
+        HiCFileStream stream(fileName);
+        if (stream.isHttp) {
+            int64_t bytes_to_read = totalFileSize - master;
+            char *buffer = getData(stream.curl, fileName, master, bytes_to_read);
+            memstream bufin(buffer, bytes_to_read);
+            masterIndex = readMasterIndex(bufin, version);
+            delete buffer;
+        } else {
+            stream.fin.seekg(master, ios::beg);
+            masterIndex = readMasterIndex(stream.fin, version);
+        }
+        stream.close();
+        return masterIndex;
+    }
+
+    MatrixZoomData *
+    getMatrixZoomData(const string &chr1, const string &chr2, const string& matrixType, const string& norm,
+                      const string& unit, int32_t resolution) const {
+        chromosome chrom1 = getChromosome(chr1);
+        chromosome chrom2 = getChromosome(chr2);
+        int32_t fileVersion = version;
+        int64_t masterPosition = master;
+        int64_t fileSize = totalFileSize;
+        return new MatrixZoomData(chrom1, chrom2, (matrixType), (norm), (unit),
+                                  resolution, fileVersion, masterPosition, fileSize, fileName);
+    }
+};
+
+// whether a <chr>[:x1:x2] locus names a chromosome of the file and, where it gives positions, gives whole numbers;
+// error says what is wrong with it otherwise
+static bool checkLocus(const map<string, chromosome> &chromosomes, const string &chrLoc, string &error) {
+    string chrom, x, y;
+    stringstream ss(chrLoc);
+    getline(ss, chrom, ':');
+    if (chromosomes.count(chrom) == 0) {
+        error = chrom + " not found in the file.";
+        return false;
+    }
+    int64_t position;
+    if (getline(ss, x, ':') && getline(ss, y, ':') && !(parseInt64(x, position) && parseInt64(y, position))) {
+        error = "Positions specified incorrectly in " + chrLoc + ", must be <chr>[:x1:x2]";
+        return false;
+    }
+    return true;
+}
+
+void parsePositions(const string &chrLoc, string &chrom, int64_t &pos1, int64_t &pos2, map<string, chromosome> map) {
+    string x, y, error;
+    if (!checkLocus(map, chrLoc, error)) {
+        failQuery(7, error);
+    }
+    stringstream ss(chrLoc);
+    getline(ss, chrom, ':');
+    if (getline(ss, x, ':') && getline(ss, y, ':')) {
+        parseInt64(x, pos1);
+        parseInt64(y, pos2);
     } else {
-        myFilePosition = myFilePosition + header_size + (nBlocks * (sizeof(int32_t) + sizeof(int64_t) + sizeof(int32_t)));
+        pos1 = 0LL;
+        pos2 = map[chrom].length;
     }
-    return blockMap;
 }
 
-// goes to the specified file pointer in http and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map<int32_t, indexEntry> readMatrixHttp(CURL *curl, int64_t myFilePosition, const string &unit, int32_t resolution,
-                                        float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount) {
-    int32_t size = sizeof(int32_t) * 3;
-    char *buffer = getData(curl, myFilePosition, size);
-    memstream bufin(buffer, size);
+// the chromosomes and genomic region of a straw() style query on an open file
+static void strawQueryRegion(const HiCFile &hiCFile, const string &chr1loc, const string &chr2loc, string &chr1,
+                             string &chr2, int64_t origRegionIndices[4]) {
+    fill(origRegionIndices, origRegionIndices + 4, -100LL);
+    if (hiCFile.getChromosome(chr1).index > hiCFile.getChromosome(chr2).index) {
+        parsePositions((chr1loc), chr1, origRegionIndices[2], origRegionIndices[3], hiCFile.chromosomeMap);
+        parsePositions((chr2loc), chr2, origRegionIndices[0], origRegionIndices[1], hiCFile.chromosomeMap);
+    } else {
+        parsePositions((chr1loc), chr1, origRegionIndices[0], origRegionIndices[1], hiCFile.chromosomeMap);
+        parsePositions((chr2loc), chr2, origRegionIndices[2], origRegionIndices[3], hiCFile.chromosomeMap);
+    }
+}
 
-    int32_t c1 = readInt32FromFile(bufin);
-    int32_t c2 = readInt32FromFile(bufin);
-    int32_t nRes = readInt32FromFile(bufin);
-    int32_t i = 0;
-    bool found = false;
-    myFilePosition = myFilePosition + size;
-    delete buffer;
-    map<int32_t, indexEntry> blockMap;
+// opens the file and finds the matrix and genomic region for a straw() style query. returns null if the arguments
+// are invalid. the matrix keeps what it needs of the file, which is closed again before this returns
+unique_ptr<MatrixZoomData>
+openStrawQuery(const string& matrixType, const string& norm, const string& fileName, const string& chr1loc,
+               const string& chr2loc, const string &unit, int32_t binsize, int64_t origRegionIndices[4]) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
+             << endl;
+        return nullptr;
+    }
 
-    while (i < nRes && !found) {
-        // myFilePosition gets updated within call
-        blockMap = readMatrixZoomDataHttp(curl, myFilePosition, unit, resolution, mySumCounts, myBlockBinCount, myBlockColumnCount,
-                                          found);
-        i++;
+    HiCFile hiCFile(fileName);
+    string chr1, chr2;
+    strawQueryRegion(hiCFile, chr1loc, chr2loc, chr1, chr2, origRegionIndices);
+    return unique_ptr<MatrixZoomData>(hiCFile.getMatrixZoomData(chr1, chr2, matrixType, norm, unit, binsize));
+}
+
+/*
+  straw serve: a daemon that keeps files open for the processes of a pipeline. It listens on a Unix domain socket
+  and keeps, across queries and clients, the header of every file it was asked about and up to maxMatrices matrices
+  with their footer entries, normalization and expected vectors and a cache of decompressed blocks. A local file
+  whose size or modification time changed is opened afresh; remote files are taken to never change.
+
+  Every message is a frame: a one byte type, a uint32 payload length and the payload, in native byte order since the
+  socket never leaves the machine. Strings are a uint32 length and their bytes.
+    client 'Q'  protocol version (uint8), matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize (int32),
+                timeout in milliseconds (int64, 0 for none)
+    server 'R'  records, binX (int32), binY (int32) and counts (float) each; one frame per batch of blocks decoded
+    server 'E'  the exit status the query would have ended the process with (int32, 0 if none) and a message;
+                ends the answer
+    server 'D'  interrupted (uint8), blocksDecoded, blocksSkipped and bytesRead (int64 each); ends the answer
+  A connection carries any number of queries, one after the other. A client that hangs up cancels its query. Both
+  ends check that the other runs as the same user before a query is sent or answered.
+ */
+#ifndef _WIN32
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0 // macOS, where sockets get SO_NOSIGPIPE instead
+#endif
+
+static const uint8_t serveProtocolVersion = 1;
+static_assert(sizeof(contactRecord) == 12, "'R' frames carry contactRecords as they are laid out in memory");
+
+static bool sendFully(int fd, const char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
     }
-    if (!found) {
-        cerr << "Error finding block data" << endl;
+    return true;
+}
+
+static bool receiveFully(int fd, char *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = recv(fd, data, size, 0);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
     }
-    return blockMap;
+    return true;
 }
 
-// goes to the specified file pointer and finds the raw contact matrixType at specified resolution, calling readMatrixZoomData.
-// sets blockbincount and blockcolumncount
-map<int32_t, indexEntry> readMatrix(istream &fin, int64_t myFilePosition, const string &unit, int32_t resolution,
-                                    float &mySumCounts, int32_t &myBlockBinCount, int32_t &myBlockColumnCount) {
-    map<int32_t, indexEntry> blockMap;
+static bool sendFrame(int fd, char type, const string &payload) {
+    char head[5];
+    head[0] = type;
+    uint32_t length = static_cast<uint32_t>(payload.size());
+    memcpy(head + 1, &length, sizeof(length));
+    return sendFully(fd, head, sizeof(head)) && sendFully(fd, payload.data(), payload.size());
+}
 
-    fin.seekg(myFilePosition, ios::beg);
-    int32_t c1 = readInt32FromFile(fin);
-    int32_t c2 = readInt32FromFile(fin);
-    int32_t nRes = readInt32FromFile(fin);
-    int32_t i = 0;
-    bool found = false;
-    while (i < nRes && !found) {
-        blockMap = readMatrixZoomData(fin, unit, resolution, mySumCounts, myBlockBinCount, myBlockColumnCount, found);
-        i++;
+static bool receiveFrame(int fd, char &type, string &payload) {
+    char head[5];
+    if (!receiveFully(fd, head, sizeof(head))) {
+        return false;
     }
-    if (!found) {
-        cerr << "Error finding block data" << endl;
+    type = head[0];
+    uint32_t length;
+    memcpy(&length, head + 1, sizeof(length));
+    payload.resize(length);
+    return length == 0 || receiveFully(fd, &payload[0], length);
+}
+
+// appends the fields of a frame's payload
+class FrameWriter {
+public:
+    string payload;
+
+    template <typename T>
+    void put(T value) {
+        payload.append(reinterpret_cast<const char *>(&value), sizeof(value));
     }
-    return blockMap;
+
+    void putString(const string &value) {
+        put(static_cast<uint32_t>(value.size()));
+        payload.append(value);
+    }
+};
+
+// takes the fields of a frame's payload off the front; ok turns false once a read runs past the end
+class FrameReader {
+public:
+    bool ok = true;
+
+    explicit FrameReader(const string &payload) : payload(payload) {}
+
+    template <typename T>
+    T get() {
+        T value = T();
+        if (at + sizeof(value) > payload.size()) {
+            ok = false;
+            return value;
+        }
+        memcpy(&value, payload.data() + at, sizeof(value));
+        at += sizeof(value);
+        return value;
+    }
+
+    string getString() {
+        uint32_t length = get<uint32_t>();
+        if (!ok || at + length > payload.size()) {
+            ok = false;
+            return string();
+        }
+        at += length;
+        return payload.substr(at - length, length);
+    }
+
+private:
+    const string &payload;
+    size_t at = 0;
+};
+
+static bool socketAddress(const string &path, sockaddr_un &address) {
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+        return false;
+    }
+    memcpy(address.sun_path, path.c_str(), path.size());
+    return true;
 }
 
-// gets the blocks that need to be read for this slice of the data.  needs blockbincount, blockcolumncount, and whether
-// or not this is intrachromosomal.
-set<int32_t> getBlockNumbersForRegionFromBinPosition(const int64_t *regionIndices, int32_t blockBinCount, int32_t blockColumnCount,
-                                                     bool intra) {
-    int32_t col1, col2, row1, row2;
-    col1 = static_cast<int32_t>(regionIndices[0] / blockBinCount);
-    col2 = static_cast<int32_t>((regionIndices[1] + 1) / blockBinCount);
-    row1 = static_cast<int32_t>(regionIndices[2] / blockBinCount);
-    row2 = static_cast<int32_t>((regionIndices[3] + 1) / blockBinCount);
+// whether the process at the other end of a connection runs as this user
+static bool peerIsThisUser(int fd) {
+#ifdef SO_PEERCRED
+    ucred credentials{};
+    socklen_t length = sizeof(credentials);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credentials, &length) == 0 && credentials.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    return getpeereid(fd, &uid, &gid) == 0 && uid == getuid();
+#endif
+}
 
-    set<int32_t> blocksSet;
-    // first check the upper triangular matrixType
-    for (int r = row1; r <= row2; r++) {
-        for (int c = col1; c <= col2; c++) {
-            int32_t blockNumber = r * blockColumnCount + c;
-            blocksSet.insert(blockNumber);
+// creates the directory, or checks the one that is there, so that it is this user's and nobody else can enter it
+static bool privateDirectory(const string &path) {
+    if (mkdir(path.c_str(), 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    struct stat info{};
+    return lstat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode) && info.st_uid == getuid() &&
+           (info.st_mode & 077) == 0;
+}
+
+// the directory of /tmp a daemon's socket goes in when there is no $XDG_RUNTIME_DIR
+static string privateSocketDirectory() {
+    return "/tmp/straw-" + to_string(getuid());
+}
+
+// a connection to whatever listens on the socket, or -1 if nothing does
+static int connectToSocket(const string &path) {
+    sockaddr_un address;
+    if (!socketAddress(path, address)) {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+#ifdef SO_NOSIGPIPE
+    int noSigPipe = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &noSigPipe, sizeof(noSigPipe));
+#endif
+    if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+  What the daemon keeps between queries. Files are looked up under the cache's lock, but a header is read outside
+  it. A matrix is built the first time it is asked for, under a lock of its own, so queries on other matrices never
+  wait for a footer being read; once built, any number of queries run on it at once. One the file doesn't have is
+  forgotten again, so that every client asking for it gets the diagnostic. The least recently used matrix is closed
+  past maxMatrices; queries still running on it keep it alive until they finish.
+ */
+class ServerCache {
+public:
+    struct Matrix {
+        mutex buildMutex;
+        unique_ptr<MatrixZoomData> mzd;
+    };
+
+    explicit ServerCache(const serveOptions &options) : options(options) {}
+
+    // the file, opened anew if it changed on disk. null, with the message and exit status a local query would have
+    // ended with, if it can't be opened
+    shared_ptr<HiCFile> getFile(const string &fileName, string &error, int32_t &status) {
+        int64_t size = 0, modified = 0;
+        bool isHttp = std::strncmp(fileName.c_str(), "http", 4) == 0;
+        if (!isHttp) {
+            struct stat info{};
+            if (stat(fileName.c_str(), &info) != 0 || !ifstream(fileName, fstream::in | fstream::binary)) {
+                error = "File " + fileName + " cannot be opened for reading";
+                status = 6;
+                return nullptr;
+            }
+            size = info.st_size;
+            modified = info.st_mtime;
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            auto it = files.find(fileName);
+            if (it != files.end() && it->second.size == size && it->second.modified == modified) {
+                return it->second.file;
+            }
+        }
+        // read without the lock, so that queries on other files don't wait for this header. may throw, leaving files
+        // as it was
+        shared_ptr<HiCFile> file = make_shared<HiCFile>(fileName);
+        lock_guard<mutex> lock(mtx);
+        auto it = files.find(fileName);
+        if (it != files.end() && it->second.size == size && it->second.modified == modified) {
+            return it->second.file; // opened by another query in the meantime
         }
+        if (it != files.end()) {
+            dropMatrices(fileName);
+        }
+        OpenFile &open = files[fileName];
+        open.file = file;
+        open.size = size;
+        open.modified = modified;
+        return open.file;
     }
-    // check region part that overlaps with lower left triangle but only if intrachromosomal
-    if (intra) {
-        for (int r = col1; r <= col2; r++) {
-            for (int c = row1; c <= row2; c++) {
-                int32_t blockNumber = r * blockColumnCount + c;
-                blocksSet.insert(blockNumber);
+
+    shared_ptr<Matrix> getMatrix(const string &fileName, const string &key) {
+        lock_guard<mutex> lock(mtx);
+        string fullKey = fileName + '\n' + key;
+        auto it = matrices.find(fullKey);
+        if (it != matrices.end()) {
+            recent.splice(recent.begin(), recent, it->second.second);
+            return it->second.first;
+        }
+        recent.push_front(fullKey);
+        shared_ptr<Matrix> matrix = make_shared<Matrix>();
+        matrices[fullKey] = make_pair(matrix, recent.begin());
+        while (static_cast<int64_t>(matrices.size()) > max(1, options.maxMatrices)) {
+            matrices.erase(recent.back());
+            recent.pop_back();
+        }
+        return matrix;
+    }
+
+    // forgets a matrix the file turned out not to have, so that the next query on it looks again
+    void dropMatrix(const string &fileName, const string &key, const shared_ptr<Matrix> &matrix) {
+        lock_guard<mutex> lock(mtx);
+        auto it = matrices.find(fileName + '\n' + key);
+        if (it != matrices.end() && it->second.first == matrix) {
+            recent.erase(it->second.second);
+            matrices.erase(it);
+        }
+    }
+
+    int64_t blockCacheBytesPerMatrix() const {
+        return options.blockCacheBytes / max(1, options.maxMatrices);
+    }
+
+private:
+    struct OpenFile {
+        shared_ptr<HiCFile> file;
+        int64_t size = 0;
+        int64_t modified = 0;
+    };
+
+    serveOptions options;
+    mutex mtx;
+    map<string, OpenFile> files;
+    map<string, pair<shared_ptr<Matrix>, list<string>::iterator>> matrices;
+    list<string> recent; // keys of matrices, most recently used first
+
+    // called with mtx held
+    void dropMatrices(const string &fileName) {
+        string prefix = fileName + '\n';
+        for (auto it = recent.begin(); it != recent.end();) {
+            if (it->compare(0, prefix.size(), prefix) == 0) {
+                matrices.erase(*it);
+                it = recent.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+};
+
+/*
+  The clients a daemon is serving, at most maxConnections at a time, each on a thread of its own. Every thread
+  removes itself as the last thing it does, so once stop() returns none of them touch the ServerCache or this any
+  more and both can go.
+ */
+class ServerConnections {
+public:
+    explicit ServerConnections(int32_t maxConnections) : maxConnections(max(1, maxConnections)) {}
+
+    // false if maxConnections clients are being served already, or the daemon is stopping
+    bool add(int fd) {
+        lock_guard<mutex> lock(mtx);
+        if (stopping || static_cast<int32_t>(open.size()) >= maxConnections) {
+            return false;
+        }
+        open.insert(fd);
+        return true;
+    }
+
+    void remove(int fd) {
+        lock_guard<mutex> lock(mtx);
+        open.erase(fd);
+        finished.notify_all(); // under mtx, so that stop() can't return and destroy finished first
+    }
+
+    // the query running on a connection, cancelled if the daemon stops before it ends
+    void startQuery(queryControl *control) {
+        lock_guard<mutex> lock(mtx);
+        if (stopping) {
+            control->cancel();
+        }
+        running.insert(control);
+    }
+
+    void endQuery(queryControl *control) {
+        lock_guard<mutex> lock(mtx);
+        running.erase(control);
+    }
+
+    // hangs up on every client, cancels their queries and waits for their threads to finish
+    void stop() {
+        unique_lock<mutex> lock(mtx);
+        stopping = true;
+        for (int fd : open) {
+            shutdown(fd, SHUT_RDWR);
+        }
+        for (queryControl *control : running) {
+            control->cancel();
+        }
+        finished.wait(lock, [this] { return open.empty(); });
+    }
+
+private:
+    int32_t maxConnections;
+    mutex mtx;
+    condition_variable finished;
+    set<int> open;
+    set<queryControl *> running;
+    bool stopping = false;
+};
+
+static bool sendError(int fd, int32_t status, const string &message) {
+    FrameWriter out;
+    out.put(status);
+    out.putString(message);
+    return sendFrame(fd, 'E', out.payload);
+}
+
+// answers one 'Q' frame. false once the client is gone. a query that fails throws a serveError, as a local query
+// would have ended the process
+static bool serveQuery(int fd, const string &request, ServerCache &cache, ServerConnections &connections) {
+    FrameReader in(request);
+    uint8_t version = in.get<uint8_t>();
+    string matrixType = in.getString(), norm = in.getString(), fileName = in.getString();
+    string chr1loc = in.getString(), chr2loc = in.getString(), unit = in.getString();
+    int32_t binsize = in.get<int32_t>();
+    int64_t timeout = in.get<int64_t>();
+    auto fail = [fd](int32_t status, const string &message) {
+        return sendError(fd, status, message);
+    };
+    if (!in.ok || version != serveProtocolVersion) {
+        return fail(0, "straw serve: unsupported request, the client and daemon are different versions of straw");
+    }
+    if (!(unit == "BP" || unit == "FRAG")) {
+        return fail(0, "Norm specified incorrectly, must be one of <BP/FRAG>\nUsage: straw [observed/oe/expected] "
+                       "<NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>");
+    }
+    string error;
+    int32_t status = 0;
+    shared_ptr<HiCFile> hiCFile = cache.getFile(fileName, error, status);
+    if (!hiCFile) {
+        return fail(status, error);
+    }
+    for (const string &loc : {chr1loc, chr2loc}) {
+        if (!checkLocus(hiCFile->chromosomeMap, loc, error)) {
+            return fail(7, error);
+        }
+    }
+    string chr1, chr2;
+    int64_t region[4];
+    strawQueryRegion(*hiCFile, chr1loc, chr2loc, chr1, chr2, region);
+
+    string key = chr1 + '\n' + chr2 + '\n' + matrixType + '\n' + norm + '\n' + unit + '\n' + to_string(binsize);
+    shared_ptr<ServerCache::Matrix> matrix = cache.getMatrix(fileName, key);
+    {
+        lock_guard<mutex> lock(matrix->buildMutex);
+        if (!matrix->mzd) {
+            servedDiagnostic.clear();
+            matrix->mzd.reset(hiCFile->getMatrixZoomData(chr1, chr2, matrixType, norm, unit, binsize));
+            if (!matrix->mzd->foundFooter || !servedDiagnostic.empty()) {
+                // not kept: the client gets what a local query would have printed, and no records
+                matrix->mzd.reset();
+                cache.dropMatrix(fileName, key, matrix);
+                string message = servedDiagnostic.empty() ? "File doesn't have the requested matrix" : servedDiagnostic;
+                servedDiagnostic.clear();
+                return fail(0, message);
+            }
+            matrix->mzd->setBlockCacheSize(cache.blockCacheBytesPerMatrix());
+        }
+    }
+    queryControl control;
+    if (timeout > 0) {
+        control.setTimeout(timeout);
+    }
+    bool connected = true;
+    connections.startQuery(&control);
+    try {
+        matrix->mzd->getRecordsInChunks(region[0], region[1], region[2], region[3],
+                                        [fd, &connected](vector<contactRecord> &records, bool) {
+            if (!records.empty()) {
+                string payload(reinterpret_cast<const char *>(records.data()), records.size() * sizeof(contactRecord));
+                connected = sendFrame(fd, 'R', payload);
             }
+            return connected;
+        }, &control);
+    } catch (...) {
+        connections.endQuery(&control);
+        throw;
+    }
+    connections.endQuery(&control);
+    if (!connected) {
+        return false;
+    }
+    FrameWriter out;
+    out.put(static_cast<uint8_t>(control.interrupted() ? 1 : 0));
+    out.put(static_cast<int64_t>(control.blocksDecoded));
+    out.put(static_cast<int64_t>(control.blocksSkipped));
+    out.put(static_cast<int64_t>(control.bytesRead));
+    return sendFrame(fd, 'D', out.payload);
+}
+
+// serves one client until it hangs up. a query that fails, whatever the reason, is answered with an 'E' frame and
+// the connection carries on
+static void serveConnection(int fd, ServerCache &cache, ServerConnections &connections) {
+    servingQuery = true;
+    char type;
+    string request;
+    while (peerIsThisUser(fd) && receiveFrame(fd, type, request) && type == 'Q') {
+        bool connected;
+        try {
+            connected = serveQuery(fd, request, cache, connections);
+        } catch (const serveError &e) {
+            connected = sendError(fd, e.status, e.what());
+        } catch (const exception &e) {
+            connected = sendError(fd, 1, string("straw serve: ") + e.what());
+        }
+        if (!connected) {
+            break;
         }
     }
-    return blocksSet;
+    close(fd);
+    connections.remove(fd);
 }
 
-set<int32_t> getBlockNumbersForRegionFromBinPositionV9Intra(int64_t *regionIndices, int32_t blockBinCount, int32_t blockColumnCount) {
-    // regionIndices is binX1 binX2 binY1 binY2
-    set<int32_t> blocksSet;
-    int32_t translatedLowerPAD, translatedHigherPAD, translatedNearerDepth, translatedFurtherDepth;
-    translatedLowerPAD = static_cast<int32_t>((regionIndices[0] + regionIndices[2]) / 2 / blockBinCount);
-    translatedHigherPAD = static_cast<int32_t>((regionIndices[1] + regionIndices[3]) / 2 / blockBinCount + 1);
-    translatedNearerDepth = static_cast<int32_t>(log2(
-            1 + abs(regionIndices[0] - regionIndices[3]) / sqrt(2) / blockBinCount));
-    translatedFurtherDepth = static_cast<int32_t>(log2(
-            1 + abs(regionIndices[1] - regionIndices[2]) / sqrt(2) / blockBinCount));
+// atomic rather than sig_atomic_t: the signal may land on any of the daemon's threads
+static atomic<bool> stopServing(false);
 
-    // because code above assume above diagonal; but we could be below diagonal
-    int32_t nearerDepth = min(translatedNearerDepth, translatedFurtherDepth);
-    if ((regionIndices[0] > regionIndices[3] && regionIndices[1] < regionIndices[2]) ||
-        (regionIndices[1] > regionIndices[2] && regionIndices[0] < regionIndices[3])) {
-        nearerDepth = 0;
-    }
-    int32_t furtherDepth = max(translatedNearerDepth, translatedFurtherDepth) + 1; // +1; integer divide rounds down
+static void onStopSignal(int) {
+    stopServing = true;
+}
 
-    for (int depth = nearerDepth; depth <= furtherDepth; depth++) {
-        for (int pad = translatedLowerPAD; pad <= translatedHigherPAD; pad++) {
-            int32_t blockNumber = depth * blockColumnCount + pad;
-            blocksSet.insert(blockNumber);
+int strawServe(const string &socketPath, const serveOptions &options) {
+    sockaddr_un address;
+    if (!socketAddress(socketPath, address)) {
+        cerr << "Socket path " << socketPath << " is empty or too long" << endl;
+        return 1;
+    }
+    int running = connectToSocket(socketPath);
+    if (running >= 0) {
+        close(running);
+        cerr << "A daemon is already listening on " << socketPath << endl;
+        return 1;
+    }
+    string directory = socketPath.substr(0, socketPath.rfind('/'));
+    if (directory == privateSocketDirectory() && !privateDirectory(directory)) {
+        cerr << "Cannot use " << directory << ": it must be a directory of this user's that nobody else can enter"
+             << endl;
+        return 1;
+    }
+    unlink(socketPath.c_str()); // left behind by a daemon that didn't shut down cleanly
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    mode_t mask = umask(077); // only this user may connect
+    bool bound = listener >= 0 && ::bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0;
+    umask(mask);
+    if (!bound || listen(listener, 64) != 0) {
+        cerr << "Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (listener >= 0) {
+            close(listener);
         }
+        return 1;
     }
-
-    return blocksSet;
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, onStopSignal);
+    signal(SIGTERM, onStopSignal);
+    cerr << "straw serve: listening on " << socketPath << endl;
+
+    ServerCache cache(options);
+    ServerConnections connections(options.maxConnections);
+    while (!stopServing) {
+        pollfd waiting{listener, POLLIN, 0};
+        if (poll(&waiting, 1, 250) <= 0) {
+            continue;
+        }
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        if (!connections.add(fd)) {
+            close(fd); // the client sees the daemon hang up and runs its query itself
+            continue;
+        }
+        thread(serveConnection, fd, ref(cache), ref(connections)).detach();
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    connections.stop();
+    return 0;
 }
 
-void appendRecord(vector<contactRecord> &vector, int32_t index, int32_t binX, int32_t binY, float counts) {
-    contactRecord record = contactRecord();
-    record.binX = binX;
-    record.binY = binY;
-    record.counts = counts;
-    vector[index] = record;
+static mutex serverSocketMutex;
+
+// queries only go to a daemon the user pointed them at
+static string &serverSocket() {
+    static string path = getenv("STRAW_SOCKET") != nullptr ? getenv("STRAW_SOCKET") : "";
+    return path;
 }
 
-// this is the meat of reading the data.  takes in the block number and returns the set of contact records corresponding to
-// that block.  the block data is compressed and must be decompressed using the zlib library functions
-vector<contactRecord> readBlock(const string& fileName, indexEntry idx, int32_t version) {
-    if (idx.size <= 0) {
-        vector<contactRecord> v;
-        return v;
+string defaultServerSocket() {
+    const char *path = getenv("STRAW_SOCKET");
+    if (path != nullptr) {
+        return path;
     }
-    char *compressedBytes = readCompressedBytesFromFile(fileName, idx);
-    char *uncompressedBytes = new char[idx.size * 10]; //biggest seen so far is 3
-    // Decompress the block
-    // zlib struct
-    z_stream infstream;
-    infstream.zalloc = Z_NULL;
-    infstream.zfree = Z_NULL;
-    infstream.opaque = Z_NULL;
-    infstream.avail_in = static_cast<uInt>(idx.size); // size of input
-    infstream.next_in = (Bytef *) compressedBytes; // input char array
-    infstream.avail_out = static_cast<uInt>(idx.size * 10); // size of output
-    infstream.next_out = (Bytef *) uncompressedBytes; // output char array
-    // the actual decompression work.
-    inflateInit(&infstream);
-    inflate(&infstream, Z_NO_FLUSH);
-    inflateEnd(&infstream);
-    int32_t uncompressedSize;
-    uncompressedSize = static_cast<int32_t>(infstream.total_out);
-
-    // create stream from buffer for ease of use
-    memstream bufferin(uncompressedBytes, uncompressedSize);
-    uint64_t nRecords;
-    nRecords = static_cast<uint64_t>(readInt32FromFile(bufferin));
-    vector<contactRecord> v(nRecords);
-    // different versions have different specific formats
-    if (version < 7) {
-        for (uInt i = 0; i < nRecords; i++) {
-            int32_t binX = readInt32FromFile(bufferin);
-            int32_t binY = readInt32FromFile(bufferin);
-            float counts = readFloatFromFile(bufferin);
-            appendRecord(v, i, binX, binY, counts);
-        }
-    } else {
-        int32_t binXOffset = readInt32FromFile(bufferin);
-        int32_t binYOffset = readInt32FromFile(bufferin);
-        bool useShort = readCharFromFile(bufferin) == 0; // yes this is opposite of usual
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime != nullptr && runtime[0] == '/') {
+        return string(runtime) + "/straw.sock";
+    }
+    return privateSocketDirectory() + "/straw.sock";
+}
 
-        bool useShortBinX = true;
-        bool useShortBinY = true;
-        if (version > 8) {
-            useShortBinX = readCharFromFile(bufferin) == 0;
-            useShortBinY = readCharFromFile(bufferin) == 0;
-        }
-
-        char type = readCharFromFile(bufferin);
-        int32_t index = 0;
-        if (type == 1) {
-            if (useShortBinX && useShortBinY) {
-                int16_t rowCount = readInt16FromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int32_t binY = binYOffset + readInt16FromFile(bufferin);
-                    int16_t colCount = readInt16FromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int32_t binX = binXOffset + readInt16FromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readInt16FromFile(bufferin);
-                        } else {
-                            counts = readFloatFromFile(bufferin);
-                        }
-                        appendRecord(v, index++, binX, binY, counts);
-                    }
+void setServerSocket(const string &path) {
+    lock_guard<mutex> lock(serverSocketMutex);
+    serverSocket() = path;
+}
+
+// runs a straw() query on the daemon, if one is listening; false means the query has to run in this process. the
+// daemon's counters are added to control, and cancelling it hangs up on the daemon between two batches of records. a
+// query the daemon failed throws the serveError it answered with
+static bool strawFromServer(const string &matrixType, const string &norm, const string &fileName,
+                            const string &chr1loc, const string &chr2loc, const string &unit, int32_t binsize,
+                            queryControl *control, vector<contactRecord> &records) {
+    string path;
+    {
+        lock_guard<mutex> lock(serverSocketMutex);
+        path = serverSocket();
+    }
+    int fd = path.empty() ? -1 : connectToSocket(path);
+    if (fd < 0) {
+        return false;
+    }
+    if (!peerIsThisUser(fd)) {
+        cerr << "Not sending the query to " << path << ", whose daemon runs as another user" << endl;
+        close(fd);
+        return false;
+    }
+    string file = fileName;
+    char cwd[4096];
+    if (std::strncmp(file.c_str(), "http", 4) != 0 && !file.empty() && file[0] != '/' &&
+        getcwd(cwd, sizeof(cwd)) != nullptr) {
+        file = string(cwd) + "/" + file; // the daemon runs in a directory of its own
+    }
+    FrameWriter out;
+    out.put(serveProtocolVersion);
+    for (const string &field : {matrixType, norm, file, chr1loc, chr2loc, unit}) {
+        out.putString(field);
+    }
+    out.put(binsize);
+    int64_t timeout = 0;
+    if (control && control->deadline.load() != chrono::steady_clock::time_point::max()) {
+        auto left = chrono::duration_cast<chrono::milliseconds>(control->deadline.load() - chrono::steady_clock::now());
+        timeout = max<int64_t>(1, left.count());
+    }
+    out.put(timeout);
+
+    bool answered = false;
+    char type;
+    string payload;
+    if (sendFrame(fd, 'Q', out.payload)) {
+        while (!answered && receiveFrame(fd, type, payload)) {
+            if (type == 'R') {
+                size_t count = payload.size() / sizeof(contactRecord);
+                size_t first = records.size();
+                records.resize(first + count);
+                memcpy(&records[first], payload.data(), count * sizeof(contactRecord));
+                if (control && control->cancelled) {
+                    control->blocksSkipped++; // the daemon's own count goes with the connection
+                    answered = true;
                 }
-            } else if (useShortBinX && !useShortBinY) {
-                int32_t rowCount = readInt32FromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int32_t binY = binYOffset + readInt32FromFile(bufferin);
-                    int16_t colCount = readInt16FromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int32_t binX = binXOffset + readInt16FromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readInt16FromFile(bufferin);
-                        } else {
-                            counts = readFloatFromFile(bufferin);
-                        }
-                        appendRecord(v, index++, binX, binY, counts);
-                    }
+            } else if (type == 'E') {
+                FrameReader in(payload);
+                int32_t status = in.get<int32_t>();
+                string message = in.getString();
+                close(fd);
+                if (status != 0) {
+                    throw serveError(status, message);
                 }
-            } else if (!useShortBinX && useShortBinY) {
-                int16_t rowCount = readInt16FromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int32_t binY = binYOffset + readInt16FromFile(bufferin);
-                    int32_t colCount = readInt32FromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int32_t binX = binXOffset + readInt32FromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readInt16FromFile(bufferin);
-                        } else {
-                            counts = readFloatFromFile(bufferin);
-                        }
-                        appendRecord(v, index++, binX, binY, counts);
-                    }
+                cerr << message << endl; // the query would only have printed this in this process
+                records.clear();
+                return true;
+            } else if (type == 'D') {
+                FrameReader in(payload);
+                in.get<uint8_t>();
+                int64_t decoded = in.get<int64_t>(), skipped = in.get<int64_t>(), bytes = in.get<int64_t>();
+                if (control) {
+                    control->blocksDecoded += decoded;
+                    control->blocksSkipped += skipped;
+                    control->bytesRead += bytes;
                 }
+                answered = true;
             } else {
-                int32_t rowCount = readInt32FromFile(bufferin);
-                for (int i = 0; i < rowCount; i++) {
-                    int32_t binY = binYOffset + readInt32FromFile(bufferin);
-                    int32_t colCount = readInt32FromFile(bufferin);
-                    for (int j = 0; j < colCount; j++) {
-                        int32_t binX = binXOffset + readInt32FromFile(bufferin);
-                        float counts;
-                        if (useShort) {
-                            counts = readInt16FromFile(bufferin);
-                        } else {
-                            counts = readFloatFromFile(bufferin);
-                        }
-                        appendRecord(v, index++, binX, binY, counts);
-                    }
-                }
-            }
-        } else if (type == 2) {
-            int32_t nPts = readInt32FromFile(bufferin);
-            int16_t w = readInt16FromFile(bufferin);
-
-            for (int i = 0; i < nPts; i++) {
-                //int32_t idx = (p.y - binOffset2) * w + (p.x - binOffset1);
-                int32_t row = i / w;
-                int32_t col = i - row * w;
-                int32_t bin1 = binXOffset + col;
-                int32_t bin2 = binYOffset + row;
-
-                float counts;
-                if (useShort) {
-                    int16_t c = readInt16FromFile(bufferin);
-                    if (c != -32768) {
-                        appendRecord(v, index++, bin1, bin2, c);
-                    }
-                } else {
-                    counts = readFloatFromFile(bufferin);
-                    if (!isnan(counts)) {
-                        appendRecord(v, index++, bin1, bin2, counts);
-                    }
-                }
+                break;
             }
         }
     }
-    delete[] compressedBytes;
-    delete[] uncompressedBytes; // don't forget to delete your heap arrays in C++!
-    return v;
+    close(fd);
+    if (!answered) {
+        records.clear(); // the daemon went away mid-answer; start over here
+    }
+    return answered;
+}
+#else
+int strawServe(const string &, const serveOptions &) {
+    cerr << "straw serve needs Unix domain sockets, which this build does not have" << endl;
+    return 1;
 }
 
-// reads the normalization vector from the file at the specified location
-vector<double> readNormalizationVector(istream &bufferin, int32_t version) {
-    int64_t nValues;
-    if (version > 8) {
-        nValues = readInt64FromFile(bufferin);
-    } else {
-        nValues = (int64_t) readInt32FromFile(bufferin);
+string defaultServerSocket() {
+    return string();
+}
+
+void setServerSocket(const string &) {
+}
+
+static bool strawFromServer(const string &, const string &, const string &, const string &, const string &,
+                            const string &, int32_t, queryControl *, vector<contactRecord> &) {
+    return false;
+}
+#endif
+
+vector<contactRecord>
+straw(const string& matrixType, const string& norm, const string& fileName, const string& chr1loc,
+      const string& chr2loc, const string &unit, int32_t binsize, queryControl *control) {
+    vector<contactRecord> fromServer;
+    if (strawFromServer(matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize, control, fromServer)) {
+        return fromServer;
+    }
+    int64_t origRegionIndices[4];
+    unique_ptr<MatrixZoomData> mzd = openStrawQuery(matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize,
+                                                    origRegionIndices);
+    if (mzd == nullptr) {
+        vector<contactRecord> v;
+        return v;
     }
+    return mzd->getRecords(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2], origRegionIndices[3],
+                           control);
+}
 
-    uint64_t numValues;
-    numValues = static_cast<uint64_t>(nValues);
-    vector<double> values(numValues);
+vector<contactRecord>
+strawExpected(const string& norm, const string& fileName, const string& chr1loc, const string& chr2loc,
+              const string &unit, int32_t binsize, const string &mode, queryControl *control) {
+    if (!(mode == "sparse" || mode == "dense")) {
+        cerr << "Mode specified incorrectly, must be one of <sparse/dense>" << endl;
+        return vector<contactRecord>();
+    }
+    int64_t origRegionIndices[4];
+    unique_ptr<MatrixZoomData> mzd = openStrawQuery("expected", norm, fileName, chr1loc, chr2loc, unit, binsize,
+                                                    origRegionIndices);
+    if (mzd == nullptr) {
+        return vector<contactRecord>();
+    }
+    if (mode == "dense") {
+        return mzd->getExpectedRecords(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2],
+                                       origRegionIndices[3]);
+    }
+    return mzd->getRecords(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2], origRegionIndices[3],
+                           control);
+}
 
-    if (version > 8) {
-        for (int i = 0; i < nValues; i++) {
-            values[i] = (double) readFloatFromFile(bufferin);
+queryCost
+strawExplain(const string& matrixType, const string& norm, const string& fileName, const string& chr1loc,
+             const string& chr2loc, const string &unit, int32_t binsize) {
+    int64_t origRegionIndices[4];
+    unique_ptr<MatrixZoomData> mzd = openStrawQuery(matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize,
+                                                    origRegionIndices);
+    if (mzd == nullptr) {
+        return queryCost();
+    }
+    return mzd->explain(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2], origRegionIndices[3]);
+}
+
+vector<vector<contactRecord>>
+strawRegions(const string& matrixType, const string& norm, const string& fileName, const string& chr1,
+             const string& chr2, const string &unit, int32_t binsize, const vector<queryRegion> &regions,
+             queryControl *control) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return vector<vector<contactRecord>>(regions.size());
+    }
+    HiCFile hiCFile(fileName);
+    unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(chr1, chr2, matrixType, norm, unit, binsize));
+    if (hiCFile.getChromosome(chr1).index <= hiCFile.getChromosome(chr2).index) {
+        return mzd->getRecordsForRegions(regions, control);
+    }
+    // the matrix is stored with the chromosomes the other way round
+    vector<queryRegion> flipped;
+    for (const queryRegion &region : regions) {
+        flipped.push_back({region.y0, region.y1, region.x0, region.x1});
+    }
+    return mzd->getRecordsForRegions(flipped, control);
+}
+
+contactColumns
+strawColumns(const string& matrixType, const string& norm, const string& fileName, const string& chr1loc,
+             const string& chr2loc, const string &unit, int32_t binsize, queryControl *control) {
+    int64_t origRegionIndices[4];
+    unique_ptr<MatrixZoomData> mzd = openStrawQuery(matrixType, norm, fileName, chr1loc, chr2loc, unit, binsize,
+                                                    origRegionIndices);
+    if (mzd == nullptr) {
+        return contactColumns();
+    }
+    return mzd->getRecordsAsColumns(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2],
+                                    origRegionIndices[3], control);
+}
+
+vector<contactRecord>
+strawBand(const string &matrixType, const string &norm, const string &fileName, const string &chr,
+          int64_t minDistance, int64_t maxDistance, const string &unit, int32_t binsize, queryControl *control) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return vector<contactRecord>();
+    }
+    HiCFile hiCFile(fileName);
+    if (hiCFile.chromosomeMap.count(chr) == 0) {
+        cerr << chr << " not found in the file." << endl;
+        return vector<contactRecord>();
+    }
+    unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(chr, chr, matrixType, norm, unit, binsize));
+    return mzd->getRecordsInBand(minDistance, maxDistance, control);
+}
+
+vector<bedpeInterval> readBedpe(istream &in) {
+    vector<bedpeInterval> intervals;
+    string line;
+    while (getline(in, line)) {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0) {
+            continue;
         }
-    } else {
-        for (int i = 0; i < nValues; i++) {
-            values[i] = readDoubleFromFile(bufferin);
+        stringstream ss(line);
+        bedpeInterval interval;
+        if (!(ss >> interval.chr1 >> interval.start1 >> interval.end1 >> interval.chr2 >> interval.start2
+                 >> interval.end2)) {
+            // typically a column header
+            cerr << "Skipping BEDPE line: " << line << endl;
+            continue;
         }
+        intervals.push_back(interval);
     }
+    return intervals;
+}
 
-    return values;
+// runs work(i) for i in [0, n) on up to threads threads
+static void parallelFor(size_t n, size_t threads, const function<void(size_t)> &work) {
+    atomic<size_t> next(0);
+    auto worker = [&]() {
+        for (size_t i = next++; i < n; i = next++) {
+            work(i);
+        }
+    };
+    vector<thread> pool;
+    for (size_t t = 1; t < min(threads, n); t++) {
+        pool.emplace_back(worker);
+    }
+    worker();
+    for (thread &t : pool) {
+        t.join();
+    }
 }
 
-class MatrixZoomData {
+// one deque of task ids per worker. a worker takes from the front of its own deque and, once that is empty, steals
+// from the back of the others'
+class WorkStealingQueues {
 public:
-    bool isIntra;
-    string fileName;
-    int64_t myFilePos = 0LL;
-    vector<double> expectedValues;
-    bool foundFooter = false;
-    vector<double> c1Norm;
-    vector<double> c2Norm;
-    int32_t c1 = 0;
-    int32_t c2 = 0;
-    string matrixType;
-    string norm;
-    int32_t version = 0;
-    int32_t resolution = 0;
-    int32_t numBins1 = 0;
-    int32_t numBins2 = 0;
-    float sumCounts;
-    int32_t blockBinCount, blockColumnCount;
-    map<int32_t, indexEntry> blockMap;
-    double avgCount;
+    explicit WorkStealingQueues(size_t workers) : queues(workers), locks(workers) {}
 
-    MatrixZoomData(const chromosome &chrom1, const chromosome &chrom2, const string &matrixType,
-                   const string &norm, const string &unit, int32_t resolution,
-                   int32_t &version, int64_t &master, int64_t &totalFileSize,
-                   const string &fileName) {
-        this->version = version;
-        this->fileName = fileName;
-        int32_t c01 = chrom1.index;
-        int32_t c02 = chrom2.index;
-        if (c01 <= c02) { // default is ok
-            this->c1 = c01;
-            this->c2 = c02;
-            this->numBins1 = static_cast<int32_t>(chrom1.length / resolution);
-            this->numBins2 = static_cast<int32_t>(chrom2.length / resolution);
-        } else { // flip
-            this->c1 = c02;
-            this->c2 = c01;
-            this->numBins1 = static_cast<int32_t>(chrom2.length / resolution);
-            this->numBins2 = static_cast<int32_t>(chrom1.length / resolution);
+    void push(size_t worker, size_t task) {
+        lock_guard<mutex> lock(locks[worker]);
+        queues[worker].push_back(task);
+    }
+
+    bool pop(size_t worker, size_t &task) {
+        {
+            lock_guard<mutex> lock(locks[worker]);
+            if (!queues[worker].empty()) {
+                task = queues[worker].front();
+                queues[worker].pop_front();
+                return true;
+            }
         }
-        isIntra = c1 == c2;
+        for (size_t i = 1; i < queues.size(); i++) {
+            size_t victim = (worker + i) % queues.size();
+            lock_guard<mutex> lock(locks[victim]);
+            if (!queues[victim].empty()) {
+                task = queues[victim].back();
+                queues[victim].pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
 
-        this->matrixType = matrixType;
-        this->norm = norm;
-        this->resolution = resolution;
+private:
+    vector<deque<size_t>> queues;
+    vector<mutex> locks;
+};
 
-        HiCFileStream *stream = new HiCFileStream(fileName);
-        indexEntry c1NormEntry{}, c2NormEntry{};
+// the intervals of one chromosome pair, in the orientation the pair is stored in the file
+class BedpeGroup {
+public:
+    string chr1;
+    string chr2;
+    vector<size_t> intervals;
+    unique_ptr<MatrixZoomData> mzd;
+};
 
-        if (stream->isHttp) {
-            int64_t bytes_to_read = totalFileSize - master;
-            char *buffer = getData(stream->curl, master, bytes_to_read);
-            memstream bufin2(buffer, bytes_to_read);
-            foundFooter = readFooter(bufin2, master, version, c1, c2, matrixType, norm, unit,
-                                     resolution,
-                                     myFilePos,
-                                     c1NormEntry, c2NormEntry, expectedValues);
-            delete buffer;
-        } else {
-            stream->fin.seekg(master, ios::beg);
-            foundFooter = readFooter(stream->fin, master, version, c1, c2, matrixType, norm,
-                                     unit,
-                                     resolution, myFilePos,
-                                     c1NormEntry, c2NormEntry, expectedValues);
+// a run of neighbouring intervals of one group, extracted together so that they share block reads
+class BedpeTask {
+public:
+    size_t group;
+    vector<size_t> intervals;
+    int64_t estimatedBytes;
+};
+
+static size_t bulkWorkers(int32_t threads) {
+    return threads > 0 ? static_cast<size_t>(threads) : max(1u, thread::hardware_concurrency());
+}
+
+// the engine behind strawBedpe and strawApa. groups the intervals by chromosome pair, opens each pair once, and cuts
+// each pair's intervals (sorted by position) into batches of up to intervalsPerTask, which run on a pool of workers
+// threads. process(worker, mzd, indices, regions, flipped) is called for every batch with the indices of its
+// intervals and their regions: BEDPE ends are exclusive while query regions are inclusive, and regions are flipped
+// to the orientation the pair is stored in, which flipped[k] records. intervals on chromosomes the file doesn't have
+// are passed to skipped(index). every pair's matrix reads its blocks as batch, and process hands control on to the
+// queries it runs; once control is cancelled or past its deadline, workers take no more batches
+static void forEachIntervalBatch(const string &matrixType, const string &norm, const string &fileName,
+                                 const string &unit, int32_t binsize, const vector<bedpeInterval> &intervals,
+                                 size_t workers, size_t intervalsPerTask,
+                                 const function<void(size_t, MatrixZoomData &, const vector<size_t> &,
+                                                     const vector<queryRegion> &, const vector<bool> &)> &process,
+                                 const function<void(size_t)> &skipped, queryControl *control) {
+    HiCFile hiCFile(fileName);
+    vector<queryRegion> regions(intervals.size());
+    vector<bool> flipped(intervals.size(), false);
+    vector<BedpeGroup> groups;
+    map<pair<string, string>, size_t> groupIndex;
+    for (size_t i = 0; i < intervals.size(); i++) {
+        const bedpeInterval &interval = intervals[i];
+        if (hiCFile.chromosomeMap.count(interval.chr1) == 0 || hiCFile.chromosomeMap.count(interval.chr2) == 0) {
+            cerr << "Skipping interval " << i << ": " << interval.chr1 << " or " << interval.chr2
+                 << " not found in the file." << endl;
+            skipped(i);
+            continue;
+        }
+        pair<string, string> chromosomes(interval.chr1, interval.chr2);
+        regions[i] = {interval.start1, interval.end1 - 1, interval.start2, interval.end2 - 1};
+        if (hiCFile.getChromosome(interval.chr1).index > hiCFile.getChromosome(interval.chr2).index) {
+            swap(chromosomes.first, chromosomes.second);
+            regions[i] = {interval.start2, interval.end2 - 1, interval.start1, interval.end1 - 1};
+            flipped[i] = true;
+        }
+        auto found = groupIndex.find(chromosomes);
+        if (found == groupIndex.end()) {
+            found = groupIndex.insert(make_pair(chromosomes, groups.size())).first;
+            groups.emplace_back();
+            groups.back().chr1 = chromosomes.first;
+            groups.back().chr2 = chromosomes.second;
         }
+        groups[found->second].intervals.push_back(i);
+    }
 
-        if (!foundFooter) {
-            return;
+    // one MatrixZoomData per pair, opened in parallel since each one reads its own footer and norm vectors
+    parallelFor(groups.size(), workers, [&](size_t g) {
+        groups[g].mzd.reset(hiCFile.getMatrixZoomData(groups[g].chr1, groups[g].chr2, matrixType, norm, unit,
+                                                      binsize));
+        groups[g].mzd->priority = ioPriority::BATCH;
+    });
+
+    vector<BedpeTask> tasks;
+    for (size_t g = 0; g < groups.size(); g++) {
+        vector<size_t> &members = groups[g].intervals;
+        stable_sort(members.begin(), members.end(), [&regions](size_t a, size_t b) {
+            return regions[a].x0 < regions[b].x0 || (regions[a].x0 == regions[b].x0 && regions[a].y0 < regions[b].y0);
+        });
+        for (size_t begin = 0; begin < members.size(); begin += intervalsPerTask) {
+            BedpeTask task;
+            task.group = g;
+            task.intervals.assign(members.begin() + begin,
+                                  members.begin() + min(begin + intervalsPerTask, members.size()));
+            vector<queryRegion> taskRegions;
+            for (size_t i : task.intervals) {
+                taskRegions.push_back(regions[i]);
+            }
+            task.estimatedBytes = groups[g].mzd->getEstimatedBlockBytes(taskRegions);
+            tasks.push_back(std::move(task));
         }
-        stream->close();
+    }
 
-        if (norm != "NONE") {
-            c1Norm = readNormalizationVectorFromFooter(c1NormEntry, version, fileName);
-            if (isIntra) {
-                c2Norm = c1Norm;
+    // biggest tasks first, each to the worker with the least estimated bytes so far; stealing evens out the estimates
+    vector<size_t> order(tasks.size());
+    for (size_t t = 0; t < tasks.size(); t++) {
+        order[t] = t;
+    }
+    stable_sort(order.begin(), order.end(), [&tasks](size_t a, size_t b) {
+        return tasks[a].estimatedBytes > tasks[b].estimatedBytes;
+    });
+    WorkStealingQueues queues(workers);
+    vector<int64_t> assignedBytes(workers, 0);
+    for (size_t t : order) {
+        size_t worker = static_cast<size_t>(min_element(assignedBytes.begin(), assignedBytes.end()) -
+                                            assignedBytes.begin());
+        assignedBytes[worker] += tasks[t].estimatedBytes;
+        queues.push(worker, t);
+    }
+
+    auto runWorker = [&](size_t worker) {
+        size_t t;
+        while (!(control && control->expired()) && queues.pop(worker, t)) {
+            vector<queryRegion> taskRegions;
+            vector<bool> taskFlipped;
+            for (size_t i : tasks[t].intervals) {
+                taskRegions.push_back(regions[i]);
+                taskFlipped.push_back(flipped[i]);
+            }
+            process(worker, *groups[tasks[t].group].mzd, tasks[t].intervals, taskRegions, taskFlipped);
+        }
+    };
+    vector<thread> pool;
+    for (size_t w = 1; w < min(workers, tasks.size()); w++) {
+        pool.emplace_back(runWorker, w);
+    }
+    runWorker(0);
+    for (thread &t : pool) {
+        t.join();
+    }
+}
+
+void strawBedpe(const string &matrixType, const string &norm, const string &fileName, const string &unit,
+                int32_t binsize, const vector<bedpeInterval> &intervals, const string &output, int32_t threads,
+                const function<void(const bedpeResult &)> &onResult, queryControl *control) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return;
+    }
+    if (!(output == "records" || output == "sum" || output == "dense")) {
+        cerr << "Output specified incorrectly, must be one of <records/sum/dense>" << endl;
+        return;
+    }
+    mutex outputMutex;
+    auto deliver = [&](bedpeResult &result) {
+        lock_guard<mutex> lock(outputMutex);
+        onResult(result);
+    };
+    auto skipped = [&](size_t index) {
+        bedpeResult result;
+        result.index = index;
+        deliver(result);
+    };
+    // regions come in the orientation the pair is stored in; records and matrices of flipped intervals are turned
+    // back so that x and rows always follow the first half of the BEDPE line
+    auto process = [&](size_t, MatrixZoomData &mzd, const vector<size_t> &indices,
+                       const vector<queryRegion> &taskRegions, const vector<bool> &flipped) {
+        int64_t resolution = mzd.resolution;
+        vector<bedpeResult> results(indices.size());
+        vector<int64_t> originR(indices.size()), originC(indices.size());
+        for (size_t k = 0; k < indices.size(); k++) {
+            queryRegion region = taskRegions[k];
+            if (flipped[k]) {
+                region = {region.y0, region.y1, region.x0, region.x1};
+            }
+            results[k].index = indices[k];
+            if (output == "dense") {
+                mzd.getMatrixShape(region.x0, region.x1, region.y0, region.y1, results[k].numRows,
+                                   results[k].numCols);
+                results[k].matrix.assign(static_cast<size_t>(results[k].numRows * results[k].numCols), 0);
+                originR[k] = region.x0 / resolution;
+                originC[k] = region.y0 / resolution;
+            }
+        }
+        mzd.forEachRegionBinRecord(taskRegions, [&](size_t k, int32_t binX, int32_t binY, float counts) {
+            bedpeResult &result = results[k];
+            if (flipped[k]) {
+                swap(binX, binY);
+            }
+            if (output == "records") {
+                contactRecord record = contactRecord();
+                record.binX = static_cast<int32_t>(binX * resolution);
+                record.binY = static_cast<int32_t>(binY * resolution);
+                record.counts = counts;
+                result.records.push_back(record);
+            } else if (output == "sum") {
+                if (!isnan(counts) && !isinf(counts)) {
+                    result.sum += counts;
+                }
             } else {
-                c2Norm = readNormalizationVectorFromFooter(c2NormEntry, version, fileName);
+                mzd.placeInMatrix(result.matrix.data(), result.numRows, result.numCols, originR[k], originC[k], binX,
+                                  binY, counts);
             }
+        }, control);
+        for (bedpeResult &result : results) {
+            deliver(result);
         }
+    };
+    // intervals are extracted 1024 at a time, in position order within their chromosome pair
+    forEachIntervalBatch(matrixType, norm, fileName, unit, binsize, intervals, bulkWorkers(threads), 1024, process,
+                         skipped, control);
+}
+
+apaResult strawApa(const string &matrixType, const string &norm, const string &fileName, const string &unit,
+                   int32_t binsize, const vector<apaLocus> &loci, int32_t window, const string &normalization,
+                   int32_t threads, queryControl *control) {
+    apaResult result;
+    result.width = 2 * static_cast<int64_t>(window) + 1;
+    result.matrix.assign(static_cast<size_t>(result.width * result.width), 0);
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return result;
+    }
+    if (!(normalization == "none" || normalization == "sum")) {
+        cerr << "Normalization specified incorrectly, must be one of <none/sum>" << endl;
+        return result;
+    }
+    int64_t width = result.width;
+    size_t cells = static_cast<size_t>(width * width);
+
+    // each locus becomes the window of bins around its anchors, clipped at the start of the chromosome; the tile
+    // keeps its own origin so clipped windows stay aligned
+    vector<bedpeInterval> intervals;
+    for (const apaLocus &locus : loci) {
+        int64_t bin1 = locus.pos1 / binsize;
+        int64_t bin2 = locus.pos2 / binsize;
+        intervals.push_back({locus.chr1, max(static_cast<int64_t>(0), (bin1 - window) * binsize),
+                             (bin1 + window + 1) * binsize, locus.chr2,
+                             max(static_cast<int64_t>(0), (bin2 - window) * binsize), (bin2 + window + 1) * binsize});
+    }
 
-        HiCFileStream *stream2 = new HiCFileStream((fileName));
-        if (stream2->isHttp) {
-            // readMatrix will assign blockBinCount and blockColumnCount
-            blockMap = readMatrixHttp(stream2->curl, myFilePos, unit, resolution, sumCounts,
-                                      blockBinCount,
-                                      blockColumnCount);
-        } else {
-            // readMatrix will assign blockBinCount and blockColumnCount
-            blockMap = readMatrix(stream2->fin, myFilePos, unit, resolution, sumCounts,
-                                  blockBinCount,
-                                  blockColumnCount);
+    size_t workers = bulkWorkers(threads);
+    // one accumulator per worker, added up at the end
+    vector<vector<double>> sums(workers, vector<double>(cells, 0));
+    vector<int64_t> used(workers, 0);
+    // tiles of a batch are held at once, so keep a batch around a few million cells
+    size_t lociPerTask = max(static_cast<size_t>(1), min(static_cast<size_t>(1024), (4u << 20) / cells));
+    // regions come in the orientation the pair is stored in; records of flipped loci are turned back so that every
+    // tile has its rows on chr1 of the locus and its columns on chr2. tiles a stopped control cut short are left out
+    auto process = [&](size_t worker, MatrixZoomData &mzd, const vector<size_t> &indices,
+                       const vector<queryRegion> &taskRegions, const vector<bool> &flipped) {
+        vector<int64_t> originR(indices.size()), originC(indices.size());
+        for (size_t k = 0; k < indices.size(); k++) {
+            const apaLocus &locus = loci[indices[k]];
+            originR[k] = locus.pos1 / binsize - window;
+            originC[k] = locus.pos2 / binsize - window;
         }
-        stream2->close();
+        vector<float> tiles(indices.size() * cells, 0);
+        vector<bool> complete = mzd.forEachRegionBinRecord(taskRegions, [&](size_t k, int32_t binX, int32_t binY,
+                                                                             float counts) {
+            if (flipped[k]) {
+                swap(binX, binY);
+            }
+            mzd.placeInMatrix(tiles.data() + k * cells, width, width, originR[k], originC[k], binX, binY, counts);
+        }, control);
+        vector<double> &sum = sums[worker];
+        for (size_t k = 0; k < indices.size(); k++) {
+            if (!complete[k]) {
+                continue;
+            }
+            const float *tile = tiles.data() + k * cells;
+            double scale = 1;
+            if (normalization == "sum") {
+                double total = 0;
+                for (size_t c = 0; c < cells; c++) {
+                    total += tile[c];
+                }
+                if (total <= 0) {
+                    continue;
+                }
+                scale = 1 / total;
+            }
+            for (size_t c = 0; c < cells; c++) {
+                sum[c] += tile[c] * scale;
+            }
+            used[worker]++;
+        }
+    };
+    forEachIntervalBatch(matrixType, norm, fileName, unit, binsize, intervals, workers, lociPerTask, process,
+                         [](size_t) {}, control);
 
-        if (!isIntra) {
-            avgCount = (sumCounts / numBins1) / numBins2;   // <= trying to avoid overflows
+    for (size_t w = 0; w < workers; w++) {
+        for (size_t c = 0; c < cells; c++) {
+            result.matrix[c] += sums[w][c];
         }
+        result.loci += used[w];
     }
+    return result;
+}
 
-    static vector<double> readNormalizationVectorFromFooter(indexEntry cNormEntry, int32_t &version, const string &fileName) {
-        char *buffer = readCompressedBytesFromFile(fileName, cNormEntry);
-        memstream bufferin(buffer, cNormEntry.size);
-        vector<double> cNorm = readNormalizationVector(bufferin, version);
-        delete buffer;
-        return cNorm;
+// one chromosome pair of a genome-wide dump, in the orientation it is stored in
+class GenomePair {
+public:
+    chromosome chr1;
+    chromosome chr2;
+    int64_t position;
+    int64_t estimatedBytes;
+};
+
+// the block index of the matrix at position in the file, at the given resolution, and its block layout. reads the
+// matrix metadata only, without the footer or the normalization vectors an open MatrixZoomData would need
+static map<int32_t, indexEntry> readBlockIndex(const string &fileName, int64_t position, const string &unit,
+                                               int32_t binsize, int32_t &blockBinCount, int32_t &blockColumnCount) {
+    float sumCounts, occupiedCellCount;
+    map<int32_t, indexEntry> blockMap;
+    HiCFileStream stream(fileName);
+    if (stream.isHttp) {
+        blockMap = readMatrixHttp(stream.curl, fileName, position, unit, binsize, sumCounts, occupiedCellCount,
+                                  blockBinCount, blockColumnCount);
+    } else {
+        blockMap = readMatrix(stream.fin, position, unit, binsize, sumCounts, occupiedCellCount, blockBinCount,
+                              blockColumnCount);
     }
+    stream.close();
+    return blockMap;
+}
 
-    bool isInRange(int32_t r, int32_t c, int32_t numRows, int32_t numCols) {
-        return 0 <= r && r < numRows && 0 <= c && c < numCols;
+// compressed size of all the blocks of the matrix at position in the file, at the given resolution
+static int64_t readMatrixBlockBytes(const string &fileName, int64_t position, const string &unit, int32_t binsize) {
+    int32_t blockBinCount, blockColumnCount;
+    map<int32_t, indexEntry> blockMap = readBlockIndex(fileName, position, unit, binsize, blockBinCount,
+                                                       blockColumnCount);
+    int64_t bytes = 0;
+    for (const auto &entry : blockMap) {
+        bytes += entry.second.size;
     }
+    return bytes;
+}
 
-    set<int32_t> getBlockNumbers(int64_t *regionIndices) const {
-        if (version > 8 && isIntra) {
-            return getBlockNumbersForRegionFromBinPositionV9Intra(regionIndices, blockBinCount, blockColumnCount);
+// passes the chunks of a genome-wide dump to onRecords, one call at a time. unordered, chunks go out as soon as they
+// are pushed. ordered, pairs go out whole and in sequence: the chunks of the pair at the head go straight out, those
+// of later pairs are buffered until the head passes them, and a worker that would take the buffer past maxBytes
+// waits. pairs have to be started in sequence so that the head always has a worker that never waits
+class GenomeSink {
+public:
+    GenomeSink(const vector<GenomePair> &pairs, bool ordered, int64_t maxBytes,
+               const function<void(const string &, const string &, const contactColumns &)> &onRecords)
+            : pairs(pairs), ordered(ordered), maxBytes(maxBytes), onRecords(onRecords), pending(pairs.size()),
+              done(pairs.size(), false) {}
+
+    void push(size_t pair, contactColumns &chunk) {
+        unique_lock<mutex> lock(sinkMutex);
+        if (!ordered) {
+            write(pair, chunk);
+            return;
+        }
+        int64_t bytes = chunkBytes(chunk);
+        // a chunk bigger than the whole budget still gets in once the buffer is empty
+        drained.wait(lock, [&]() {
+            return pair == head || bufferedBytes == 0 || bufferedBytes + bytes <= maxBytes;
+        });
+        if (pair == head) {
+            write(pair, chunk);
         } else {
-            return getBlockNumbersForRegionFromBinPosition(regionIndices, blockBinCount, blockColumnCount, isIntra);
+            pending[pair].push_back(contactColumns());
+            pending[pair].back().binX.swap(chunk.binX);
+            pending[pair].back().binY.swap(chunk.binY);
+            pending[pair].back().counts.swap(chunk.counts);
+            bufferedBytes += bytes;
         }
     }
 
-    vector<double> getNormVector(int32_t index){
-        if(index == c1){
-            return c1Norm;
-        } else if(index == c2){
-            return c2Norm;
+    void finish(size_t pair) {
+        lock_guard<mutex> lock(sinkMutex);
+        done[pair] = true;
+        while (head < pairs.size() && done[head]) {
+            head++;
+            if (head < pairs.size()) {
+                for (const contactColumns &chunk : pending[head]) {
+                    write(head, chunk);
+                    bufferedBytes -= chunkBytes(chunk);
+                }
+                pending[head].clear();
+            }
         }
-        cerr << "Invalid index provided: " << index << endl;
-        cerr << "Should be either " << c1 << " or " << c2 << endl;
-        vector<double> v;
-        return v;
+        drained.notify_all();
     }
 
-    vector<double> getExpectedValues(){
-        return expectedValues;
+private:
+    static int64_t chunkBytes(const contactColumns &chunk) {
+        return static_cast<int64_t>(chunk.counts.size() * (2 * sizeof(int32_t) + sizeof(float)));
     }
 
-    vector<contactRecord> getRecords(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
-        if (!foundFooter) {
-            vector<contactRecord> v;
-            return v;
-        }
-        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
-        int64_t regionIndices[4];
-        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
+    void write(size_t pair, const contactColumns &chunk) {
+        onRecords(pairs[pair].chr1.name, pairs[pair].chr2.name, chunk);
+    }
 
-        set<int32_t> blockNumbers = getBlockNumbers(regionIndices);
-        vector<contactRecord> records;
-        for (int32_t blockNumber : blockNumbers) {
-            // get contacts in this block
-            //cout << *it << " -- " << blockMap.size() << endl;
-            //cout << blockMap[*it].size << " " <<  blockMap[*it].position << endl;
-            vector<contactRecord> tmp_records = readBlock(fileName, blockMap[blockNumber], version);
-            for (contactRecord rec : tmp_records) {
-                int64_t x = rec.binX * resolution;
-                int64_t y = rec.binY * resolution;
-
-                if ((x >= origRegionIndices[0] && x <= origRegionIndices[1] &&
-                     y >= origRegionIndices[2] && y <= origRegionIndices[3]) ||
-                    // or check regions that overlap with lower left
-                    (isIntra && y >= origRegionIndices[0] && y <= origRegionIndices[1] && x >= origRegionIndices[2] &&
-                     x <= origRegionIndices[3])) {
-
-                    float c = rec.counts;
-                    if (norm != "NONE") {
-                        c = static_cast<float>(c / (c1Norm[rec.binX] * c2Norm[rec.binY]));
-                    }
-                    if (matrixType == "oe") {
-                        if (isIntra) {
-                            c = static_cast<float>(c / expectedValues[min(expectedValues.size() - 1,
-                                                                          (size_t) floor(abs(y - x) /
-                                                                                         resolution))]);
-                        } else {
-                            c = static_cast<float>(c / avgCount);
-                        }
-                    } else if (matrixType == "expected") {
-                        if (isIntra) {
-                            c = static_cast<float>(expectedValues[min(expectedValues.size() - 1,
-                                                                      (size_t) floor(abs(y - x) /
-                                                                                     resolution))]);
-                        } else {
-                            c = static_cast<float>(avgCount);
-                        }
-                    }
+    const vector<GenomePair> &pairs;
+    bool ordered;
+    int64_t maxBytes;
+    const function<void(const string &, const string &, const contactColumns &)> &onRecords;
+    mutex sinkMutex;
+    condition_variable drained;
+    vector<vector<contactColumns>> pending;
+    vector<bool> done;
+    size_t head = 0;
+    int64_t bufferedBytes = 0;
+};
 
-                    contactRecord record = contactRecord();
-                    record.binX = static_cast<int32_t>(x);
-                    record.binY = static_cast<int32_t>(y);
-                    record.counts = c;
-                    records.push_back(record);
-                }
-            }
+void strawGenome(const string &matrixType, const string &norm, const string &fileName, const string &unit,
+                 int32_t binsize, int32_t threads, bool ordered, int64_t maxBufferedBytes,
+                 const function<void(const string &, const string &, const contactColumns &)> &onRecords,
+                 queryControl *control) {
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return;
+    }
+    HiCFile hiCFile(fileName);
+    vector<chromosome> byIndex(hiCFile.chromosomeMap.size());
+    for (const auto &entry : hiCFile.chromosomeMap) {
+        if (entry.second.index >= 0 && static_cast<size_t>(entry.second.index) < byIndex.size()) {
+            byIndex[entry.second.index] = entry.second;
         }
-        return records;
     }
 
-    auto getRecordsAsMatrix(int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1){
-        vector<contactRecord> records = this->getRecords(gx0, gx1, gy0, gy1);
-        if (records.empty()){
-            auto res = vector<vector<float>>(1, vector<float>(1, 0));
-            return py::array(py::cast(res));
+    // every pair in the master index, in chromosome index order, leaving out the whole genome "All" matrix
+    vector<GenomePair> pairs;
+    for (const auto &entry : hiCFile.getMasterIndex()) {
+        int32_t c1, c2;
+        char separator;
+        stringstream key(entry.first);
+        if (!(key >> c1 >> separator >> c2) || c1 <= 0 || c2 <= 0 || static_cast<size_t>(max(c1, c2)) >= byIndex.size()) {
+            continue;
         }
+        pairs.push_back({byIndex[c1], byIndex[c2], entry.second.position, 0});
+    }
+    sort(pairs.begin(), pairs.end(), [](const GenomePair &a, const GenomePair &b) {
+        return a.chr1.index != b.chr1.index ? a.chr1.index < b.chr1.index : a.chr2.index < b.chr2.index;
+    });
+
+    size_t workers = bulkWorkers(threads);
+    parallelFor(pairs.size(), workers, [&](size_t p) {
+        pairs[p].estimatedBytes = readMatrixBlockBytes(fileName, pairs[p].position, unit, binsize);
+    });
+
+    // unordered, the biggest matrices start first so that the last to finish are short ones. ordered, pairs start in
+    // output order, which GenomeSink needs to bound its buffer
+    vector<size_t> order(pairs.size());
+    for (size_t p = 0; p < order.size(); p++) {
+        order[p] = p;
+    }
+    if (!ordered) {
+        stable_sort(order.begin(), order.end(), [&pairs](size_t a, size_t b) {
+            return pairs[a].estimatedBytes > pairs[b].estimatedBytes;
+        });
+    }
 
-        int64_t origRegionIndices[] = {gx0, gx1, gy0, gy1};
-        int64_t regionIndices[4];
-        convertGenomeToBinPos(origRegionIndices, regionIndices, resolution);
-
-        int64_t originR = regionIndices[0];
-        int64_t endR = regionIndices[1];
-        int64_t originC = regionIndices[2];
-        int64_t endC = regionIndices[3];
-        int32_t numRows = endR - originR + 1;
-        int32_t numCols = endC - originC + 1;
-        float matrix[numRows][numCols];
-
-        for(contactRecord cr : records) {
-            if (isnan(cr.counts) || isinf(cr.counts)) continue;
-            int32_t r = cr.binX/resolution - originR;
-            int32_t c = cr.binY/resolution - originC;
-            if (isInRange(r, c, numRows, numCols)) {
-                matrix[r][c] = cr.counts;
-            }
-            if (isIntra) {
-                r = cr.binY/resolution - originR;
-                c = cr.binX/resolution - originC;
-                if (isInRange(r, c, numRows, numCols)) {
-                    matrix[r][c] = cr.counts;
+    // records are handed over about a million at a time
+    const size_t recordsPerChunk = 1 << 20;
+    GenomeSink sink(pairs, ordered, maxBufferedBytes, onRecords);
+    parallelFor(order.size(), workers, [&](size_t i) {
+        size_t p = order[i];
+        if (pairs[p].estimatedBytes > 0) {
+            unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(pairs[p].chr1.name, pairs[p].chr2.name,
+                                                                     matrixType, norm, unit, binsize));
+            mzd->priority = ioPriority::BATCH;
+            int64_t resolution = mzd->resolution;
+            contactColumns chunk;
+            mzd->forEachMatrixBatch([&](RecordBatch &batch) {
+                for (size_t r = 0; r < batch.size(); r++) {
+                    chunk.binX.push_back(static_cast<int32_t>(batch.binX[r] * resolution));
+                    chunk.binY.push_back(static_cast<int32_t>(batch.binY[r] * resolution));
+                    chunk.counts.push_back(batch.counts[r]);
+                }
+                if (chunk.counts.size() >= recordsPerChunk) {
+                    sink.push(p, chunk);
+                    chunk = contactColumns();
                 }
+            }, control);
+            if (!chunk.counts.empty()) {
+                sink.push(p, chunk);
             }
         }
+        sink.finish(p);
+    });
+}
 
-        vector<vector<float>> finalMatrix;
-        for(int32_t i = 0; i < numRows; i++){
-            vector<float> row;
-            for(int32_t j = 0; j < numCols; j++){
-                row.push_back(matrix[i][j]);
+vector<viewpointProfile> strawViewpoint(const string &matrixType, const string &norm, const string &fileName,
+                                        const string &chr, int64_t position, const vector<string> &targets,
+                                        const string &unit, int32_t binsize, int32_t threads,
+                                        queryControl *control) {
+    vector<viewpointProfile> profiles;
+    if (!(unit == "BP" || unit == "FRAG")) {
+        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
+        return profiles;
+    }
+    HiCFile hiCFile(fileName);
+    if (hiCFile.chromosomeMap.count(chr) == 0) {
+        cerr << chr << " not found in the file." << endl;
+        return profiles;
+    }
+    if (targets.empty()) {
+        // every chromosome but the whole genome "All", in index order
+        for (const chromosome &target : hiCFile.getChromosomes()) {
+            if (target.index > 0) {
+                profiles.push_back({target.name, vector<float>()});
             }
-            finalMatrix.push_back(row);
         }
-        return py::array(py::cast(finalMatrix));
+        sort(profiles.begin(), profiles.end(), [&hiCFile](const viewpointProfile &a, const viewpointProfile &b) {
+            return hiCFile.getChromosome(a.chr).index < hiCFile.getChromosome(b.chr).index;
+        });
+    } else {
+        for (const string &target : targets) {
+            profiles.push_back({target, vector<float>()});
+        }
     }
-};
-
-class HiCFile {
-public:
-    string prefix = "http"; // HTTP code
-    int64_t master = 0LL;
-    map<string, chromosome> chromosomeMap;
-    string genomeID;
-    int32_t numChromosomes = 0;
-    int32_t version = 0;
-    int64_t nviPosition = 0LL;
-    int64_t nviLength = 0LL;
-    vector<int32_t> resolutions;
-    static int64_t totalFileSize;
-    string fileName;
 
-    static size_t hdf(char *b, size_t size, size_t nitems, void *userdata) {
-        size_t numbytes = size * nitems;
-        b[numbytes + 1] = '\0';
-        string s(b);
-        int32_t found;
-        found = static_cast<int32_t>(s.find("content-range"));
-        if ((size_t)found == string::npos) {
-            found = static_cast<int32_t>(s.find("Content-Range"));
-        }
-        if ((size_t)found != string::npos) {
-            int32_t found2;
-            found2 = static_cast<int32_t>(s.find('/'));
-            //content-range: bytes 0-100000/891471462
-            if ((size_t)found2 != string::npos) {
-                string total = s.substr(found2 + 1);
-                totalFileSize = stol(total);
-            }
+    int32_t index = hiCFile.getChromosome(chr).index;
+    parallelFor(profiles.size(), bulkWorkers(threads), [&](size_t p) {
+        if (hiCFile.chromosomeMap.count(profiles[p].chr) == 0) {
+            cerr << profiles[p].chr << " not found in the file." << endl;
+            return;
         }
+        unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(chr, profiles[p].chr, matrixType, norm, unit,
+                                                                 binsize));
+        profiles[p].values = mzd->getViewpointProfile(index, position, control);
+    });
+    return profiles;
+}
 
-        return numbytes;
-    }
+// pixels of the region [x0, x1] x [y0, y1] at a resolution
+static int64_t regionPixels(const int64_t region[4], int32_t resolution) {
+    return (region[1] / resolution - region[0] / resolution + 1) * (region[3] / resolution - region[2] / resolution + 1);
+}
 
-    static CURL *oneTimeInitCURL(const char *url) {
-        CURL *curl = initCURL(url);
-        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, hdf);
-        return curl;
+queryPlan planQuery(const string &fileName, const string &chr1loc, const string &chr2loc, const string &unit,
+                    int64_t maxPixels, int64_t maxBytes) {
+    queryPlan plan;
+    if (unit != "BP") {
+        cerr << "Only BP resolutions can be planned" << endl;
+        return plan;
+    }
+    HiCFile hiCFile(fileName);
+    string chr1, chr2;
+    int64_t region[4];
+    parsePositions(chr1loc, chr1, region[0], region[1], hiCFile.chromosomeMap);
+    parsePositions(chr2loc, chr2, region[2], region[3], hiCFile.chromosomeMap);
+    chromosome chrom1 = hiCFile.getChromosome(chr1);
+    chromosome chrom2 = hiCFile.getChromosome(chr2);
+    if (chrom1.index > chrom2.index) {
+        // the matrix is stored with the chromosomes the other way round
+        swap(chrom1, chrom2);
+        swap(region[0], region[2]);
+        swap(region[1], region[3]);
+    }
+    bool intra = chrom1.index == chrom2.index;
+
+    stringstream key;
+    key << chrom1.index << "_" << chrom2.index;
+    map<string, indexEntry> masterIndex = hiCFile.getMasterIndex();
+    auto matrix = masterIndex.find(key.str());
+    if (matrix == masterIndex.end()) {
+        cerr << "File doesn't have the given chr_chr map " << key.str() << endl;
+        return plan;
     }
 
-    explicit HiCFile(const string &fileName) {
-        this->fileName = fileName;
-
-        // read header into buffer; 100K should be sufficient
-        if (std::strncmp(fileName.c_str(), prefix.c_str(), prefix.size()) == 0) {
-            CURL *curl;
-            curl = oneTimeInitCURL(fileName.c_str());
-            char *buffer = getData(curl, 0, 100000);
-            memstream bufin(buffer, 100000);
-            chromosomeMap = readHeader(bufin, master, genomeID, numChromosomes,
-                                       version, nviPosition, nviLength);
-            resolutions = readResolutionsFromHeader(bufin);
-            curl_easy_cleanup(curl);
-            delete buffer;
+    // coarsest first. finer resolutions have more pixels and more bytes to read, so the walk stops at the first one
+    // over budget, and only the block indexes of the resolutions up to there are read
+    vector<int32_t> resolutions = hiCFile.getResolutions();
+    sort(resolutions.rbegin(), resolutions.rend());
+    int64_t chosen = -1, fallback = -1;
+    for (size_t i = 0; i < resolutions.size(); i++) {
+        zoomEstimate estimate;
+        estimate.resolution = resolutions[i];
+        estimate.pixels = regionPixels(region, estimate.resolution);
+        bool overPixels = maxPixels > 0 && estimate.pixels > maxPixels;
+        if (overPixels && fallback >= 0) {
+            plan.considered.push_back(estimate);
+            break;
+        }
+        // the coarsest available resolution is always sized, as it is the fallback when nothing fits
+        int32_t blockBinCount, blockColumnCount;
+        map<int32_t, indexEntry> blockMap = readBlockIndex(fileName, matrix->second.position, unit,
+                                                           estimate.resolution, blockBinCount, blockColumnCount);
+        if (blockMap.empty()) {
+            // listed in the header but not stored for this pair: there is nothing to read at it, so it can't be picked
+            estimate.available = false;
+            plan.considered.push_back(estimate);
+            continue;
+        }
+        if (fallback < 0) {
+            fallback = static_cast<int64_t>(i);
+        }
+        int64_t bins[4];
+        convertGenomeToBinPos(region, bins, estimate.resolution);
+        set<int32_t> blockNumbers;
+        if (hiCFile.version > 8 && intra) {
+            blockNumbers = getBlockNumbersForRegionFromBinPositionV9Intra(bins, blockBinCount, blockColumnCount);
         } else {
-            ifstream fin;
-            fin.open(fileName, fstream::in | fstream::binary);
-            if (!fin) {
-                cerr << "File " << fileName << " cannot be opened for reading" << endl;
-                exit(6);
+            blockNumbers = getBlockNumbersForRegionFromBinPosition(bins, blockBinCount, blockColumnCount, intra);
+        }
+        estimate.blocks = estimate.bytes = 0;
+        for (int32_t blockNumber : blockNumbers) {
+            auto block = blockMap.find(blockNumber);
+            if (block != blockMap.end()) {
+                estimate.blocks++;
+                estimate.bytes += block->second.size;
             }
-            chromosomeMap = readHeader(fin, master, genomeID, numChromosomes,
-                                       version, nviPosition, nviLength);
-            resolutions = readResolutionsFromHeader(fin);
-            fin.close();
         }
+        plan.considered.push_back(estimate);
+        if (overPixels || (maxBytes > 0 && estimate.bytes > maxBytes)) {
+            break;
+        }
+        chosen = static_cast<int64_t>(i);
     }
+    if (fallback < 0) {
+        cerr << "File doesn't have the given chr_chr map " << key.str() << " at any BP resolution" << endl;
+        return plan;
+    }
+    plan.fits = chosen >= 0;
+    const zoomEstimate &estimate = plan.considered[plan.fits ? chosen : fallback];
+    plan.resolution = estimate.resolution;
+    plan.pixels = estimate.pixels;
+    plan.blocks = estimate.blocks;
+    plan.bytes = estimate.bytes;
+    return plan;
+}
 
-    string getGenomeID() const{
-        return genomeID;
+vector<contactRecord>
+strawPlanned(const string &matrixType, const string &norm, const string &fileName, const string &chr1loc,
+             const string &chr2loc, const string &unit, int64_t maxPixels, int64_t maxBytes, queryPlan &plan,
+             queryControl *control) {
+    plan = planQuery(fileName, chr1loc, chr2loc, unit, maxPixels, maxBytes);
+    if (plan.resolution == 0) {
+        return vector<contactRecord>();
     }
+    return straw(matrixType, norm, fileName, chr1loc, chr2loc, unit, plan.resolution, control);
+}
 
-    vector<int32_t> getResolutions() const{
-        return resolutions;
+bool strawProgressive(const string &matrixType, const string &norm, const string &fileName, const string &chr1loc,
+                      const string &chr2loc, const string &unit, int32_t binsize, int64_t maxFirstPixels,
+                      const function<bool(const progressiveChunk &)> &onChunk, queryControl *control) {
+    if (unit != "BP") {
+        cerr << "Only BP resolutions can be queried progressively" << endl;
+        return false;
+    }
+    HiCFile hiCFile(fileName);
+    string chr1, chr2;
+    int64_t region[4];
+    parsePositions(chr1loc, chr1, region[0], region[1], hiCFile.chromosomeMap);
+    parsePositions(chr2loc, chr2, region[2], region[3], hiCFile.chromosomeMap);
+    if (hiCFile.getChromosome(chr1).index > hiCFile.getChromosome(chr2).index) {
+        // the matrix is stored with the chromosomes the other way round
+        swap(region[0], region[2]);
+        swap(region[1], region[3]);
     }
 
-    vector<chromosome> getChromosomes(){
-        vector<chromosome> chromosomes;
-        auto iter = chromosomeMap.begin();
-        while (iter != chromosomeMap.end()) {
-            chromosomes.push_back(static_cast<chromosome>(iter->second));
-            iter++;
+    // the file's resolutions down to binsize, coarsest first, starting from the finest that fits maxFirstPixels
+    vector<int32_t> resolutions = hiCFile.getResolutions();
+    sort(resolutions.rbegin(), resolutions.rend());
+    vector<int32_t> levels;
+    for (int32_t resolution : resolutions) {
+        if (resolution <= binsize) {
+            break;
         }
-        return chromosomes;
+        if (!levels.empty() && maxFirstPixels > 0 && regionPixels(region, resolution) <= maxFirstPixels) {
+            levels.clear();
+        }
+        levels.push_back(resolution);
+    }
+    levels.push_back(binsize);
+    if (maxFirstPixels > 0 && levels.size() > 1 && regionPixels(region, binsize) <= maxFirstPixels) {
+        levels.erase(levels.begin(), levels.end() - 1);
     }
 
-    MatrixZoomData *
-    getMatrixZoomData(const string &chr1, const string &chr2, const string& matrixType, const string& norm,
-                      const string& unit, int32_t resolution) {
-        chromosome chrom1 = chromosomeMap[chr1];
-        chromosome chrom2 = chromosomeMap[chr2];
-        return new MatrixZoomData(chrom1, chrom2, (matrixType), (norm), (unit),
-                                  resolution, version, master, totalFileSize, fileName);
+    progressiveChunk chunk;
+    for (size_t level = 0; level < levels.size(); level++) {
+        if (control && control->expired()) {
+            return false;
+        }
+        unique_ptr<MatrixZoomData> mzd(hiCFile.getMatrixZoomData(chr1, chr2, matrixType, norm, unit, levels[level]));
+        chunk.resolution = levels[level];
+        chunk.level = static_cast<int32_t>(level);
+        bool completed = mzd->getRecordsInChunks(region[0], region[1], region[2], region[3],
+                                                 [&](vector<contactRecord> &records, bool last) {
+            chunk.records.swap(records);
+            chunk.levelDone = last;
+            chunk.finished = last && level + 1 == levels.size();
+            bool more = onChunk(chunk);
+            chunk.records.swap(records);
+            return more;
+        }, control);
+        if (!completed || (control && control->interrupted())) {
+            return false;
+        }
     }
-};
+    return true;
+}
 
-int64_t HiCFile::totalFileSize = 0LL;
+// Python bindings
 
-void parsePositions(const string &chrLoc, string &chrom, int64_t &pos1, int64_t &pos2, map<string, chromosome> map) {
-    string x, y;
-    stringstream ss(chrLoc);
-    getline(ss, chrom, ':');
-    if (map.count(chrom) == 0) {
-        cerr << chrom << " not found in the file." << endl;
-        exit(7);
-    }
+// hands the columns to NumPy without copying them; the three arrays share ownership of the columns
+py::tuple columnsToArrays(contactColumns &&columns) {
+    auto *owned = new contactColumns(std::move(columns));
+    py::capsule owner(owned, [](void *p) { delete static_cast<contactColumns *>(p); });
+    return py::make_tuple(py::array_t<int32_t>(owned->binX.size(), owned->binX.data(), owner),
+                          py::array_t<int32_t>(owned->binY.size(), owned->binY.data(), owner),
+                          py::array_t<float>(owned->counts.size(), owned->counts.data(), owner));
+}
 
-    if (getline(ss, x, ':') && getline(ss, y, ':')) {
-        pos1 = stol(x);
-        pos2 = stol(y);
-    } else {
-        pos1 = 0LL;
-        pos2 = map[chrom].length;
+// genomic coordinates from Python; any integer sequence is converted to a contiguous int64 array
+typedef py::array_t<int64_t, py::array::c_style | py::array::forcecast> positionArray;
+
+// regions from four equally long arrays of genomic coordinates, one rectangle per position
+vector<queryRegion> regionsFromArrays(const positionArray &x0, const positionArray &x1, const positionArray &y0,
+                                      const positionArray &y1) {
+    size_t n = static_cast<size_t>(x0.size());
+    if (static_cast<size_t>(x1.size()) != n || static_cast<size_t>(y0.size()) != n ||
+        static_cast<size_t>(y1.size()) != n) {
+        throw py::value_error("x0, x1, y0 and y1 must have the same length");
+    }
+    vector<queryRegion> regions(n);
+    for (size_t i = 0; i < n; i++) {
+        regions[i] = {x0.data()[i], x1.data()[i], y0.data()[i], y1.data()[i]};
     }
+    return regions;
 }
 
-vector<contactRecord>
-straw(const string& matrixType, const string& norm, const string& fileName, const string& chr1loc,
-      const string& chr2loc, const string &unit, int32_t binsize) {
-    if (!(unit == "BP" || unit == "FRAG")) {
-        cerr << "Norm specified incorrectly, must be one of <BP/FRAG>" << endl;
-        cerr << "Usage: straw [observed/oe/expected] <NONE/VC/VC_SQRT/KR> <hicFile(s)> <chr1>[:x1:x2] <chr2>[:y1:y2] <BP/FRAG> <binsize>"
-             << endl;
-        vector<contactRecord> v;
-        return v;
+// aggregate peak analysis over loci given as parallel sequences; returns the pileup as a 2D numpy array and the
+// number of loci in it
+py::tuple apaPileup(const string &matrixType, const string &norm, const string &fname, const string &unit,
+                    int32_t binsize, const vector<string> &chr1, const positionArray &pos1, const vector<string> &chr2,
+                    const positionArray &pos2, int32_t window, const string &normalization, int32_t threads,
+                    queryControl *control) {
+    size_t n = chr1.size();
+    if (static_cast<size_t>(pos1.size()) != n || chr2.size() != n || static_cast<size_t>(pos2.size()) != n) {
+        throw py::value_error("chr1, pos1, chr2 and pos2 must have the same length");
     }
+    vector<apaLocus> loci(n);
+    for (size_t i = 0; i < n; i++) {
+        loci[i] = {chr1[i], pos1.data()[i], chr2[i], pos2.data()[i]};
+    }
+    apaResult pileup;
+    {
+        py::gil_scoped_release release;
+        pileup = strawApa(matrixType, norm, fname, unit, binsize, loci, window, normalization, threads, control);
+    }
+    py::array_t<double> matrix({pileup.width, pileup.width});
+    copy(pileup.matrix.begin(), pileup.matrix.end(), matrix.mutable_data());
+    return py::make_tuple(matrix, pileup.loci);
+}
 
-    HiCFile *hiCFile = new HiCFile(fileName);
-    string chr1, chr2;
-    int64_t origRegionIndices[4] = {-100LL, -100LL, -100LL, -100LL};
-    if (hiCFile->chromosomeMap[chr1].index > hiCFile->chromosomeMap[chr2].index) {
-        parsePositions((chr1loc), chr1, origRegionIndices[2], origRegionIndices[3], hiCFile->chromosomeMap);
-        parsePositions((chr2loc), chr2, origRegionIndices[0], origRegionIndices[1], hiCFile->chromosomeMap);
-    } else {
-        parsePositions((chr1loc), chr1, origRegionIndices[0], origRegionIndices[1], hiCFile->chromosomeMap);
-        parsePositions((chr2loc), chr2, origRegionIndices[2], origRegionIndices[3], hiCFile->chromosomeMap);
+// virtual 4C profiles as a list of (chromosome, float32 numpy array) pairs
+py::list viewpointProfiles(const string &matrixType, const string &norm, const string &fname, const string &chr,
+                           int64_t position, const string &unit, int32_t binsize, const vector<string> &targets,
+                           int32_t threads, queryControl *control) {
+    vector<viewpointProfile> profiles;
+    {
+        py::gil_scoped_release release;
+        profiles = strawViewpoint(matrixType, norm, fname, chr, position, targets, unit, binsize, threads, control);
+    }
+    py::list result;
+    for (const viewpointProfile &profile : profiles) {
+        py::array_t<float> values(profile.values.size());
+        copy(profile.values.begin(), profile.values.end(), values.mutable_data());
+        result.append(py::make_tuple(profile.chr, values));
     }
+    return result;
+}
 
-    MatrixZoomData *mzd = hiCFile->getMatrixZoomData(chr1, chr2, matrixType, norm, unit, binsize);
-    return mzd->getRecords(origRegionIndices[0], origRegionIndices[1], origRegionIndices[2], origRegionIndices[3]);
+// the region as a float32 numpy array, filled in place from the decoded blocks without an intermediate copy
+py::array_t<float> recordsAsMatrix(MatrixZoomData &mzd, int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                                   queryControl *control) {
+    int64_t numRows, numCols;
+    mzd.getMatrixShape(gx0, gx1, gy0, gy1, numRows, numCols);
+    py::array_t<float> matrix({numRows, numCols});
+    float *data = matrix.mutable_data();
+    bool found;
+    {
+        py::gil_scoped_release release;
+        found = mzd.fillMatrix(gx0, gx1, gy0, gy1, data, control);
+    }
+    if (!found) {
+        py::array_t<float> empty({int64_t(1), int64_t(1)});
+        *empty.mutable_data() = 0;
+        return empty;
+    }
+    return matrix;
 }
 
+// every cell of the region's expected values as a float32 numpy array, computed without reading any block
+py::array_t<float> expectedAsMatrix(MatrixZoomData &mzd, int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1) {
+    int64_t numRows, numCols;
+    mzd.getMatrixShape(gx0, gx1, gy0, gy1, numRows, numCols);
+    py::array_t<float> matrix({numRows, numCols});
+    float *data = matrix.mutable_data();
+    py::gil_scoped_release release;
+    mzd.fillExpectedMatrix(gx0, gx1, gy0, gy1, data);
+    return matrix;
+}
 
-//namespace py = pybind11;
+// the region as a scipy.sparse matrix (coo or csr) indexed from the window's origin, with intrachromosomal contacts
+// mirrored the same way getRecordsAsMatrix does
+py::object recordsAsSparse(MatrixZoomData &mzd, int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                           const string &format, queryControl *control) {
+    contactColumns cells;
+    int64_t originR = gx0 / mzd.resolution;
+    int64_t originC = gy0 / mzd.resolution;
+    int64_t numRows = gx1 / mzd.resolution - originR + 1;
+    int64_t numCols = gy1 / mzd.resolution - originC + 1;
+    {
+        py::gil_scoped_release release;
+        contactColumns columns = mzd.getRecordsAsColumns(gx0, gx1, gy0, gy1, control);
+        for (size_t i = 0; i < columns.counts.size(); i++) {
+            if (isnan(columns.counts[i]) || isinf(columns.counts[i])) continue;
+            int32_t r = static_cast<int32_t>(columns.binX[i] / mzd.resolution - originR);
+            int32_t c = static_cast<int32_t>(columns.binY[i] / mzd.resolution - originC);
+            if (mzd.isInRange(r, c, numRows, numCols)) {
+                cells.binX.push_back(r);
+                cells.binY.push_back(c);
+                cells.counts.push_back(columns.counts[i]);
+            }
+            if (mzd.isIntra) {
+                int32_t r2 = static_cast<int32_t>(columns.binY[i] / mzd.resolution - originR);
+                int32_t c2 = static_cast<int32_t>(columns.binX[i] / mzd.resolution - originC);
+                if ((r2 != r || c2 != c) && mzd.isInRange(r2, c2, numRows, numCols)) {
+                    cells.binX.push_back(r2);
+                    cells.binY.push_back(c2);
+                    cells.counts.push_back(columns.counts[i]);
+                }
+            }
+        }
+    }
+    py::tuple arrays = columnsToArrays(std::move(cells));
+    py::object coo = py::module::import("scipy.sparse").attr("coo_matrix")(
+            py::make_tuple(arrays[2], py::make_tuple(arrays[0], arrays[1])),
+            py::arg("shape") = py::make_tuple(numRows, numCols));
+    if (format == "csr") {
+        return coo.attr("tocsr")();
+    }
+    return coo;
+}
 
 PYBIND11_MODULE(strawC, m) {
 m.doc() = "Fast hybrid tool for reading .hic files; see https://github.com/aidenlab/straw for documentation";
 
-m.def("strawC", &straw, "get contact records");
+m.def("strawC", &straw, "get contact records", py::arg("matrixType"), py::arg("norm"), py::arg("fname"),
+      py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"), py::arg("control") = nullptr,
+      py::call_guard<py::gil_scoped_release>());
+m.def("strawExpected", &strawExpected, "get expected values, only where there are contacts (mode 'sparse') or for every cell ('dense', no block reads)",
+      py::arg("norm"), py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+      py::arg("mode") = "sparse", py::arg("control") = nullptr, py::call_guard<py::gil_scoped_release>());
+m.def("strawAsArrays", [](const string &matrixType, const string &norm, const string &fname, const string &chr1loc,
+                          const string &chr2loc, const string &unit, int32_t binsize, queryControl *control) {
+    contactColumns columns;
+    {
+        py::gil_scoped_release release;
+        columns = strawColumns(matrixType, norm, fname, chr1loc, chr2loc, unit, binsize, control);
+    }
+    return columnsToArrays(std::move(columns));
+}, "get contact records as (binX, binY, counts) NumPy arrays", py::arg("matrixType"), py::arg("norm"),
+      py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit"), py::arg("binsize"),
+      py::arg("control") = nullptr);
+m.def("strawRegions", [](const string &matrixType, const string &norm, const string &fname, const string &chr1,
+                         const string &chr2, const string &unit, int32_t binsize, const positionArray &x0,
+                         const positionArray &x1, const positionArray &y0, const positionArray &y1,
+                         queryControl *control) {
+    vector<queryRegion> regions = regionsFromArrays(x0, x1, y0, y1);
+    py::gil_scoped_release release;
+    return strawRegions(matrixType, norm, fname, chr1, chr2, unit, binsize, regions, control);
+}, "get contact records for each region [x0[i], x1[i]] x [y0[i], y1[i]] of chr1 x chr2", py::arg("matrixType"),
+      py::arg("norm"), py::arg("fname"), py::arg("chr1"), py::arg("chr2"), py::arg("unit"), py::arg("binsize"),
+      py::arg("x0"), py::arg("x1"), py::arg("y0"), py::arg("y1"), py::arg("control") = nullptr);
+m.def("apa", &apaPileup, "aggregate peak analysis: (pileup matrix, number of loci used)", py::arg("matrixType"),
+      py::arg("norm"), py::arg("fname"), py::arg("unit"), py::arg("binsize"), py::arg("chr1"), py::arg("pos1"),
+      py::arg("chr2"), py::arg("pos2"), py::arg("window") = 10, py::arg("normalization") = "none",
+      py::arg("threads") = 0, py::arg("control") = nullptr);
+m.def("strawBand", &strawBand, "contacts of a whole chromosome with minDistance <= |x - y| <= maxDistance",
+      py::arg("matrixType"), py::arg("norm"), py::arg("fname"), py::arg("chr"), py::arg("minDistance"),
+      py::arg("maxDistance"), py::arg("unit"), py::arg("binsize"), py::arg("control") = nullptr,
+      py::call_guard<py::gil_scoped_release>());
+m.def("viewpoint", &viewpointProfiles, "virtual 4C: [(chromosome, profile)] for the bin at chr:position",
+      py::arg("matrixType"), py::arg("norm"), py::arg("fname"), py::arg("chr"), py::arg("position"),
+      py::arg("unit"), py::arg("binsize"), py::arg("targets") = vector<string>(), py::arg("threads") = 0,
+      py::arg("control") = nullptr);
+m.def("strawExplain", &strawExplain, "what a strawC query would read, without reading any block",
+      py::arg("matrixType"), py::arg("norm"), py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"),
+      py::arg("unit"), py::arg("binsize"), py::call_guard<py::gil_scoped_release>());
+m.def("planQuery", &planQuery, "pick the finest resolution that keeps a region within a pixel and byte budget",
+      py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit") = "BP", py::arg("maxPixels") = 0,
+      py::arg("maxBytes") = 0, py::call_guard<py::gil_scoped_release>());
+m.def("strawPlanned", [](const string &matrixType, const string &norm, const string &fname, const string &chr1loc,
+                         const string &chr2loc, const string &unit, int64_t maxPixels, int64_t maxBytes,
+                         queryControl *control) {
+    queryPlan plan;
+    vector<contactRecord> records;
+    {
+        py::gil_scoped_release release;
+        records = strawPlanned(matrixType, norm, fname, chr1loc, chr2loc, unit, maxPixels, maxBytes, plan, control);
+    }
+    return py::make_tuple(records, plan);
+}, "get contact records at the resolution planQuery picks: (records, plan)", py::arg("matrixType"), py::arg("norm"),
+      py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"), py::arg("unit") = "BP", py::arg("maxPixels") = 0,
+      py::arg("maxBytes") = 0, py::arg("control") = nullptr);
+m.def("strawProgressive", [](const string &matrixType, const string &norm, const string &fname, const string &chr1loc,
+                             const string &chr2loc, const string &unit, int32_t binsize, const py::function &onChunk,
+                             int64_t maxFirstPixels, queryControl *control) {
+    py::gil_scoped_release release;
+    return strawProgressive(matrixType, norm, fname, chr1loc, chr2loc, unit, binsize, maxFirstPixels,
+                            [&onChunk](const progressiveChunk &chunk) {
+        py::gil_scoped_acquire acquire;
+        py::object more = onChunk(chunk);
+        return more.is_none() || more.cast<bool>();
+    }, control);
+}, "get contact records from coarse to fine, onChunk(chunk) getting each batch; return False from it to cancel",
+      py::arg("matrixType"), py::arg("norm"), py::arg("fname"), py::arg("chr1loc"), py::arg("chr2loc"),
+      py::arg("unit"), py::arg("binsize"), py::arg("onChunk"), py::arg("maxFirstPixels") = 0,
+      py::arg("control") = nullptr);
+m.def("setDiskCache", &setDiskCache, "cache byte ranges of remote files in a local directory",
+      py::arg("directory"), py::arg("maxBytes"));
+m.def("setLocalReadBackend", &setLocalReadBackend, "ifstream, pread or io_uring", py::arg("name"));
+m.def("setIoScheduler", &setIoScheduler, "send every block read through one scheduler with these limits",
+      py::arg("options"));
+m.def("getIoSchedulerStats", &getIoSchedulerStats, "I/O scheduler counters per priority class, interactive first");
+m.def("setHedging", &setHedging, "send a duplicate request for remote block reads slower than most",
+      py::arg("options"));
+m.def("getHedgeStats", &getHedgeStats, "counters of hedged remote reads");
+m.def("setServerSocket", &setServerSocket, "socket of the straw serve daemon strawC queries go to; '' for none",
+      py::arg("path"));
+m.def("defaultServerSocket", &defaultServerSocket,
+      "socket straw serve listens on by default: STRAW_SOCKET, or straw.sock in XDG_RUNTIME_DIR or /tmp/straw-<uid>");
+
+py::enum_<ioPriority>(m, "ioPriority")
+.value("INTERACTIVE", ioPriority::INTERACTIVE)
+.value("BATCH", ioPriority::BATCH)
+;
 
 py::class_<contactRecord>(m, "contactRecord")
 .def(py::init<>())
@@ -1247,6 +5727,88 @@ py::class_<contactRecord>(m, "contactRecord")
 .def_readwrite("counts", &contactRecord::counts)
 ;
 
+py::class_<zoomEstimate>(m, "zoomEstimate")
+.def_readonly("resolution", &zoomEstimate::resolution)
+.def_readonly("pixels", &zoomEstimate::pixels)
+.def_readonly("blocks", &zoomEstimate::blocks)
+.def_readonly("bytes", &zoomEstimate::bytes)
+.def_readonly("available", &zoomEstimate::available)
+;
+
+py::class_<queryControl>(m, "queryControl")
+.def(py::init<>())
+.def("cancel", &queryControl::cancel)
+.def("setTimeout", &queryControl::setTimeout, py::arg("milliseconds"))
+.def("expired", &queryControl::expired)
+.def("interrupted", &queryControl::interrupted)
+.def_property_readonly("blocksDecoded", [](const queryControl &control) { return control.blocksDecoded.load(); })
+.def_property_readonly("blocksSkipped", [](const queryControl &control) { return control.blocksSkipped.load(); })
+.def_property_readonly("bytesRead", [](const queryControl &control) { return control.bytesRead.load(); })
+.def_readwrite("priority", &queryControl::priority)
+;
+
+py::class_<ioSchedulerOptions>(m, "ioSchedulerOptions")
+.def(py::init<>())
+.def_readwrite("maxInFlight", &ioSchedulerOptions::maxInFlight)
+.def_readwrite("maxInteractive", &ioSchedulerOptions::maxInteractive)
+.def_readwrite("maxBatch", &ioSchedulerOptions::maxBatch)
+.def_readwrite("interactiveShare", &ioSchedulerOptions::interactiveShare)
+;
+
+py::class_<hedgeOptions>(m, "hedgeOptions")
+.def(py::init<>())
+.def_readwrite("percentile", &hedgeOptions::percentile)
+.def_readwrite("minDelayMs", &hedgeOptions::minDelayMs)
+.def_readwrite("maxExtraLoad", &hedgeOptions::maxExtraLoad)
+;
+
+py::class_<hedgeStats>(m, "hedgeStats")
+.def_readonly("reads", &hedgeStats::reads)
+.def_readonly("hedgesIssued", &hedgeStats::hedgesIssued)
+.def_readonly("hedgesWon", &hedgeStats::hedgesWon)
+.def_readonly("hedgesDenied", &hedgeStats::hedgesDenied)
+.def_readonly("delayMs", &hedgeStats::delayMs)
+;
+
+py::class_<ioClassStats>(m, "ioClassStats")
+.def_readonly("name", &ioClassStats::name)
+.def_readonly("reads", &ioClassStats::reads)
+.def_readonly("bytes", &ioClassStats::bytes)
+.def_readonly("waiting", &ioClassStats::waiting)
+.def_readonly("inFlight", &ioClassStats::inFlight)
+.def_readonly("latencyHistogram", &ioClassStats::latencyHistogram)
+.def("percentile", &ioClassStats::percentile, py::arg("q"))
+;
+
+py::class_<progressiveChunk>(m, "progressiveChunk")
+.def_readonly("resolution", &progressiveChunk::resolution)
+.def_readonly("level", &progressiveChunk::level)
+.def_readonly("levelDone", &progressiveChunk::levelDone)
+.def_readonly("finished", &progressiveChunk::finished)
+.def_readonly("records", &progressiveChunk::records)
+;
+
+py::class_<queryCost>(m, "queryCost")
+.def_readonly("resolution", &queryCost::resolution)
+.def_readonly("blocks", &queryCost::blocks)
+.def_readonly("compressedBytes", &queryCost::compressedBytes)
+.def_readonly("estimatedDecompressedBytes", &queryCost::estimatedDecompressedBytes)
+.def_readonly("estimatedRecords", &queryCost::estimatedRecords)
+.def_readonly("requests", &queryCost::requests)
+.def_readonly("coalescedRequests", &queryCost::coalescedRequests)
+.def_readonly("normVectorBytes", &queryCost::normVectorBytes)
+.def_readonly("expectedVectorBytes", &queryCost::expectedVectorBytes)
+;
+
+py::class_<queryPlan>(m, "queryPlan")
+.def_readonly("resolution", &queryPlan::resolution)
+.def_readonly("pixels", &queryPlan::pixels)
+.def_readonly("blocks", &queryPlan::blocks)
+.def_readonly("bytes", &queryPlan::bytes)
+.def_readonly("fits", &queryPlan::fits)
+.def_readonly("considered", &queryPlan::considered)
+;
+
 py::class_<chromosome>(m, "chromosome")
 .def(py::init<>())
 .def_readwrite("name", &chromosome::name)
@@ -1254,12 +5816,78 @@ py::class_<chromosome>(m, "chromosome")
 .def_readwrite("length", &chromosome::length)
 ;
 
+py::class_<prefetchOptions>(m, "prefetchOptions")
+.def(py::init<>())
+.def_readwrite("ringBlocks", &prefetchOptions::ringBlocks)
+.def_readwrite("maxBytesPerQuery", &prefetchOptions::maxBytesPerQuery)
+.def_readwrite("maxBytesPerSecond", &prefetchOptions::maxBytesPerSecond)
+.def_readwrite("cacheBytes", &prefetchOptions::cacheBytes)
+;
+
+py::class_<prefetchStats>(m, "prefetchStats")
+.def(py::init<>())
+.def_readonly("hits", &prefetchStats::hits)
+.def_readonly("misses", &prefetchStats::misses)
+.def_readonly("prefetchedBlocks", &prefetchStats::prefetchedBlocks)
+.def_readonly("prefetchedBytes", &prefetchStats::prefetchedBytes)
+.def_readonly("usefulPrefetches", &prefetchStats::usefulPrefetches)
+.def_readonly("evictions", &prefetchStats::evictions)
+.def_readonly("cachedBytes", &prefetchStats::cachedBytes)
+;
 
 py::class_<MatrixZoomData>(m, "MatrixZoomData")
 //must include the & when defining parameters that require it
 .def(py::init<chromosome &, chromosome &, string &, string &, string &, int32_t, int32_t &, int64_t &, int64_t &, string &>())
-.def("getRecords", &MatrixZoomData::getRecords)
-.def("getRecordsAsMatrix", &MatrixZoomData::getRecordsAsMatrix)
+.def("getRecords", &MatrixZoomData::getRecords, py::arg("gx0"), py::arg("gx1"), py::arg("gy0"), py::arg("gy1"),
+     py::arg("control") = nullptr, py::call_guard<py::gil_scoped_release>())
+.def("getRecordsInBand", &MatrixZoomData::getRecordsInBand, py::arg("minDistance"), py::arg("maxDistance"),
+     py::arg("control") = nullptr, py::call_guard<py::gil_scoped_release>())
+.def("getExpectedRecords", &MatrixZoomData::getExpectedRecords, py::call_guard<py::gil_scoped_release>())
+.def("getExpectedMatrix", &expectedAsMatrix)
+.def("explain", &MatrixZoomData::explain, py::call_guard<py::gil_scoped_release>())
+.def("getViewpointProfile", [](MatrixZoomData &mzd, int32_t index, int64_t position, queryControl *control) {
+    vector<float> profile;
+    {
+        py::gil_scoped_release release;
+        profile = mzd.getViewpointProfile(index, position, control);
+    }
+    py::array_t<float> values(profile.size());
+    copy(profile.begin(), profile.end(), values.mutable_data());
+    return values;
+}, py::arg("index"), py::arg("position"), py::arg("control") = nullptr)
+.def("getRecordsAsMatrix", &recordsAsMatrix, py::arg("gx0"), py::arg("gx1"), py::arg("gy0"), py::arg("gy1"),
+     py::arg("control") = nullptr)
+.def("getRecordsAsArrays", [](MatrixZoomData &mzd, int64_t gx0, int64_t gx1, int64_t gy0, int64_t gy1,
+                              queryControl *control) {
+    contactColumns columns;
+    {
+        py::gil_scoped_release release;
+        columns = mzd.getRecordsAsColumns(gx0, gx1, gy0, gy1, control);
+    }
+    return columnsToArrays(std::move(columns));
+}, py::arg("gx0"), py::arg("gx1"), py::arg("gy0"), py::arg("gy1"), py::arg("control") = nullptr)
+.def("getRecordsForRegions", [](MatrixZoomData &mzd, const positionArray &x0, const positionArray &x1,
+                                const positionArray &y0, const positionArray &y1, queryControl *control) {
+    vector<queryRegion> regions = regionsFromArrays(x0, x1, y0, y1);
+    vector<contactColumns> columns;
+    {
+        py::gil_scoped_release release;
+        columns = mzd.getRecordsForRegionsAsColumns(regions, control);
+    }
+    py::list arrays;
+    for (contactColumns &region : columns) {
+        arrays.append(columnsToArrays(std::move(region)));
+    }
+    return arrays;
+}, "(binX, binY, counts) NumPy arrays for each region [x0[i], x1[i]] x [y0[i], y1[i]], reading shared blocks once",
+   py::arg("x0"), py::arg("x1"), py::arg("y0"), py::arg("y1"), py::arg("control") = nullptr)
+.def("getRecordsAsSparse", &recordsAsSparse, py::arg("gx0"), py::arg("gx1"), py::arg("gy0"), py::arg("gy1"),
+     py::arg("format") = "coo", py::arg("control") = nullptr)
+.def("setIoPriority", &MatrixZoomData::setIoPriority, py::arg("priority"))
+.def("setBlockCacheSize", &MatrixZoomData::setBlockCacheSize)
+.def("enablePrefetch", &MatrixZoomData::enablePrefetch)
+.def("disablePrefetch", &MatrixZoomData::disablePrefetch)
+.def("getPrefetchStats", &MatrixZoomData::getPrefetchStats)
 ;
 
 
@@ -28,6 +28,10 @@
 #include <set>
 #include <vector>
 #include <map>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
 
 // pointer structure for reading blocks or matrices, holds the size and position
 struct indexEntry {
@@ -37,9 +41,67 @@ struct indexEntry {
 
 // sparse matrixType entry
 struct contactRecord {
-    int32_t binX;
-    int32_t binY;
-    float counts;
+  int32_t binX;
+  int32_t binY;
+  float counts;
+};
+
+// the same records as a vector<contactRecord>, one contiguous column per field
+struct contactColumns {
+    std::vector<int32_t> binX;
+    std::vector<int32_t> binY;
+    std::vector<float> counts;
+};
+
+// a rectangle [x0, x1] x [y0, y1] in genomic coordinates, inclusive
+struct queryRegion {
+    int64_t x0;
+    int64_t x1;
+    int64_t y0;
+    int64_t y1;
+};
+
+// one line of a BEDPE file: [start1, end1) on chr1 by [start2, end2) on chr2
+struct bedpeInterval {
+    std::string chr1;
+    int64_t start1;
+    int64_t end1;
+    std::string chr2;
+    int64_t start2;
+    int64_t end2;
+};
+
+// what strawBedpe extracts for one interval, oriented like its BEDPE line whichever way round the chromosome pair is
+// stored: binX and the rows are on chr1, binY and the columns on chr2. only the field for the chosen output is
+// filled: records, the sum of the finite counts, or a numRows x numCols row-major matrix with one cell per bin
+struct bedpeResult {
+    size_t index = 0; // position of the interval in the list given to strawBedpe
+    std::vector<contactRecord> records;
+    double sum = 0;
+    int64_t numRows = 0;
+    int64_t numCols = 0;
+    std::vector<float> matrix;
+};
+
+// a loop for aggregate peak analysis, with anchors at pos1 on chr1 and pos2 on chr2
+struct apaLocus {
+    std::string chr1;
+    int64_t pos1;
+    std::string chr2;
+    int64_t pos2;
+};
+
+// the pileup of the loci: a width x width row-major matrix summed over loci, and how many loci went into it
+struct apaResult {
+    int64_t width = 0;
+    std::vector<double> matrix;
+    int64_t loci = 0;
+};
+
+// a virtual 4C profile against one chromosome: values[b] is the viewpoint's contact with bin b of chr
+struct viewpointProfile {
+    std::string chr;
+    std::vector<float> values;
 };
 
 // chromosome
@@ -49,6 +111,178 @@ struct chromosome {
     int64_t length;
 };
 
+// knobs for the read-ahead prefetcher on MatrixZoomData
+struct prefetchOptions {
+    int32_t ringBlocks = 1;                     // blocks to load beyond the last query in every direction
+    int64_t maxBytesPerQuery = 32LL << 20;      // compressed bytes fetched ahead of any single query
+    int64_t maxBytesPerSecond = 0;              // bandwidth cap for read-ahead, 0 for none
+    int64_t cacheBytes = 256LL << 20;           // memory budget of the decompressed block cache
+};
+
+// block cache and prefetcher counters, for tuning prefetchOptions
+struct prefetchStats {
+    int64_t hits = 0;                   // blocks a query found in the cache
+    int64_t misses = 0;                 // blocks a query had to read itself
+    int64_t prefetchedBlocks = 0;       // blocks read ahead of time
+    int64_t prefetchedBytes = 0;        // compressed bytes read ahead of time
+    int64_t usefulPrefetches = 0;       // prefetched blocks a later query actually used
+    int64_t evictions = 0;
+    int64_t cachedBytes = 0;
+};
+
+// what reading a region at one resolution would take: its pixels, and the blocks it touches with their compressed
+// size. blocks and bytes are -1 for a resolution that was ruled out on pixels alone, or that the file lists but
+// doesn't store for the pair, which is then not available
+struct zoomEstimate {
+    int32_t resolution = 0;
+    int64_t pixels = 0;
+    int64_t blocks = -1;
+    int64_t bytes = -1;
+    bool available = true;
+};
+
+// the resolution planQuery picked for a region and what it costs. fits is false when even the coarsest available
+// resolution is over budget, which is then picked anyway; resolution is 0 if the query could not be planned, the
+// pair or every resolution of it missing from the file. considered lists
+// every resolution looked at, coarsest first
+struct queryPlan {
+    int32_t resolution = 0;
+    int64_t pixels = 0;
+    int64_t blocks = 0;
+    int64_t bytes = 0;
+    bool fits = false;
+    std::vector<zoomEstimate> considered;
+};
+
+// what a query would read, from MatrixZoomData::explain. straw reads each block with a request of its own;
+// coalescedRequests is how many reads are left once blocks adjacent in the file are merged. the vector sizes are
+// those of the normalization and expected vectors the matrix needs, as stored in the file
+struct queryCost {
+    int32_t resolution = 0;
+    int64_t blocks = 0;
+    int64_t compressedBytes = 0;
+    int64_t estimatedDecompressedBytes = 0;
+    int64_t estimatedRecords = 0;
+    int64_t requests = 0;
+    int64_t coalescedRequests = 0;
+    int64_t normVectorBytes = 0;
+    int64_t expectedVectorBytes = 0;
+};
+
+// one step of strawProgressive: the records of the region at one resolution from a batch of blocks, in genomic
+// coordinates. level counts the resolutions from the coarsest queried, levelDone marks the last batch of a
+// resolution and finished the last batch of all
+struct progressiveChunk {
+    int32_t resolution = 0;
+    int32_t level = 0;
+    bool levelDone = false;
+    bool finished = false;
+    std::vector<contactRecord> records;
+};
+
+// priority classes of the shared I/O scheduler: a waiting interactive read goes ahead of batch reads queued before it
+enum class ioPriority { INTERACTIVE, BATCH };
+
+// limits of the shared I/O scheduler, see setIoScheduler. a class cap of 0 leaves that class limited by maxInFlight only
+struct ioSchedulerOptions {
+    int32_t maxInFlight = 16;           // block reads running at once across all classes, 0 turns the scheduler off
+    int32_t maxInteractive = 16;        // interactive reads running at once
+    int32_t maxBatch = 4;               // batch reads running at once
+    int32_t interactiveShare = 8;       // slots waiting interactive reads get for every one a waiting batch read gets,
+                                        // 0 for strict priority
+};
+
+// block reads of one priority class since the scheduler was last configured. latencyHistogram[b] counts the reads
+// that took under 2^(b+1) microseconds, and at least 2^b for b > 0, from being queued to completing
+struct ioClassStats {
+    std::string name;
+    int64_t reads = 0;
+    int64_t bytes = 0;
+    int64_t waiting = 0;                // reads queued for a slot right now
+    int64_t inFlight = 0;               // reads running right now
+    std::vector<int64_t> latencyHistogram;
+
+    // upper bound in microseconds of the latency within which a fraction q of the reads completed, 0 without reads
+    int64_t percentile(double q) const {
+        int64_t total = 0;
+        for (int64_t count : latencyHistogram) {
+            total += count;
+        }
+        int64_t seen = 0;
+        for (size_t b = 0; b < latencyHistogram.size(); b++) {
+            seen += latencyHistogram[b];
+            if (total > 0 && seen >= q * total) {
+                return int64_t(2) << b;
+            }
+        }
+        return 0;
+    }
+};
+
+// hedged reads of the blocks of remote files, see setHedging
+struct hedgeOptions {
+    double percentile = 0.95;       // a block read still running past this percentile of recent block read latencies
+                                    // gets a duplicate request, 0 turns hedging off
+    int64_t minDelayMs = 50;        // never hedge sooner, and the delay used until enough latencies are known
+    double maxExtraLoad = 0.05;     // duplicate requests as a fraction of block reads, at most
+};
+
+// counters of hedged reads since hedging was last configured
+struct hedgeStats {
+    int64_t reads = 0;              // remote block reads
+    int64_t hedgesIssued = 0;       // duplicate requests sent
+    int64_t hedgesWon = 0;          // duplicates that answered before the request they duplicated
+    int64_t hedgesDenied = 0;       // reads past the delay left without a duplicate by maxExtraLoad
+    int64_t delayMs = 0;            // how long a read runs before it is hedged, right now
+};
+
+// what a straw serve daemon keeps in memory between queries
+struct serveOptions {
+    int32_t maxMatrices = 64;               // matrices kept open, with their footer entries, norm and expected vectors
+    int64_t blockCacheBytes = 1LL << 30;    // decompressed blocks kept, split evenly between the open matrices
+    int32_t maxConnections = 64;            // clients served at once; past it, new clients run their queries themselves
+};
+
+// a query that failed on a straw serve daemon, thrown by straw() in the client. status is the exit status the query
+// would have ended the process with had it run there
+struct serveError : public std::runtime_error {
+    int32_t status;
+
+    serveError(int32_t status, const std::string &message) : std::runtime_error(message), status(status) {}
+};
+
+// stops a query when cancel() is called from another thread or once its deadline passes, and counts how far it got.
+// queries check it between block reads and between block decodes and abort remote reads in flight; a stopped query
+// returns what it had decoded, and interrupted() tells it apart from one that finished. one control can be shared by
+// the threads of a bulk query or by several queries that should stop together
+struct queryControl {
+    std::atomic<bool> cancelled{false};
+    // atomic so that setTimeout can move it while a query on another thread is checking it
+    std::atomic<std::chrono::steady_clock::time_point> deadline{std::chrono::steady_clock::time_point::max()};
+    std::atomic<int64_t> blocksDecoded{0};
+    std::atomic<int64_t> blocksSkipped{0};     // blocks needed but not read or not decoded because of the stop
+    std::atomic<int64_t> bytesRead{0};         // compressed bytes of the blocks read
+    ioPriority priority = ioPriority::INTERACTIVE;  // class of the query's block reads under the I/O scheduler;
+                                                    // strawGenome, strawBedpe and strawApa always read as batch
+
+    void cancel() {
+        cancelled = true;
+    }
+
+    // sets the deadline this many milliseconds from now
+    void setTimeout(int64_t milliseconds) {
+        deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(milliseconds);
+    }
+
+    bool expired() const {
+        return cancelled || std::chrono::steady_clock::now() >= deadline.load();
+    }
+
+    bool interrupted() const {
+        return blocksSkipped > 0;
+    }
+};
+
 // this is for creating a stream from a byte array for ease of use
 // see https://stackoverflow.com/questions/41141175/how-to-implement-seekg-seekpos-on-an-in-memory-buffer
 struct membuf : std::streambuf {
@@ -68,8 +302,8 @@ struct memstream : virtual membuf, std::istream {
     }
 
     std::istream::pos_type seekoff(std::istream::off_type off,
-                                   std::ios_base::seekdir dir,
-                                   std::ios_base::openmode which = std::ios_base::in) override {
+                                    std::ios_base::seekdir dir,
+                                    std::ios_base::openmode which = std::ios_base::in) override {
         if (dir == std::ios_base::cur)
             gbump(off);
         else if (dir == std::ios_base::end)
@@ -88,17 +322,145 @@ struct MemoryStruct {
 
 std::map<int32_t, indexEntry>
 readMatrixZoomData(std::istream &fin, const std::string &myunit, int32_t mybinsize, float &mySumCounts,
-                   int32_t &myBlockBinCount,
+                   float &myOccupiedCellCount, int32_t &myBlockBinCount,
                    int32_t &myBlockColumnCount, bool &found);
 
 std::map<int32_t, indexEntry>
-readMatrix(std::istream &fin, int32_t myFilePosition, std::string unit, int32_t resolution, float &mySumCounts,
-           int32_t &myBlockBinCount, int32_t &myBlockColumnCount);
+readMatrix(std::istream &fin, int64_t myFilePosition, const std::string &unit, int32_t resolution, float &mySumCounts,
+           float &myOccupiedCellCount, int32_t &myBlockBinCount, int32_t &myBlockColumnCount);
 
 std::vector<double> readNormalizationVector(std::istream &fin, indexEntry entry);
 
+// opt-in on-disk cache for byte ranges read from remote files; an empty directory or zero size disables it
+void setDiskCache(const std::string &directory, int64_t maxBytes);
+
+// how blocks are read from local files: "ifstream" (default), "pread" or "io_uring"
+void setLocalReadBackend(const std::string &name);
+
+// sends the block reads of every file in the process through one scheduler with these limits, so bulk queries can't
+// starve interactive ones of disk or network. off until called; maxInFlight 0 turns it off again
+void setIoScheduler(const ioSchedulerOptions &options);
+
+// counters of the I/O scheduler, one per priority class, interactive first
+std::vector<ioClassStats> getIoSchedulerStats();
+
+// sends a duplicate range request for a block of a remote file whose read is slower than most, and keeps whichever
+// answer comes first. off unless called or STRAW_HEDGE_PERCENTILE is set (e.g. 95); blocks read through the disk
+// cache are not hedged
+void setHedging(const hedgeOptions &options);
+
+hedgeStats getHedgeStats();
+
+// runs a query daemon on a Unix domain socket until SIGINT or SIGTERM. straw() in processes of the same user that
+// point STRAW_SOCKET (or setServerSocket) at it sends its queries there, and the daemon answers them from the files,
+// matrices and blocks it has cached. returns the process exit status
+int strawServe(const std::string &socketPath, const serveOptions &options);
+
+// the socket strawServe listens on unless told otherwise: STRAW_SOCKET if set, otherwise straw.sock in
+// $XDG_RUNTIME_DIR, or in /tmp/straw-<uid>, a directory only the user can enter
+std::string defaultServerSocket();
+
+// points straw() at the daemon on this socket, in place of STRAW_SOCKET; an empty path makes every query run in this
+// process. a daemon owned by another user is never sent a query, and one that answers with an error makes straw()
+// throw a serveError
+void setServerSocket(const std::string &path);
+
+// the queries below take an optional queryControl to cancel them or give them a deadline
 std::vector<contactRecord>
 straw(const std::string& matrixType, const std::string& norm, const std::string& fname, const std::string& chr1loc, const std::string& chr2loc,
-      const std::string &unit, int32_t binsize);
+      const std::string &unit, int32_t binsize, queryControl *control = nullptr);
+
+contactColumns
+strawColumns(const std::string& matrixType, const std::string& norm, const std::string& fname, const std::string& chr1loc,
+             const std::string& chr2loc, const std::string &unit, int32_t binsize, queryControl *control = nullptr);
+
+// a dry run of straw: what the query would read, without reading any block
+queryCost
+strawExplain(const std::string& matrixType, const std::string& norm, const std::string& fname,
+             const std::string& chr1loc, const std::string& chr2loc, const std::string &unit, int32_t binsize);
+
+// straw with matrixType "expected". mode "sparse" gives today's records: the expected values at the cells that have
+// contacts, which takes reading the blocks to find them. "dense" gives every cell of the region, worked out from the
+// expected vector (or the average count between chromosomes) without reading any block
+std::vector<contactRecord>
+strawExpected(const std::string& norm, const std::string& fname, const std::string& chr1loc,
+              const std::string& chr2loc, const std::string &unit, int32_t binsize, const std::string &mode,
+              queryControl *control = nullptr);
+
+// the records of each region between chromosomes chr1 and chr2, opening the file once and reading each block once
+std::vector<std::vector<contactRecord>>
+strawRegions(const std::string& matrixType, const std::string& norm, const std::string& fname, const std::string& chr1,
+             const std::string& chr2, const std::string &unit, int32_t binsize,
+             const std::vector<queryRegion> &regions, queryControl *control = nullptr);
+
+// the contacts of chromosome chr whose genomic distance |x - y| is between minDistance and maxDistance inclusive,
+// over the whole chromosome. only the blocks that can hold such contacts are read
+std::vector<contactRecord>
+strawBand(const std::string &matrixType, const std::string &norm, const std::string &fname, const std::string &chr,
+          int64_t minDistance, int64_t maxDistance, const std::string &unit, int32_t binsize,
+          queryControl *control = nullptr);
+
+// the intervals of a BEDPE file; comment, track and browser lines and lines that don't parse (headers) are skipped
+std::vector<bedpeInterval> readBedpe(std::istream &in);
+
+// extracts every interval with output "records", "sum" or "dense", opening each chromosome pair once and reading
+// the blocks that neighbouring intervals share once. pairs are processed on up to threads threads (0 for one per
+// core) and onResult is called, one call at a time, as the results of each batch of intervals are ready, so not in
+// the order of the list
+void strawBedpe(const std::string &matrixType, const std::string &norm, const std::string &fname,
+                const std::string &unit, int32_t binsize, const std::vector<bedpeInterval> &intervals,
+                const std::string &output, int32_t threads,
+                const std::function<void(const bedpeResult &)> &onResult, queryControl *control = nullptr);
+
+// aggregate peak analysis: sums the (2 * window + 1) bins square around each locus, centered on the anchor bins, over
+// all loci. with normalization "sum" each locus's square is divided by its total first (loci with none are left
+// out); "none" adds the raw values. squares have their rows on chr1 of the locus and columns on chr2, whichever way
+// round the pair is stored. loci are grouped and batched like strawBedpe and each of up to threads threads (0 for one
+// per core) keeps its own sum, added up at the end. a stopped control leaves out the loci it cut short, and
+// result.loci counts only those that were read in full
+apaResult strawApa(const std::string &matrixType, const std::string &norm, const std::string &fname,
+                   const std::string &unit, int32_t binsize, const std::vector<apaLocus> &loci, int32_t window,
+                   const std::string &normalization, int32_t threads, queryControl *control = nullptr);
+
+// every chromosome pair of the file, whole, at one resolution. pairs are listed from the footer, read on up to
+// threads threads (0 for one per core), and handed to onRecords(chr1, chr2, records) in chunks of about a million
+// records in genomic coordinates, one call at a time. unordered, the biggest pairs start first and chunks come out
+// as they are ready; ordered, pairs come out one after the other in chromosome order, with at most
+// maxBufferedBytes of later pairs' records held back. either way memory stays bounded by the threads and the buffer,
+// not by the size of the genome
+void strawGenome(const std::string &matrixType, const std::string &norm, const std::string &fname,
+                 const std::string &unit, int32_t binsize, int32_t threads, bool ordered, int64_t maxBufferedBytes,
+                 const std::function<void(const std::string &, const std::string &, const contactColumns &)> &onRecords,
+                 queryControl *control = nullptr);
+
+// virtual 4C: the contacts of the bin at position on chr with every bin of each target chromosome (all of them when
+// targets is empty, chr itself included), as dense profiles. the targets are read in parallel on up to threads
+// threads (0 for one per core); unknown targets get an empty profile
+std::vector<viewpointProfile>
+strawViewpoint(const std::string &matrixType, const std::string &norm, const std::string &fname, const std::string &chr,
+               int64_t position, const std::vector<std::string> &targets, const std::string &unit, int32_t binsize,
+               int32_t threads, queryControl *control = nullptr);
+
+// the finest BP resolution at which the region (chr1loc x chr2loc, as for straw) stays within maxPixels pixels and
+// maxBytes compressed bytes of blocks; 0 lifts either limit. sized from the footer and the block indexes alone,
+// without reading a block
+queryPlan planQuery(const std::string &fname, const std::string &chr1loc, const std::string &chr2loc,
+                    const std::string &unit, int64_t maxPixels, int64_t maxBytes);
+
+// straw at the resolution planQuery picks, which is left in plan
+std::vector<contactRecord>
+strawPlanned(const std::string &matrixType, const std::string &norm, const std::string &fname,
+             const std::string &chr1loc, const std::string &chr2loc, const std::string &unit, int64_t maxPixels,
+             int64_t maxBytes, queryPlan &plan, queryControl *control = nullptr);
+
+// straw for interactive viewers: the region at the file's BP resolutions from coarse to fine down to binsize, each
+// resolution read a batch of blocks at a time and handed to onChunk as soon as it is decoded. the first resolution is
+// the finest whose region fits in maxFirstPixels pixels (the coarsest when none does, or when maxFirstPixels is 0),
+// so the first answer is cheap. returning false from onChunk cancels the rest, e.g. when the viewport moves; the
+// result is false if the query was cancelled
+bool strawProgressive(const std::string &matrixType, const std::string &norm, const std::string &fname,
+                      const std::string &chr1loc, const std::string &chr2loc, const std::string &unit, int32_t binsize,
+                      int64_t maxFirstPixels, const std::function<bool(const progressiveChunk &)> &onChunk,
+                      queryControl *control = nullptr);
 
 #endif